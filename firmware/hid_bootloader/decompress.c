@@ -0,0 +1,116 @@
+/*
+ * decompress.c
+ *
+ * Page decoders for compressed and patched page transfers. There isn't enough RAM for a second
+ * page buffer on small parts, so pages are decoded in place.
+ *
+ */
+
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdbool.h>
+#include <string.h>
+#include "decompress.h"
+
+
+/**************************************************************************************************
+* Decompress a page in place. The compressed data is received at the start of the buffer, moved to
+* the end and then decoded back to the start. The host only sends pages where the output never
+* overtakes the input. Returns false if the data is corrupt.
+*/
+bool DCMP_DecompressPage(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length)
+{
+	if ((length == 0) || (length > buffer_size))
+		return false;
+
+	uint8_t *in = buffer + buffer_size - length;
+	uint8_t *in_end = buffer + buffer_size;
+	uint8_t *out = buffer;
+	uint8_t *out_end = buffer + page_size;
+	memmove(in, buffer, length);
+
+	while (in < in_end)
+	{
+		uint8_t token = *in++;
+		uint8_t count;
+
+		if (token < 0x80)		// literal run
+		{
+			count = token + 1;
+			if ((in + count > in_end) || (out + count > out_end))
+				return false;
+			while (count--)
+				*out++ = *in++;
+		}
+		else					// match
+		{
+			if (in >= in_end)
+				return false;
+			count = (token & 0x7F) + DCMP_MATCH_MIN;
+			uint16_t offset = *in++ + 1;
+			if ((offset > (uint16_t)(out - buffer)) || (out + count > out_end))
+				return false;
+			uint8_t *src = out - offset;
+			while (count--)		// byte by byte, overlapping matches repeat the pattern
+				*out++ = *src++;
+		}
+
+		if (out > in)			// overwrote unread input
+			return false;
+	}
+
+	return (out == out_end);
+}
+
+/**************************************************************************************************
+* Rebuild a page in place from a patch of literal data and copies of existing application flash.
+* A length of zero means the buffer already holds the page. Must not be called while the NVM
+* controller is busy, because flash can't be read during a write. Returns false if the patch is
+* corrupt.
+*/
+bool DCMP_PatchPage(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length)
+{
+	if (length == 0)
+		return true;
+	if (length > buffer_size)
+		return false;
+
+	uint8_t *in = buffer + buffer_size - length;
+	uint8_t *in_end = buffer + buffer_size;
+	uint8_t *out = buffer;
+	uint8_t *out_end = buffer + page_size;
+	memmove(in, buffer, length);
+
+	while (in < in_end)
+	{
+		uint8_t token = *in++;
+		uint16_t count;
+
+		if (token < 0x80)		// literal run
+		{
+			count = token + 1;
+			if ((in + count > in_end) || (out + count > out_end))
+				return false;
+			while (count--)
+				*out++ = *in++;
+		}
+		else					// copy from flash
+		{
+			if (in + 4 > in_end)
+				return false;
+			count = (((uint16_t)(token & 0x7F) << 8) | in[0]) + 1;
+			uint32_t addr = in[1] | ((uint32_t)in[2] << 8) | ((uint32_t)in[3] << 16);
+			in += 4;
+			if ((out + count > out_end) || (addr + count > APP_SECTION_SIZE))
+				return false;
+			memcpy_PF(out, APP_SECTION_START + addr, count);
+			out += count;
+		}
+
+		if (out > in)			// overwrote unread input
+			return false;
+	}
+
+	return (out == out_end);
+}
@@ -0,0 +1,32 @@
+/*
+ * decompress.h
+ *
+ */
+
+
+#ifndef DECOMPRESS_H_
+#define DECOMPRESS_H_
+
+
+/* Compressed page format, a sequence of tokens:
+ *   0x00-0x7F	literal run, token+1 bytes follow
+ *   0x80-0xFF	match, (token&0x7F)+3 bytes copied from offset (next byte)+1 bytes back in the page
+ */
+#define DCMP_LITERAL_MAX			128
+#define DCMP_MATCH_MIN				3
+#define DCMP_MATCH_MAX				130
+#define DCMP_WINDOW_SIZE			256
+
+/* Patch format, a sequence of tokens:
+ *   0x00-0x7F	literal run, token+1 bytes follow
+ *   0x80-0xFF	copy, ((token&0x7F)<<8 | next byte)+1 bytes from the 24 bit flash address in the
+ *				following three bytes (little endian)
+ */
+#define DCMP_COPY_MAX				32768
+
+
+extern bool DCMP_DecompressPage(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length);
+extern bool DCMP_PatchPage(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length);
+
+
+#endif /* DECOMPRESS_H_ */
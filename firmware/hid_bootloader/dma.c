@@ -0,0 +1,82 @@
+/*
+ * dma.c
+ *
+ * DMA service. The CRC module is fed from memory in bursts, without the CPU loading and storing
+ * each byte. The CPU waits for the result, there is nothing else for it to do during a command.
+ * The DMA controller can only reach data memory, so flash and the signature rows are still read
+ * with LPM. EEPROM must be memory mapped.
+ *
+ */
+
+
+#include <avr/io.h>
+#include <stdbool.h>
+#include "dma.h"
+
+
+static uint8_t	crc_sink;		// fixed destination for CRC transfers, the data is only wanted by the CRC module
+
+
+/**************************************************************************************************
+** Start a software triggered block transfer within data memory
+*/
+static void dma_start(volatile DMA_CH_t *ch, void *dest, const void *src, uint16_t size, uint8_t addrctrl)
+{
+	ch->CTRLA = 0;
+	ch->CTRLB = DMA_CH_ERRIF_bm | DMA_CH_TRNIF_bm;		// clear flags
+	ch->ADDRCTRL = addrctrl;
+	ch->TRIGSRC = DMA_CH_TRIGSRC_OFF_gc;
+	ch->TRFCNT = size;
+
+	ch->SRCADDR0 = (uint16_t)src & 0xFF;
+	ch->SRCADDR1 = (uint16_t)src >> 8;
+	ch->SRCADDR2 = 0;
+	ch->DESTADDR0 = (uint16_t)dest & 0xFF;
+	ch->DESTADDR1 = (uint16_t)dest >> 8;
+	ch->DESTADDR2 = 0;
+
+	// a single trigger moves the whole block, the channel disables itself when done
+	ch->CTRLA = DMA_CH_ENABLE_bm | DMA_CH_BURSTLEN_8BYTE_gc;
+	ch->CTRLA |= DMA_CH_TRFREQ_bm;
+}
+
+/**************************************************************************************************
+** Wait for a channel to finish. Returns immediately if it was never started.
+*/
+static void dma_wait(volatile DMA_CH_t *ch)
+{
+	while (ch->CTRLA & DMA_CH_ENABLE_bm)
+		;
+}
+
+/**************************************************************************************************
+** Reset and enable the DMA controller
+*/
+void DMA_init(void)
+{
+	DMA.CTRL = 0;
+	DMA.CTRL = DMA_RESET_bm;
+	while (DMA.CTRL & DMA_RESET_bm)
+		;
+	DMA.CTRL = DMA_ENABLE_bm;
+}
+
+/**************************************************************************************************
+** CRC-32 of a block of data memory, computed by the CRC module as the DMA controller moves it
+*/
+uint32_t DMA_CRC32(const void *src, uint16_t size)
+{
+	CRC.CTRL = CRC_RESET_RESET1_gc;
+	CRC.CTRL = CRC_CRC32_bm | DMA_CRC_SOURCE_gc;
+
+	dma_start(&DMA_CH_CRC, &crc_sink, src, size,
+			  DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc);
+	dma_wait(&DMA_CH_CRC);
+
+	// the CRC module stops when the transfer completes
+	while (CRC.STATUS & CRC_BUSY_bm)
+		;
+	uint32_t crc = CRC.CHECKSUM0 | ((uint32_t)CRC.CHECKSUM1 << 8) | ((uint32_t)CRC.CHECKSUM2 << 16) | ((uint32_t)CRC.CHECKSUM3 << 24);
+	CRC.CTRL = CRC_SOURCE_DISABLE_gc;
+	return crc;
+}
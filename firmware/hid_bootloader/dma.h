@@ -0,0 +1,23 @@
+/*
+ * dma.h
+ *
+ */
+
+
+#ifndef DMA_H_
+#define DMA_H_
+
+
+// channel allocation
+#define	DMA_CH_CRC					DMA.CH0			// memory to the CRC module
+#define	DMA_CRC_SOURCE_gc			CRC_SOURCE_DMAC0_gc
+
+// transfers move 8 byte bursts, sizes must be a multiple of this
+#define	DMA_BURST_SIZE				8
+
+
+extern void DMA_init(void);
+extern uint32_t DMA_CRC32(const void *src, uint16_t size)	__attribute__((nonnull));
+
+
+#endif /* DMA_H_ */
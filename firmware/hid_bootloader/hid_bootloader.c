@@ -12,8 +12,26 @@
 #include "eeprom.h"
 #include "sp_driver.h"
 #include "protocol.h"
-
-#define BOOTLOADER_VERSION	1
+#include "decompress.h"
+#include "serial_num.h"
+#include "dma.h"
+
+#define BOOTLOADER_VERSION	2
+
+// NVM timing hints for CMD_READ_CAPABILITIES, from the XMEGA A datasheets
+#define	NVM_PAGE_WRITE_MS			4
+#define	NVM_PAGE_ERASE_WRITE_MS		8
+#define	NVM_EEPROM_WRITE_MS			8
+#define	NVM_APP_ERASE_MS			40
+
+// Bootloader entry requests, checked at reset before the application is validated. Without one the
+// application is started if the boot record in the user signature row matches it. Keep at least one
+// hardware entry enabled, otherwise an application without the magic word can only be replaced
+// over PDI.
+#define	BOOT_REQUEST_ADDR	(RAMEND - 3)	// BOOT_REQUEST_MAGIC from the application
+//#define	BOOT_CHECK_VUSB					// stay in the bootloader while VUSB (PD5) is present
+#define	BOOT_PIN_PORT		PORTE			// stay in the bootloader while this pin is held low
+#define	BOOT_PIN_bm			PIN0_bm
 
 typedef void (*AppPtr)(void) __attribute__ ((noreturn));
 
@@ -39,9 +57,140 @@ typedef struct
 
 uint8_t		page_buffer[APP_SECTION_PAGE_SIZE + UDI_HID_REPORT_OUT_SIZE];	// needed size + safety buffer
 uint16_t	page_ptr = 0;
+uint8_t		in_seq = 0;					// number of the last IN report queued
+
+uint32_t	boot_request __attribute__((section(".noinit")));
+
+const CAPABILITIES_t capabilities = {
+	.caps_version = CAPS_VERSION,
+	.bootloader_version = BOOTLOADER_VERSION,
+	.features = CAP_BLANK_CHECK | CAP_BOOT_RECORD | CAP_EEPROM | CAP_USER_SIG_ROW | CAP_NVM_WAIT | CAP_TAGGED,
+	.encodings = ENC_RAW | ENC_COMPRESSED | ENC_FILL | ENC_PATCH,
+	.page_buffers = 2,				// RAM page buffer and the NVM controller's
+	.max_batch = FILL_BATCH_PAGES,
+	.in_queue = UDI_HID_GENERIC_REPORT_IN_QUEUE,
+	.page_size = APP_SECTION_PAGE_SIZE,
+	.app_section_size = APP_SECTION_SIZE,
+	.eeprom_size = EEPROM_SIZE,
+	.eeprom_page_size = EEPROM_PAGE_SIZE,
+	.page_write_ms = NVM_PAGE_WRITE_MS,
+	.page_erase_write_ms = NVM_PAGE_ERASE_WRITE_MS,
+	.eeprom_write_ms = NVM_EEPROM_WRITE_MS,
+	.app_erase_ms = NVM_APP_ERASE_MS,
+};
 
 //uint8_t		feature_response[5];
 
+/**************************************************************************************************
+* Copy the entry request word before anything is pushed to the stack, like avr-libc's MCUSR example.
+* Calling main() pushes its return address over the top of SRAM, so the request doesn't survive into
+* the next reset.
+*/
+void BOOT_CaptureRequest(void) __attribute__((naked, used, section(".init3")));
+void BOOT_CaptureRequest(void)
+{
+	boot_request = *(volatile uint32_t *)BOOT_REQUEST_ADDR;
+}
+
+/**************************************************************************************************
+* Check for a request to stay in the bootloader
+*/
+bool BOOT_Requested(void)
+{
+	if (boot_request == BOOT_REQUEST_MAGIC)
+		return true;
+
+#ifdef BOOT_PIN_PORT
+	BOOT_PIN_PORT.DIRCLR = BOOT_PIN_bm;
+	PORTCFG.MPCMASK = BOOT_PIN_bm;
+	BOOT_PIN_PORT.PIN0CTRL = PORT_OPC_PULLUP_gc;
+	_delay_ms(1);
+	if (!(BOOT_PIN_PORT.IN & BOOT_PIN_bm))
+		return true;
+#endif
+
+#ifdef BOOT_CHECK_VUSB
+	PORTD.DIRCLR = PIN5_bm;
+	PORTD.PIN5CTRL = (PORTD.PIN5CTRL & ~PORT_OPC_gm) | PORT_OPC_PULLDOWN_gc;
+	_delay_ms(1);
+	if (PORTD.IN & PIN5_bm)		// connected to USB
+		return true;
+#endif
+
+	return false;
+}
+
+/**************************************************************************************************
+* NVM flash range CRC, end address inclusive
+*/
+uint32_t BOOT_RangeCRC(uint32_t start, uint32_t end)
+{
+	SP_WaitForSPM();
+	NVM.ADDR0 = start & 0xFF;
+	NVM.ADDR1 = (start >> 8) & 0xFF;
+	NVM.ADDR2 = (start >> 16) & 0xFF;
+	NVM.DATA0 = end & 0xFF;
+	NVM.DATA1 = (end >> 8) & 0xFF;
+	NVM.DATA2 = (end >> 16) & 0xFF;
+	NVM.CMD = NVM_CMD_FLASH_RANGE_CRC_gc;
+	ccp_write_io((void *)&NVM.CTRLA, NVM_CMDEX_bm);
+	SP_WaitForSPM();
+	return NVM.DATA0 | ((uint32_t)NVM.DATA1 << 8) | ((uint32_t)NVM.DATA2 << 16);
+}
+
+/**************************************************************************************************
+* Check the application against the boot record. Takes one pass of the NVM controller over the
+* recorded length, so boot time depends on the size of the application and nothing else.
+*/
+bool BOOT_ApplicationValid(void)
+{
+	BOOT_RECORD_t record;
+	uint8_t *ptr = (uint8_t *)&record;
+
+	for (uint8_t i = 0; i < sizeof(record); i++)
+		*ptr++ = SP_ReadUserSignatureByte(i);
+	if ((record.magic != BOOT_RECORD_MAGIC) || (record.length == 0) || (record.length > APP_SECTION_SIZE) || (record.length & 1))
+		return false;
+	return BOOT_RangeCRC(APP_SECTION_START, APP_SECTION_START + record.length - 1) == record.crc;
+}
+
+/**************************************************************************************************
+* Write the boot record for an application of length bytes. The rest of the user signature row is
+* kept, applications may store data there.
+*/
+void BOOT_WriteRecord(uint32_t length)
+{
+	BOOT_RECORD_t record = {	.magic = BOOT_RECORD_MAGIC,
+								.length = length,
+								.crc = BOOT_RangeCRC(APP_SECTION_START, APP_SECTION_START + length - 1) };
+
+	for (uint16_t i = 0; i < USER_SIGNATURES_PAGE_SIZE; i++)
+		page_buffer[i] = SP_ReadUserSignatureByte(i);
+	memcpy(page_buffer, &record, sizeof(record));
+	page_ptr = 0;
+
+	SP_WaitForSPM();
+	SP_EraseUserSignatureRow();
+	SP_WaitForSPM();
+	SP_LoadFlashPage(page_buffer);
+	SP_WriteUserSignatureRow();
+	SP_WaitForSPM();
+}
+
+/**************************************************************************************************
+* Exit the bootloader
+*/
+void BOOT_StartApplication(void) __attribute__ ((noreturn));
+void BOOT_StartApplication(void)
+{
+	AppPtr application_vector = (AppPtr)0x000000;
+	CCP = CCP_IOREG_gc;		// unlock IVSEL
+	PMIC.CTRL = 0;			// disable interrupts, set vector table to app section
+	EIND = 0;				// indirect jumps go to app section
+	RAMPZ = 0;				// LPM uses lower 64k of flash
+	application_vector();
+}
+
 /**************************************************************************************************
 * Main entry point
 */
@@ -50,24 +199,14 @@ int main(void)
 	CCP = CCP_IOREG_gc;				// unlock IVSEL
 	PMIC.CTRL |= PMIC_IVSEL_bm;		// set interrupt vector table to bootloader section
 
-	// check for VUSB
-	PORTD.DIRCLR = PIN5_bm;
-	PORTD.PIN5CTRL = (PORTD.PIN5CTRL & ~PORT_OPC_gm) | PORT_OPC_PULLDOWN_gc;
-	_delay_ms(1);
-	if (0)
-	//if (!(PORTD.IN & PIN5_bm))	// not connected to USB
-	{
-		// exit bootloader
-		AppPtr application_vector = (AppPtr)0x000000;
-		CCP = CCP_IOREG_gc;		// unlock IVSEL
-		PMIC.CTRL = 0;			// disable interrupts, set vector table to app section
-		EIND = 0;				// indirect jumps go to app section
-		RAMPZ = 0;				// LPM uses lower 64k of flash
-		application_vector();
-	}
+	// fast path, straight to a valid application without starting the clocks or USB
+	if ((!BOOT_Requested()) && BOOT_ApplicationValid())
+		BOOT_StartApplication();
 
 	// set up USB HID bootloader interface
+	USB_init_build_usb_serial_number();
 	sysclk_init();
+	DMA_init();
 	irq_initialize_vectors();
 	cpu_irq_enable();
 	udc_start();
@@ -76,24 +215,13 @@ int main(void)
 	for(;;);
 }
 
-/**************************************************************************************************
-** Convert lower nibble to hex char
-*/
-uint8_t hex_to_char(uint8_t hex)
-{
-	if (hex < 10)
-		hex += '0';
-	else
-		hex += 'A' - 10;
-
-	return(hex);
-}
-
 /**************************************************************************************************
 * Handle received HID report out requests
 */
 void HID_report_out(uint8_t *report)
 {
+	// the endpoint is rearmed with the same buffer when this returns, so the copy has to be done by
+	// then, and setting up a DMA channel costs more than copying 64 bytes
 	memcpy(&page_buffer[page_ptr], report, UDI_HID_REPORT_OUT_SIZE);
 	page_ptr += UDI_HID_REPORT_OUT_SIZE;
 	page_ptr &= APP_SECTION_PAGE_SIZE-1;
@@ -105,7 +233,7 @@ void HID_report_out(uint8_t *report)
 bool HID_get_feature_report_out(uint8_t **payload, uint16_t *size)
 {
 	feature_response.busy_flags = NVM.STATUS & (~NVM_FLOAD_bm);
-	feature_response.page_ptr = page_ptr;
+	feature_response.page_ptr = (page_ptr & STATUS_PAGE_PTR_MASK) | ((uint16_t)in_seq << STATUS_SEQ_SHIFT);
 	*payload = (uint8_t *)&feature_response;
 	*size = sizeof(feature_response);
 
@@ -146,6 +274,7 @@ void HID_set_feature_report_out(uint8_t *report)
 				feature_response.result = -1;
 				return;
 			}
+			SP_WaitForSPM();
 			memcpy_PF(response, (uint_farptr_t)cmd->params.u32, sizeof(response));
 			break;
 
@@ -173,6 +302,7 @@ void HID_set_feature_report_out(uint8_t *report)
 
 		// read fuses
 		case CMD_READ_FUSES:
+			SP_WaitForSPM();
 			memset(response, 0, 6);
 			#ifdef FUSE_FUSEBYTE0
 			response[0] = SP_ReadFuseByte(0);
@@ -205,20 +335,20 @@ void HID_set_feature_report_out(uint8_t *report)
 			SP_LoadFlashPage(page_buffer);
 			SP_WriteApplicationPage(APP_SECTION_START + ((uint32_t)cmd->params.u16[0] * APP_SECTION_PAGE_SIZE));
 			page_ptr = 0;
-			break;
+			return;
 
 		// erase user signature row
 		case CMD_ERASE_USER_SIG_ROW:
 			SP_WaitForSPM();
 			SP_EraseUserSignatureRow();
-			break;
+			return;
 
 		// write RAM buffer to user signature row
 		case CMD_WRITE_USER_SIG_ROW:
 			SP_WaitForSPM();
 			SP_LoadFlashPage(page_buffer);
 			SP_WriteUserSignatureRow();
-			break;
+			return;
 
 		// read user signature row
 		case CMD_READ_USER_SIG_ROW:
@@ -227,43 +357,28 @@ void HID_set_feature_report_out(uint8_t *report)
 				feature_response.result = -1;
 				return;
 			}
+			SP_WaitForSPM();
 			for (uint8_t i = 0; i < sizeof(response); i++)
 				response[i] = SP_ReadUserSignatureByte(cmd->params.u16[0] + i);
 			break;
 
 		case CMD_READ_SERIAL:
-			{
-				uint8_t	i;
-				uint8_t	j = 0;
-				uint8_t b;
-
-				for (i = 0; i < 6; i++)
-				{
-					b = SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i);
-					response[j++] = hex_to_char(b >> 4);
-					response[j++] = hex_to_char(b & 0x0F);
-				}
-				response[j++] = '-';
-				b = SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + 6);
-				response[j++] = hex_to_char(b >> 4);
-				response[j++] = hex_to_char(b & 0x0F);
-				response[j++] = '-';
+			memcpy(response, USB_serial_number, USB_DEVICE_GET_SERIAL_NAME_LENGTH + 1);
+			break;
 
-				for (i = 7; i < 11; i++)
+		case CMD_RESET_MCU:
+			if (cmd->params.u32 != 0)		// application length for the boot record
+			{
+				if ((cmd->params.u32 > APP_SECTION_SIZE) || (cmd->params.u32 & 1))
 				{
-					b = SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i);
-					response[j++] = hex_to_char(b >> 4);
-					response[j++] = hex_to_char(b & 0x0F);
+					feature_response.result = -1;
+					return;
 				}
-
-				response[j] = '\0';
-				break;
+				BOOT_WriteRecord(cmd->params.u32);
 			}
-
-		case CMD_RESET_MCU:
 			//reset_do_soft_reset();
 			ccp_write_io((void *)&WDT.CTRL, WDT_PER_128CLK_gc | WDT_WEN_bm | WDT_CEN_bm);	// watchdog will reset us in ~128ms
-			break;
+			return;
 
 		case CMD_READ_EEPROM:
 			if (cmd->params.u16[0] > EEPROM_SIZE)
@@ -271,6 +386,7 @@ void HID_set_feature_report_out(uint8_t *report)
 				feature_response.result = -1;
 				return;
 			}
+			EEP_WaitForNVM();
 			EEP_EnableMapping();
 			memcpy(response, (const void *)(MAPPED_EEPROM_START + cmd->params.u16[0]), sizeof(response));
 			EEP_DisableMapping();
@@ -280,22 +396,96 @@ void HID_set_feature_report_out(uint8_t *report)
 			if (cmd->params.u16[0] > (EEPROM_SIZE / EEPROM_PAGE_SIZE))
 			EEP_LoadPageBuffer(page_buffer, EEPROM_PAGE_SIZE);
 			EEP_AtomicWritePage(cmd->params.u16[0]);
-			break;
+			return;
 
 		case CMD_READ_EEPROM_CRC:
-			CRC.CTRL = CRC_RESET_RESET1_gc;
-			CRC.CTRL = CRC_SOURCE_FLASH_gc | CRC_CRC32_bm;
-			uint8_t *ptr = (uint8_t *)MAPPED_EEPROM_START;
-			uint16_t i = EEPROM_SIZE;
+			EEP_WaitForNVM();
 			EEP_EnableMapping();
-			while (i--)
-				CRC.DATAIN = *ptr++;
+			*(uint32_t *)&response[0] = DMA_CRC32((const void *)MAPPED_EEPROM_START, EEPROM_SIZE);
 			EEP_DisableMapping();
-			CRC.STATUS = CRC_BUSY_bm;
-			response[0] = CRC.CHECKSUM0;
-			response[1] = CRC.CHECKSUM1;
-			response[2] = CRC.CHECKSUM2;
-			response[3] = CRC.CHECKSUM3;
+			break;
+
+		// check a range of application section pages is erased, returns first non-blank address
+		case CMD_BLANK_CHECK:
+			{
+				uint32_t addr = APP_SECTION_START + ((uint32_t)cmd->params.u16[0] * APP_SECTION_PAGE_SIZE);
+				uint32_t end = addr + ((uint32_t)cmd->params.u16[1] * APP_SECTION_PAGE_SIZE);
+				if ((cmd->params.u16[1] > BLANK_CHECK_MAX_PAGES) || (end > APP_SECTION_START + APP_SECTION_SIZE))
+				{
+					feature_response.result = -1;
+					return;
+				}
+				SP_WaitForSPM();
+				while ((addr < end) && (pgm_read_dword_far(addr) == 0xFFFFFFFF))
+					addr += 4;
+				if (addr < end)
+				{
+					while (pgm_read_byte_far(addr) == 0xFF)
+						addr++;
+				}
+				else
+					addr = 0xFFFFFFFF;
+				*(uint32_t *)&response[0] = addr;
+				break;
+			}
+
+		// decompress RAM page buffer and write to application section page
+		case CMD_WRITE_COMPRESSED_PAGE:
+			if ((cmd->params.u16[0] >= (APP_SECTION_SIZE / APP_SECTION_PAGE_SIZE)) ||
+				(!DCMP_DecompressPage(page_buffer, sizeof(page_buffer), APP_SECTION_PAGE_SIZE, cmd->params.u16[1])))
+			{
+				page_ptr = 0;
+				feature_response.result = -1;
+				return;
+			}
+			SP_WaitForSPM();
+			SP_LoadFlashPage(page_buffer);
+			SP_WriteApplicationPage(APP_SECTION_START + ((uint32_t)cmd->params.u16[0] * APP_SECTION_PAGE_SIZE));
+			page_ptr = 0;
+			return;
+
+		// fill RAM page buffer with a 16 bit pattern and write it to a run of application section pages
+		case CMD_FILL_PAGES:
+			{
+				uint16_t page = cmd->params.u16[1] & FILL_PAGE_MASK;
+				uint8_t count = (cmd->params.u16[1] >> FILL_COUNT_SHIFT) + 1;
+				if ((count > FILL_BATCH_PAGES) || (page + count > (APP_SECTION_SIZE / APP_SECTION_PAGE_SIZE)))
+				{
+					feature_response.result = -1;
+					return;
+				}
+				uint16_t *ptr = (uint16_t *)page_buffer;
+				for (uint16_t i = 0; i < APP_SECTION_PAGE_SIZE / 2; i++)
+					*ptr++ = cmd->params.u16[0];
+				while (count--)
+				{
+					SP_WaitForSPM();
+					SP_LoadFlashPage(page_buffer);
+					SP_WriteApplicationPage(APP_SECTION_START + ((uint32_t)page++ * APP_SECTION_PAGE_SIZE));
+				}
+				page_ptr = 0;
+				return;
+			}
+
+		// rebuild page from RAM buffer patch and existing flash, then erase and write it
+		case CMD_PATCH_PAGE:
+			SP_WaitForSPM();
+			if ((cmd->params.u16[0] >= (APP_SECTION_SIZE / APP_SECTION_PAGE_SIZE)) ||
+				(!DCMP_PatchPage(page_buffer, sizeof(page_buffer), APP_SECTION_PAGE_SIZE, cmd->params.u16[1])))
+			{
+				page_ptr = 0;
+				feature_response.result = -1;
+				return;
+			}
+			SP_LoadFlashPage(page_buffer);
+			SP_EraseWriteApplicationPage(APP_SECTION_START + ((uint32_t)cmd->params.u16[0] * APP_SECTION_PAGE_SIZE));
+			page_ptr = 0;
+			return;
+
+		// what this build supports, so hosts can pick the fastest way to program it
+		case CMD_READ_CAPABILITIES:
+			memset(response, 0, sizeof(response));
+			memcpy(response, &capabilities, sizeof(capabilities));
 			break;
 
 		// unknown command
@@ -304,5 +494,13 @@ void HID_set_feature_report_out(uint8_t *report)
 			return;
 	}
 
-	udi_hid_generic_send_report_in(response);
+	// number the report, reads give up their last byte for it
+	uint8_t seq = (in_seq + 1) & STATUS_SEQ_MASK;
+	response[RESPONSE_SEQ_BYTE] = seq;
+
+	// the IN queue is full, the host has stopped reading responses
+	if (!udi_hid_generic_send_report_in(response))
+		feature_response.result = -1;
+	else
+		in_seq = seq;
 }
@@ -32,6 +32,84 @@
 //#define CMD_WRITE_EEPROM			0x10
 #define CMD_WRITE_EEPROM_PAGE		0x10
 #define CMD_READ_EEPROM_CRC			0x11
+#define CMD_BLANK_CHECK				0x12
+#define CMD_WRITE_COMPRESSED_PAGE	0x13
+#define CMD_FILL_PAGES				0x14
+#define CMD_PATCH_PAGE				0x15
+#define CMD_READ_CAPABILITIES		0x16
+
+
+// CMD_RESET_MCU params: u32 = 0 for a plain reset, or the length of the application in bytes (even).
+// With a length the boot record is written first, so later resets start the application directly.
+
+// boot record, the first bytes of the user signature row
+#define BOOT_RECORD_MAGIC			0x544F4F42		// "BOOT"
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	length;				// bytes from the start of the application section
+	uint32_t	crc;				// NVM flash range CRC of those bytes
+} BOOT_RECORD_t;
+
+// an application enters the bootloader by writing this to the last four bytes of SRAM and resetting
+#define BOOT_REQUEST_MAGIC			0x4C424448		// "HDBL"
+
+// CMD_READ_CAPABILITIES response. Bootloaders without it fail the command, hosts then use the
+// original flow. Later versions only append fields.
+#define CAPS_VERSION				1
+
+#define CAP_BLANK_CHECK				0x0001
+#define CAP_BOOT_RECORD				0x0002		// CMD_RESET_MCU takes the application length
+#define CAP_EEPROM					0x0004		// CMD_READ_EEPROM, CMD_WRITE_EEPROM_PAGE and CMD_READ_EEPROM_CRC
+#define CAP_USER_SIG_ROW			0x0008
+#define CAP_NVM_WAIT				0x0010		// commands wait for the NVM controller, no need to poll busy
+#define CAP_TAGGED					0x0020		// numbered responses, see below
+
+#define ENC_RAW						0x01		// CMD_WRITE_PAGE
+#define ENC_COMPRESSED				0x02		// CMD_WRITE_COMPRESSED_PAGE
+#define ENC_FILL					0x04		// CMD_FILL_PAGES
+#define ENC_PATCH					0x08		// CMD_PATCH_PAGE
+
+typedef struct {
+	uint8_t		caps_version;
+	uint8_t		bootloader_version;
+	uint16_t	features;			// CAP_*
+	uint8_t		encodings;			// ENC_*
+	uint8_t		page_buffers;		// pages held at once, 2 lets the next page stream in while one is written
+	uint8_t		max_batch;			// most pages written by one command
+	uint8_t		in_queue;			// responses held for the host
+	uint16_t	page_size;
+	uint32_t	app_section_size;
+	uint16_t	eeprom_size;
+	uint8_t		eeprom_page_size;
+	uint8_t		page_write_ms;		// NVM timing hints
+	uint8_t		page_erase_write_ms;
+	uint8_t		eeprom_write_ms;
+	uint16_t	app_erase_ms;
+} CAPABILITIES_t;
+
+// Tagged responses. Every IN report the bootloader queues is numbered, and the status returned
+// after each command carries the number of the last one in the top bits of page_ptr. Every response
+// echoes its number in the last byte, so flash, EEPROM and user signature row reads return 63 bytes
+// of data. Commands without a response don't queue a report. Hosts match reports to the commands
+// waiting for them by number, instead of discarding everything before each command.
+#define STATUS_PAGE_PTR_MASK		0x03FF
+#define STATUS_SEQ_SHIFT			10
+#define STATUS_SEQ_MASK				0x3F
+#define RESPONSE_SEQ_BYTE			63
+#define RESPONSE_DATA_BYTES			63		// bytes of data in a read response
+
+// CMD_FILL_PAGES params: u16[0] = fill pattern, u16[1] = first page | ((count-1) << 10)
+#define FILL_PAGE_MASK				0x03FF
+#define FILL_COUNT_SHIFT			10
+#define FILL_MAX_PAGES				64
+
+// The set feature handler has to finish before the control transfer's 50 ms status stage limit,
+// which bounds the work one command can do. A page write takes about 4 ms.
+#define FILL_BATCH_PAGES			8			// CAPABILITIES_t.max_batch
+
+// CMD_BLANK_CHECK params: u16[0] = first page, u16[1] = page count
+#define BLANK_CHECK_MAX_PAGES		64
 
 
 
@@ -11,7 +11,7 @@
 #include "sp_driver.h"
 #include "serial_num.h"
 
-uint8_t USB_serial_number[USB_DEVICE_GET_SERIAL_NAME_LENGTH];
+uint8_t USB_serial_number[USB_DEVICE_GET_SERIAL_NAME_LENGTH + 1];
 
 /**************************************************************************************************
 ** Convert lower nibble to hex char
@@ -27,32 +27,35 @@ uint8_t usb_hex_to_char(uint8_t hex)
 }
 
 /**************************************************************************************************
-** Set USB serial number string from MCU ID
+** Append a production signature byte as two hex chars
+*/
+uint8_t usb_serial_append(uint8_t j, uint8_t offset)
+{
+	uint8_t b = SP_ReadCalibrationByte(offset);
+	USB_serial_number[j++] = usb_hex_to_char(b >> 4);
+	USB_serial_number[j++] = usb_hex_to_char(b & 0x0F);
+	return(j);
+}
+
+/**************************************************************************************************
+** Set USB serial number string from the lot number, wafer number and die coordinates, which
+** together are unique to each device: LLLLLLLLLLLL-WW-XXXX-YYYY
 */
 void USB_init_build_usb_serial_number(void)
 {
 	uint8_t	i;
 	uint8_t	j = 0;
-	uint8_t b;
 	
 	for (i = 0; i < 6; i++)
-	{
-		b = SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i);
-		USB_serial_number[j++] = usb_hex_to_char(b >> 4);
-		USB_serial_number[j++] = usb_hex_to_char(b & 0x0F);
-	}
+		j = usb_serial_append(j, offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i);
 	USB_serial_number[j++] = '-';
-	b = SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + 7);
-	USB_serial_number[j++] = usb_hex_to_char(b >> 4);
-	USB_serial_number[j++] = usb_hex_to_char(b & 0x0F);
+	j = usb_serial_append(j, offsetof(NVM_PROD_SIGNATURES_t, WAFNUM));
 	USB_serial_number[j++] = '-';
-
-	for (i = 7; i < 11; i++)
-	{
-		b = SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i);
-		USB_serial_number[j++] = usb_hex_to_char(b >> 4);
-		USB_serial_number[j++] = usb_hex_to_char(b & 0x0F);
-	}
+	j = usb_serial_append(j, offsetof(NVM_PROD_SIGNATURES_t, COORDX1));
+	j = usb_serial_append(j, offsetof(NVM_PROD_SIGNATURES_t, COORDX0));
+	USB_serial_number[j++] = '-';
+	j = usb_serial_append(j, offsetof(NVM_PROD_SIGNATURES_t, COORDY1));
+	j = usb_serial_append(j, offsetof(NVM_PROD_SIGNATURES_t, COORDY0));
 
 	USB_serial_number[j] = '\0';
 }
@@ -95,11 +95,13 @@ COMPILER_WORD_ALIGNED
 //! To store current protocol of HID generic
 COMPILER_WORD_ALIGNED
 		static uint8_t udi_hid_generic_protocol;
-//! To signal if the report IN buffer is free (no transfer on going)
-static bool udi_hid_generic_b_report_in_free;
-//! Report to send
+//! Reports to send, a ring. The head is on the endpoint while the ring isn't empty.
 COMPILER_WORD_ALIGNED
-		static uint8_t udi_hid_generic_report_in[UDI_HID_REPORT_IN_SIZE];
+		static uint8_t udi_hid_generic_report_in[UDI_HID_GENERIC_REPORT_IN_QUEUE][UDI_HID_REPORT_IN_SIZE];
+//! Index of the report on the endpoint
+static uint8_t udi_hid_generic_report_in_head;
+//! Number of reports in the ring, including the one on the endpoint
+static uint8_t udi_hid_generic_report_in_count;
 //! Report to receive
 COMPILER_WORD_ALIGNED
 		static uint8_t udi_hid_generic_report_out[UDI_HID_REPORT_OUT_SIZE];
@@ -202,6 +204,13 @@ static void udi_hid_generic_report_out_received(udd_ep_status_t status,
  */
 static bool udi_hid_generic_report_out_enable(void);
 
+/**
+ * \brief Start sending the report at the head of the ring
+ *
+ * \return \c 1 if function was successfully done, otherwise \c 0.
+ */
+static bool udi_hid_generic_report_in_start(void);
+
 /**
  * \brief Callback called when the report is sent
  *
@@ -223,7 +232,8 @@ bool udi_hid_generic_enable(void)
 	// Initialize internal values
 	udi_hid_generic_rate = 0;
 	udi_hid_generic_protocol = 0;
-	udi_hid_generic_b_report_in_free = true;
+	udi_hid_generic_report_in_head = 0;
+	udi_hid_generic_report_in_count = 0;
 	if (!udi_hid_generic_report_out_enable())
 		return false;
 	return UDI_HID_GENERIC_ENABLE_EXT();
@@ -273,23 +283,26 @@ static bool udi_hid_generic_setreport(void)
 
 bool udi_hid_generic_send_report_in(uint8_t *data)
 {
-	if (!udi_hid_generic_b_report_in_free)
-		return false;
 	irqflags_t flags = cpu_irq_save();
-	// Fill report
-	memset(&udi_hid_generic_report_in, 0,
-			sizeof(udi_hid_generic_report_in));
-	memcpy(&udi_hid_generic_report_in, data,
-	      		sizeof(udi_hid_generic_report_in));
-	udi_hid_generic_b_report_in_free =
-			!udd_ep_run(UDI_HID_GENERIC_EP_IN,
-							false,
-							(uint8_t *) & udi_hid_generic_report_in,
-							sizeof(udi_hid_generic_report_in),
-							udi_hid_generic_report_in_sent);
+	if (udi_hid_generic_report_in_count >= UDI_HID_GENERIC_REPORT_IN_QUEUE) {
+		cpu_irq_restore(flags);
+		return false;
+	}
+	uint8_t slot = udi_hid_generic_report_in_head + udi_hid_generic_report_in_count;
+	if (slot >= UDI_HID_GENERIC_REPORT_IN_QUEUE)
+		slot -= UDI_HID_GENERIC_REPORT_IN_QUEUE;
+	memcpy(&udi_hid_generic_report_in[slot], data,
+			sizeof(udi_hid_generic_report_in[slot]));
+	udi_hid_generic_report_in_count++;
+	// Endpoint is idle, send it now. Otherwise the sent callback will.
+	if ((udi_hid_generic_report_in_count == 1)
+			&& !udi_hid_generic_report_in_start()) {
+		udi_hid_generic_report_in_count = 0;
+		cpu_irq_restore(flags);
+		return false;
+	}
 	cpu_irq_restore(flags);
-	return !udi_hid_generic_b_report_in_free;
-
+	return true;
 }
 
 //--------------------------------------------
@@ -326,13 +339,36 @@ static bool udi_hid_generic_report_out_enable(void)
 }
 
 
+static bool udi_hid_generic_report_in_start(void)
+{
+	return udd_ep_run(UDI_HID_GENERIC_EP_IN,
+							false,
+							(uint8_t *) & udi_hid_generic_report_in[udi_hid_generic_report_in_head],
+							sizeof(udi_hid_generic_report_in[0]),
+							udi_hid_generic_report_in_sent);
+}
+
+
 static void udi_hid_generic_report_in_sent(udd_ep_status_t status,
 		iram_size_t nb_sent, udd_ep_id_t ep)
 {
-	UNUSED(status);
 	UNUSED(nb_sent);
 	UNUSED(ep);
-	udi_hid_generic_b_report_in_free = true;
+	if (UDD_EP_TRANSFER_OK != status) {
+		// Endpoint disabled or reset, drop everything queued
+		udi_hid_generic_report_in_count = 0;
+		return;
+	}
+	if (0 == udi_hid_generic_report_in_count)
+		return;
+
+	// Refill the endpoint from the ring
+	if (++udi_hid_generic_report_in_head >= UDI_HID_GENERIC_REPORT_IN_QUEUE)
+		udi_hid_generic_report_in_head = 0;
+	udi_hid_generic_report_in_count--;
+	if ((0 != udi_hid_generic_report_in_count)
+			&& !udi_hid_generic_report_in_start())
+		udi_hid_generic_report_in_count = 0;
 }
 
 //@}
@@ -139,12 +139,20 @@ typedef struct {
  * @{
  */
 
+//! Number of IN reports that can be queued behind the one being sent
+#ifndef UDI_HID_GENERIC_REPORT_IN_QUEUE
+#  define UDI_HID_GENERIC_REPORT_IN_QUEUE 1
+#endif
+
 /**
  * \brief Routine used to send a report to USB Host
  *
+ * The report is copied, and queued if the endpoint is busy. Reports are sent
+ * in order.
+ *
  * \param data     Pointer on the report to send (size = UDI_HID_REPORT_IN_SIZE)
  *
- * \return \c 1 if function was successfully done, otherwise \c 0.
+ * \return \c 1 if function was successfully done, otherwise \c 0 (queue full).
  */
 bool udi_hid_generic_send_report_in(uint8_t *data);
 
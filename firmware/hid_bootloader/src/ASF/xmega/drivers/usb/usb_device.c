@@ -482,9 +482,11 @@ void udd_enable(void)
 	Assert(((uint16_t)(&udd_sram) & 0x01) == 0); /* check align on WORD */
 #endif
 	udd_set_ep_table_addr(udd_sram.ep_ctrl);
+#ifndef UDD_NO_TC_FIFO
 	// Enable TC fifo management
 	udd_enable_fifo();
 	udd_reset_fifo();
+#endif
 	// Enable Interrupt USB Device
 	udd_enable_interrupt(UDD_USB_INT_LEVEL);
 
@@ -858,10 +860,12 @@ ISR(USB_TRNCOMPL_vect)
 {
 #if (0!=USB_DEVICE_MAX_EP)
 	uint8_t ep_index;
+#  ifndef UDD_NO_TC_FIFO
 	uint8_t i_fifo;
 	uint16_t ad;
 	uint16_t *p_ad;
 	int8_t rp;
+#  endif
 	UDD_EP_t *ep_ctrl;
 	udd_ep_id_t ep;
 #endif
@@ -879,7 +883,30 @@ ISR(USB_TRNCOMPL_vect)
 	udd_ack_tc_event();
 
 #if (0!=USB_DEVICE_MAX_EP)
+#  ifdef UDD_NO_TC_FIFO
+	//** Scan the endpoint table
+	// One TC event can cover transfers on several endpoints, so handle them all
+	for (ep_index = 0; ep_index < (2 * (USB_DEVICE_MAX_EP + 1)); ep_index++) {
+		ep_ctrl = &udd_sram.ep_ctrl[ep_index];
+		if (!udd_endpoint_transfer_complete(ep_ctrl)) {
+			continue;
+		}
+		udd_endpoint_ack_transfer_complete(ep_ctrl);
+		ep = (ep_index / 2) + ((ep_index & 1) ? USB_EP_DIR_IN : 0);
+		if (ep == 0) {
+			udd_ctrl_out_received();
+		} else if (ep == (0 | USB_EP_DIR_IN)) {
+			udd_ctrl_in_sent();
+		} else {
+			Assert(udd_ep_is_valid(ep));
+			udd_ep_trans_complet(ep);
+		}
+	}
+	goto udd_interrupt_tc_end;
+#  else
 	//** Decode TC FIFO
+	// The FIFO names the endpoint descriptor of the completed transfer, so the cost doesn't
+	// depend on the number of endpoints
 	// Compute ep addr
 	rp = udd_get_fifo_rp();
 	i_fifo = 2 * (1 + ~rp);
@@ -909,10 +936,13 @@ ISR(USB_TRNCOMPL_vect)
 	Assert(udd_ep_is_valid(ep));
 	// Manage end of transfer on endpoint bulk/interrupt/isochronous
 	udd_ep_trans_complet(ep);
+#  endif
 
 #else
 
+#  ifndef UDD_NO_TC_FIFO
 	udd_get_fifo_rp();
+#  endif
 	if (udd_endpoint_transfer_complete(udd_ep_get_ctrl(0))) {
 		udd_endpoint_ack_transfer_complete(udd_ep_get_ctrl(0));
 		udd_ctrl_out_received();
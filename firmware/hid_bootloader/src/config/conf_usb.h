@@ -71,11 +71,11 @@
 //! USB Device string definitions (Optional)
 #define  USB_DEVICE_MANUFACTURE_NAME      "Keio"
 #define  USB_DEVICE_PRODUCT_NAME          "USB Bootloader"
-// serial number removed
-//#define	USB_DEVICE_SERIAL_NAME
-//#define	USB_DEVICE_GET_SERIAL_NAME_POINTER USB_serial_number
-//#define	USB_DEVICE_GET_SERIAL_NAME_LENGTH  25
-//extern uint8_t USB_serial_number[];
+// serial number built from the production signature row at startup, see serial_num.c
+#define	USB_DEVICE_SERIAL_NAME
+#define	USB_DEVICE_GET_SERIAL_NAME_POINTER USB_serial_number
+#define	USB_DEVICE_GET_SERIAL_NAME_LENGTH  25		// not including null terminator
+extern uint8_t USB_serial_number[];
 
 
 /**
@@ -154,6 +154,9 @@ extern bool HID_get_feature_report_out(uint8_t **payload, uint16_t *size);
 
 //! Sizes of I/O endpoints
 #define  UDI_HID_GENERIC_EP_SIZE            64
+
+//! IN reports held while the endpoint is busy, so responses to back to back commands aren't lost
+#define  UDI_HID_GENERIC_REPORT_IN_QUEUE    4
 //@}
 //@}
 
@@ -164,6 +167,9 @@ extern bool HID_get_feature_report_out(uint8_t **payload, uint16_t *size);
  * USB Device Driver Configuration
  * @{
  */
+//! Find completed transfers by scanning the endpoint table instead of reading the
+//! transaction complete FIFO (default), which names the endpoint directly
+//#define  UDD_NO_TC_FIFO
 //@}
 
 //! The includes of classes and other headers must be done at the end of this file to avoid compile error
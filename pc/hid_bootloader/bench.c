@@ -0,0 +1,446 @@
+// bench.c
+//
+// End to end throughput benchmark. The host's own update and verify code (hid_bootloader.c) runs
+// against the simulated bootloader (simdev.c), with every transfer costed on a model of a full
+// speed bus: control transfers for commands and status, interrupt OUT reports for page data only
+// in the frames their endpoint is polled, IN responses picked up at the next poll after the device
+// loads them, and completions seen by the host at the end of the frame. While a command handler
+// waits for the NVM controller the firmware stalls the bus, so the host's retries are NAKed until
+// it finishes. Flash times are the simulator's XMEGA model (sim.h).
+//
+// A sweep of synthetic images covers both page sizes, several image sizes and each protocol mode,
+// and the results are written as a CSV table in seconds per device of bus time. Given the table
+// from an earlier run, any case slower than it by more than BENCH_REGRESSION_PCT fails. The times
+// are virtual, so runs are repeatable and take seconds. BENCH_HOST_US can be calibrated against
+// a real station by replaying a recorded session with -P, which reports the recorded time.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "crc.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "simdev.h"
+#include "bench.h"
+
+
+SIMDEV_t		*bench_device = NULL;		// transfers go to this simulated bootloader instead of USB
+BENCH_RESULT_t	*bench_result = NULL;		// counters of the case being run
+uint64_t		bench_arrival_us[SIMDEV_IN_QUEUE];	// when each queued IN report reaches the host
+uint64_t		bench_poll_us = 0;			// poll taking the last IN report queued, one report per poll
+uint32_t		bench_seed = 0;
+
+const BENCH_PART_t bench_parts[] = {
+	{ "atxmega128a4u", { 0x1E, 0x97, 0x46 }, 128 * 1024, 256, 2048, 32 },
+	{ "atxmega256a3bu", { 0x1E, 0x98, 0x43 }, 256 * 1024, 512, 4096, 32 },
+};
+
+const int bench_image_pct[] = { 25, 50, 100 };
+
+const char *bench_mode_names[BENCH_MODES] = { "raw", "compressed", "delta" };
+
+// common AVR opcodes, with the register fields clear
+const uint16_t bench_opcodes[16] = {
+	0x2C00, 0x0C00, 0x1C00, 0x0800, 0xE000, 0x8000, 0x8200, 0x9000,
+	0x920F, 0x900F, 0xC000, 0xF401, 0xF001, 0x9508, 0x940E, 0x0000,
+};
+
+
+/**************************************************************************************************
+* Start of the first frame at or after t in which an endpoint polled every interval frames is
+* scheduled
+*/
+uint64_t BenchNextPoll(uint64_t t, uint32_t interval)
+{
+	uint64_t frame = (t + BENCH_FRAME_US - 1) / BENCH_FRAME_US;
+	frame = ((frame + interval - 1) / interval) * interval;
+	return frame * BENCH_FRAME_US;
+}
+
+/**************************************************************************************************
+* End of the frame containing t, when the host controller reports completions
+*/
+uint64_t BenchFrameEnd(uint64_t t)
+{
+	return ((t / BENCH_FRAME_US) + 1) * BENCH_FRAME_US;
+}
+
+/**************************************************************************************************
+* hid_send_feature_report(), a control transfer with a command. The status stage is NAKed until
+* the command handler returns.
+*/
+int BenchSendFeatureReport(const unsigned char *data, size_t length)
+{
+	SIMDEV_t *dev = bench_device;
+
+	dev->clock_us += BENCH_HOST_US + BENCH_SETUP_US + BENCH_PACKET_US(length - 1);
+	uint64_t received = dev->clock_us;
+	uint8_t queued = dev->response_count;
+	SimDevSetFeature(dev, &data[1]);
+	bench_result->nak_frames += (uint32_t)((dev->clock_us / BENCH_FRAME_US) - (received / BENCH_FRAME_US));
+	if (dev->response_count > queued)
+	{
+		uint64_t t = max(dev->clock_us, bench_poll_us + BENCH_FRAME_US);
+		bench_poll_us = BenchNextPoll(t, BENCH_INTERVAL_FRAMES);
+		bench_arrival_us[(dev->response_head + dev->response_count - 1) % SIMDEV_IN_QUEUE] = BenchFrameEnd(bench_poll_us);
+	}
+
+	dev->clock_us = BenchFrameEnd(dev->clock_us + BENCH_HANDSHAKE_US);
+	bench_result->transfers++;
+	return (int)length;
+}
+
+/**************************************************************************************************
+* hid_get_feature_report(), a control transfer reading the status. Like hidapi, the report ID
+* isn't counted.
+*/
+int BenchGetFeatureReport(unsigned char *data, size_t length)
+{
+	SIMDEV_t *dev = bench_device;
+	BLSTATUS_t status;
+
+	dev->clock_us += BENCH_HOST_US + BENCH_SETUP_US;
+	SimDevGetFeature(dev, &status);
+	length = min(length, sizeof(status));
+	memcpy(data, &status, length);
+
+	dev->clock_us = BenchFrameEnd(dev->clock_us + BENCH_PACKET_US(length - 1) + BENCH_HANDSHAKE_US);
+	bench_result->transfers++;
+	return (int)length - 1;
+}
+
+/**************************************************************************************************
+* hid_write(), an interrupt OUT report of page data, sent the next time the endpoint is polled
+*/
+int BenchWrite(const unsigned char *data, size_t length)
+{
+	SIMDEV_t *dev = bench_device;
+
+	dev->clock_us = BenchNextPoll(dev->clock_us + BENCH_HOST_US, BENCH_INTERVAL_FRAMES) + BENCH_PACKET_US(length - 1);
+	SimDevReportOut(dev, &data[1]);
+
+	dev->clock_us = BenchFrameEnd(dev->clock_us);
+	bench_result->transfers++;
+	bench_result->reports++;
+	return (int)length;
+}
+
+/**************************************************************************************************
+* hid_read_timeout(), an IN report with a response. The HID driver keeps polling the endpoint, so
+* a response may be waiting already. With none the read times out.
+*/
+int BenchReadTimeout(unsigned char *data, size_t length, int milliseconds)
+{
+	SIMDEV_t *dev = bench_device;
+
+	dev->clock_us += BENCH_HOST_US;
+	if (dev->response_count == 0)
+	{
+		if (milliseconds > 0)
+			dev->clock_us += (uint64_t)milliseconds * 1000;
+		return 0;
+	}
+
+	// polls are NAKed until the device loads the report
+	uint64_t arrival = bench_arrival_us[dev->response_head];
+	if (arrival > dev->clock_us)
+	{
+		bench_result->nak_frames += (uint32_t)((arrival - dev->clock_us) / BENCH_FRAME_US);
+		dev->clock_us = arrival;
+	}
+
+	uint8_t response[HID_DATA_BYTES];
+	SimDevReportIn(dev, response);
+	memcpy(data, response, min(length, HID_DATA_BYTES));
+	bench_result->transfers++;
+	return (int)min(length, HID_DATA_BYTES);
+}
+
+/**************************************************************************************************
+* Pseudo random numbers, the same sequence on every run
+*/
+uint32_t BenchRandom(void)
+{
+	bench_seed = (bench_seed * 1103515245) + 12345;
+	return bench_seed >> 16;
+}
+
+/**************************************************************************************************
+* Build a synthetic firmware image of size bytes in the firmware buffer, mostly code with some
+* tables and zeroed data, and with embedded info for part
+*/
+void BenchBuildImage(const BENCH_PART_t *part, uint32_t size, uint32_t seed)
+{
+	memset(firmware_buffer, 0xFF, sizeof(firmware_buffer));
+	bench_seed = seed;
+
+	for (uint32_t addr = 0; addr < size; addr += HID_DATA_BYTES)
+	{
+		uint8_t *block = &firmware_buffer[addr];
+		uint32_t length = min(HID_DATA_BYTES, size - addr);
+		uint32_t kind = BenchRandom() % 100;
+
+		if (kind < 10)							// zeroed data
+			memset(block, 0, length);
+		else if (kind < 20)						// lookup table
+		{
+			uint8_t step = (uint8_t)(1 + (BenchRandom() % 7));
+			for (uint32_t i = 0; i < length; i++)
+				block[i] = (uint8_t)(addr + (i * step));
+		}
+		else									// code
+		{
+			for (uint32_t i = 0; i + 1 < length; i += 2)
+			{
+				uint16_t word = bench_opcodes[BenchRandom() % 16] | (BenchRandom() & 0x03FF);
+				block[i] = word & 0xFF;
+				block[i + 1] = word >> 8;
+			}
+		}
+	}
+
+	FW_INFO_t *info = (FW_INFO_t *)&firmware_buffer[BENCH_INFO_OFFSET];
+	memcpy(info->magic_string, MAGIC_STRING, sizeof(info->magic_string));
+	info->version_major = 1;
+	info->version_minor = 0;
+	memcpy(info->mcu_signature, part->signature, sizeof(info->mcu_signature));
+	info->flash_size_b = part->flash_size;
+	info->page_size_b = part->page_size;
+	info->eeprom_size_b = part->eeprom_size;
+	info->eeprom_page_size_b = part->eeprom_page_size;
+
+	fw_info = info;
+	fw_info_v2 = NULL;
+	firmware_size = size;
+	firmware_crc = xmega_nvm_crc32(firmware_buffer, part->flash_size);
+}
+
+/**************************************************************************************************
+* Turn the image into the next release: a few words changed every 16 pages, and the end of the
+* image moved up by a word as if a function had grown
+*/
+void BenchChangeImage(uint32_t size, uint16_t page_size)
+{
+	for (uint32_t addr = page_size; addr + page_size <= size; addr += page_size * 16)
+	{
+		uint32_t offset = BenchRandom() % (page_size - 8);
+		for (int i = 0; i < 8; i++)
+			firmware_buffer[addr + offset + i] ^= (uint8_t)(1 + (BenchRandom() % 255));
+	}
+
+	uint32_t tail = size / 8;
+	memmove(&firmware_buffer[size - tail + 2], &firmware_buffer[size - tail], tail - 2);
+	firmware_buffer[size - tail] = 0x00;
+	firmware_buffer[size - tail + 1] = 0x00;
+
+	firmware_crc = xmega_nvm_crc32(firmware_buffer, fw_info->flash_size_b);
+}
+
+/**************************************************************************************************
+* Run the host's update and verify against a simulated device for one case
+*/
+bool BenchRun(const BENCH_PART_t *part, int pct, BENCH_MODE_t mode, BENCH_RESULT_t *res)
+{
+	PLAN_IMAGE_t bench_image;
+	BL_TARGET_t bench_target;
+	SIMDEV_t dev;
+
+	memset(res, 0, sizeof(BENCH_RESULT_t));
+	_snprintf(res->name, sizeof(res->name) - 1, "%s/%d%%/%s", part->name, pct, bench_mode_names[mode]);
+	res->part = part;
+	res->mode = mode;
+	res->image_bytes = (uint32_t)(((uint64_t)part->flash_size * pct) / 100);
+
+	// the same image for every mode of a part and size
+	uint32_t seed = part->flash_size + pct;
+	BenchBuildImage(part, res->image_bytes, seed);
+	uint32_t base_crc = firmware_crc;
+	if (mode == BENCH_MODE_DELTA)
+	{
+		memcpy(delta_base_buffer, firmware_buffer, sizeof(delta_base_buffer));
+		BenchChangeImage(res->image_bytes, part->page_size);
+		if (!PlanDelta(delta_base_buffer, base_crc))
+			return false;
+	}
+	else if (!PlanPages(mode == BENCH_MODE_COMPRESSED))
+		return false;
+	GetPlanImage(&bench_image);
+
+	uint8_t mcu_id[4] = { part->signature[0], part->signature[1], part->signature[2], 0 };
+	if (!SimDevInit(&dev, part->flash_size, part->page_size, part->eeprom_size, part->eeprom_page_size, mcu_id, "BENCH"))
+		return false;
+	if (mode == BENCH_MODE_DELTA)
+		memcpy(dev.flash, delta_base_buffer, part->flash_size);
+
+	bench_device = &dev;
+	bench_result = res;
+	bench_poll_us = 0;
+
+	res->ok = GetBootloaderInfo(NULL, &bench_target) &&
+			  CheckTarget(NULL, &bench_target, &bench_image) &&
+			  UpdateFirmware(NULL, &bench_target, &bench_image);
+	res->update_us = dev.clock_us;
+	if (res->ok)
+	{
+		res->ok = VerifyFirmware(NULL, &bench_target, &bench_image);
+		res->verify_us = dev.clock_us - res->update_us;
+	}
+	if (res->ok && (memcmp(dev.flash, firmware_buffer, part->flash_size) != 0))
+		res->ok = false;
+	res->flash_us = dev.flash_us;
+
+	bench_device = NULL;
+	bench_result = NULL;
+	SimDevFree(&dev);
+	return true;
+}
+
+/**************************************************************************************************
+* Print a time in microseconds as seconds
+*/
+void BenchPrintTime(uint64_t us)
+{
+	silent_printf("%llu.%03llus\t", us / 1000000, (us / 1000) % 1000);
+}
+
+/**************************************************************************************************
+* Write the results table
+*/
+bool BenchWriteResults(const char *filename, BENCH_RESULT_t *results, int count)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	fprintf(fp, "case,part,page_size,image_bytes,mode,ok,update_s,verify_s,seconds_per_device,transfers,reports,nak_frames,flash_s\n");
+	for (int i = 0; i < count; i++)
+	{
+		BENCH_RESULT_t *res = &results[i];
+		fprintf(fp, "%s,%s,%u,%lu,%s,%d,%.3f,%.3f,%.3f,%lu,%lu,%lu,%.3f\n",
+				res->name, res->part->name, res->part->page_size, res->image_bytes, bench_mode_names[res->mode], res->ok ? 1 : 0,
+				res->update_us / 1e6, res->verify_us / 1e6, (res->update_us + res->verify_us) / 1e6,
+				res->transfers, res->reports, res->nak_frames, res->flash_us / 1e6);
+	}
+
+	bool ok = (fclose(fp) == 0);
+	if (!ok)
+		silent_printf("Failed to write %s.\n", filename);
+	else
+		quiet_printf("Results written to %s.\n", filename);
+	return ok;
+}
+
+/**************************************************************************************************
+* Compare the results with a table from an earlier run. Returns false if any case that is in both
+* failed or is slower than the baseline by more than BENCH_REGRESSION_PCT.
+*/
+bool BenchCompare(const char *filename, BENCH_RESULT_t *results, int count)
+{
+	char line[512];
+	char name[64];
+	double update_s, verify_s, total_s;
+	int compared = 0;
+	int regressions = 0;
+
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to open %s.\n", filename);
+		return false;
+	}
+
+	silent_printf("\nBaseline %s, threshold %d%%\n", filename, BENCH_REGRESSION_PCT);
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		if (sscanf(line, "%63[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%lf,%lf,%lf", name, &update_s, &verify_s, &total_s) != 4)
+			continue;		// header
+
+		for (int i = 0; i < count; i++)
+		{
+			BENCH_RESULT_t *res = &results[i];
+			if (strcmp(res->name, name) != 0)
+				continue;
+
+			compared++;
+			double now_s = (res->update_us + res->verify_us) / 1e6;
+			double change = (total_s > 0) ? ((now_s - total_s) * 100.0) / total_s : 0;
+			if ((!res->ok) || (change > BENCH_REGRESSION_PCT))
+			{
+				silent_printf("REGRESSION %s\t%.3fs, was %.3fs (%+.1f%%)\n", name, now_s, total_s, change);
+				regressions++;
+			}
+			else if (change < -BENCH_REGRESSION_PCT)
+				silent_printf("improved %s\t%.3fs, was %.3fs (%+.1f%%)\n", name, now_s, total_s, change);
+		}
+	}
+	fclose(fp);
+
+	silent_printf("%d cases compared, %d regressions.\n", compared, regressions);
+	if (compared == 0)
+		silent_printf("No cases in %s match this benchmark.\n", filename);
+	return (compared != 0) && (regressions == 0);
+}
+
+/**************************************************************************************************
+* Run the benchmark sweep, write the results table and compare it with a baseline if given
+*/
+bool RunBenchmark(const char *results_file, const char *baseline_file)
+{
+	BENCH_RESULT_t results[BENCH_MAX_CASES];
+	int count = 0;
+	bool ok = true;
+
+	// the host's own progress output would swamp the table
+	bool quiet = opt_quiet;
+	bool silent = opt_silent;
+
+	silent_printf("Case\t\t\t\t\tUpdate\tVerify\tTransfers\tNAKed frames\n");
+	for (int p = 0; p < sizeof(bench_parts) / sizeof(bench_parts[0]); p++)
+	{
+		for (int s = 0; s < sizeof(bench_image_pct) / sizeof(bench_image_pct[0]); s++)
+		{
+			for (int m = 0; (m < BENCH_MODES) && (count < BENCH_MAX_CASES); m++)
+			{
+				BENCH_RESULT_t *res = &results[count];
+				opt_quiet = true;
+				opt_silent = true;
+				bool run = BenchRun(&bench_parts[p], bench_image_pct[s], (BENCH_MODE_t)m, res);
+				opt_quiet = quiet;
+				opt_silent = silent;
+				if (!run)
+				{
+					silent_printf("Unable to set up %s.\n", res->name);
+					return false;
+				}
+				count++;
+
+				silent_printf("%-40s", res->name);
+				if (!res->ok)
+				{
+					silent_printf("FAILED\n");
+					ok = false;
+					continue;
+				}
+				BenchPrintTime(res->update_us);
+				BenchPrintTime(res->verify_us);
+				silent_printf("%lu\t\t%lu\n", res->transfers, res->nak_frames);
+			}
+		}
+	}
+
+	if ((results_file != NULL) && (!BenchWriteResults(results_file, results, count)))
+		ok = false;
+	if ((baseline_file != NULL) && (!BenchCompare(baseline_file, results, count)))
+		ok = false;
+	return ok;
+}
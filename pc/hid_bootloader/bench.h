@@ -0,0 +1,64 @@
+// bench.h
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+
+// full speed USB timing model
+#define	BENCH_FRAME_US				1000		// full speed frame
+#define	BENCH_INTERVAL_FRAMES		4			// bInterval of the bootloader's interrupt endpoints (udi_hid_generic.h)
+#define	BENCH_HOST_US				150			// host stack turnaround, from one transfer completing to the next being queued
+#define	BENCH_SETUP_US				12			// SETUP token, 8 byte DATA0 and handshake
+#define	BENCH_HANDSHAKE_US			6			// zero length status stage
+#define	BENCH_PACKET_US(bytes)		(8 + (((bytes) * 56) / 72))	// token, data with bit stuffing and handshake
+
+// sweep
+#define	BENCH_REGRESSION_PCT		2			// slower than the baseline by more than this fails
+#define	BENCH_INFO_OFFSET			0x80		// FW_INFO_t in the synthetic images
+#define	BENCH_MAX_CASES				32
+
+
+typedef enum {
+	BENCH_MODE_RAW = 0,
+	BENCH_MODE_COMPRESSED,
+	BENCH_MODE_DELTA,
+	BENCH_MODES,
+} BENCH_MODE_t;
+
+typedef struct {
+	const char	*name;
+	uint8_t		signature[3];
+	uint32_t	flash_size;					// application section
+	uint16_t	page_size;
+	uint32_t	eeprom_size;
+	uint16_t	eeprom_page_size;
+} BENCH_PART_t;
+
+typedef struct {
+	char		name[64];
+	const BENCH_PART_t	*part;
+	uint32_t	image_bytes;
+	BENCH_MODE_t	mode;
+	bool		ok;
+	uint64_t	update_us;					// identify, check and write, on the bus model
+	uint64_t	verify_us;
+	uint32_t	transfers;
+	uint32_t	reports;					// page data reports
+	uint32_t	nak_frames;					// frames NAKed while the device was busy
+	uint64_t	flash_us;
+} BENCH_RESULT_t;
+
+
+extern SIMDEV_t *bench_device;
+extern const BENCH_PART_t bench_parts[];
+
+
+extern int BenchSendFeatureReport(const unsigned char *data, size_t length);
+extern int BenchGetFeatureReport(unsigned char *data, size_t length);
+extern int BenchWrite(const unsigned char *data, size_t length);
+extern int BenchReadTimeout(unsigned char *data, size_t length, int milliseconds);
+extern void BenchBuildImage(const BENCH_PART_t *part, uint32_t size, uint32_t seed);
+extern bool RunBenchmark(const char *results_file, const char *baseline_file);
+
+
+#endif
@@ -19,11 +19,54 @@
 #define CMD_READ_USER_SIG_ROW			0x0B
 #define CMD_READ_SERIAL					0x0C
 //#define CMD_READ_BOOTLOADER_VERSION		0x0D
-#define CMD_RESET_MCU					0x0E
+#define CMD_RESET_MCU					0x0E	// u32 = application length to write the boot record first, or 0
 #define CMD_READ_EEPROM					0x0F
 //#define CMD_WRITE_EEPROM				0x10
 #define CMD_WRITE_EEPROM_PAGE			0x10
 #define CMD_READ_EEPROM_CRC				0x11
+#define CMD_BLANK_CHECK					0x12
+#define CMD_WRITE_COMPRESSED_PAGE		0x13
+#define CMD_FILL_PAGES					0x14
+#define CMD_PATCH_PAGE					0x15
+#define CMD_READ_CAPABILITIES			0x16
+
+
+// CMD_FILL_PAGES params: u16[0] = fill pattern, u16[1] = first page | ((count-1) << 10)
+#define FILL_PAGE_MASK					0x03FF
+#define FILL_COUNT_SHIFT				10
+#define FILL_MAX_PAGES					64
+
+// The set feature handler has to finish before the control transfer's 50 ms status stage limit,
+// which bounds the work one command can do. A page write takes about 4 ms.
+#define FILL_BATCH_PAGES				8		// default max_batch
+
+// CMD_BLANK_CHECK params: u16[0] = first page, u16[1] = page count
+#define BLANK_CHECK_MAX_PAGES			64
+
+
+// CMD_READ_CAPABILITIES response, see BL_CAPS_t
+#define CAPS_VERSION					1
+
+#define CAP_BLANK_CHECK					0x0001
+#define CAP_BOOT_RECORD					0x0002
+#define CAP_EEPROM						0x0004
+#define CAP_USER_SIG_ROW				0x0008
+#define CAP_NVM_WAIT					0x0010	// commands wait for the NVM controller, no need to poll busy
+#define CAP_TAGGED						0x0020	// numbered responses
+
+#define ENC_RAW							0x01
+#define ENC_COMPRESSED					0x02
+#define ENC_FILL						0x04
+#define ENC_PATCH						0x08
+
+
+// tagged responses, the number of the last IN report queued is in the top bits of the status's
+// page_ptr, and every response echoes its own number in the last byte, leaving reads 63 bytes
+#define STATUS_PAGE_PTR_MASK			0x03FF
+#define STATUS_SEQ_SHIFT				10
+#define STATUS_SEQ_MASK					0x3F
+#define RESPONSE_SEQ_BYTE				63
+#define RESPONSE_DATA_BYTES				63		// bytes of data in a tagged read response
 
 
 #define	APP_SECTION_ERASE_TIMEOUT_MS	100
@@ -33,6 +76,11 @@
 #define	HID_DATA_BYTES					64
 
 
+// gcc spells MSVC's __pragma as _Pragma, for the tools that build on Linux
+#if !defined(_MSC_VER) && !defined(__pragma)
+#define __pragma(x) _Pragma(#x)
+#endif
+
 #define PACK( __Declaration__ ) __pragma( pack(push, 1) ) __Declaration__ __pragma( pack(pop) )
 
 PACK(
@@ -59,3 +107,24 @@ typedef struct
 	} params;
 } BLCOMMAND_t;
 )
+
+PACK(
+typedef struct
+{
+	uint8_t		caps_version;
+	uint8_t		bootloader_version;
+	uint16_t	features;			// CAP_*
+	uint8_t		encodings;			// ENC_*
+	uint8_t		page_buffers;		// 2 or more, the next page can be sent while one is written
+	uint8_t		max_batch;			// most pages written by one command
+	uint8_t		in_queue;			// responses held for the host
+	uint16_t	page_size;
+	uint32_t	app_section_size;
+	uint16_t	eeprom_size;
+	uint8_t		eeprom_page_size;
+	uint8_t		page_write_ms;		// NVM timing hints
+	uint8_t		page_erase_write_ms;
+	uint8_t		eeprom_write_ms;
+	uint16_t	app_erase_ms;
+} BL_CAPS_t;
+)
@@ -0,0 +1,340 @@
+// compress.c
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+
+
+/**************************************************************************************************
+* Decompress a page in place, exactly as the bootloader does. The compressed data is at the start
+* of the buffer, which must be the same size as the bootloader's page buffer. Returns false if the
+* data is corrupt or the output would overwrite input that has not been read yet.
+*/
+bool DecompressPageInPlace(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length)
+{
+	if ((length == 0) || (length > buffer_size))
+		return false;
+
+	uint8_t *in = buffer + buffer_size - length;
+	uint8_t *in_end = buffer + buffer_size;
+	uint8_t *out = buffer;
+	uint8_t *out_end = buffer + page_size;
+	memmove(in, buffer, length);
+
+	while (in < in_end)
+	{
+		uint8_t token = *in++;
+		uint8_t count;
+
+		if (token < 0x80)		// literal run
+		{
+			count = token + 1;
+			if ((in + count > in_end) || (out + count > out_end))
+				return false;
+			while (count--)
+				*out++ = *in++;
+		}
+		else					// match
+		{
+			if (in >= in_end)
+				return false;
+			count = (token & 0x7F) + COMPRESS_MATCH_MIN;
+			uint16_t offset = *in++ + 1;
+			if ((offset > (uint16_t)(out - buffer)) || (out + count > out_end))
+				return false;
+			uint8_t *src = out - offset;
+			while (count--)
+				*out++ = *src++;
+		}
+
+		if (out > in)
+			return false;
+	}
+
+	return (out == out_end);
+}
+
+/**************************************************************************************************
+* Greedy LZ compression of one page. buffer_size is the size of the bootloader's page buffer,
+* output must be at least that big. Returns the compressed length, or 0 if the page can't be sent
+* compressed (no smaller, or not decodable in place).
+*/
+uint16_t CompressPage(uint8_t *page, uint16_t page_size, uint8_t *output, uint16_t buffer_size)
+{
+	uint16_t	in = 0;
+	uint16_t	out = 0;
+	uint16_t	literal_start = 0;
+	uint16_t	literal_count = 0;
+
+	while (in < page_size)
+	{
+		// find longest match in window
+		uint16_t best_len = 0;
+		uint16_t best_offset = 0;
+		uint16_t max_len = page_size - in;
+		if (max_len > COMPRESS_MATCH_MAX)
+			max_len = COMPRESS_MATCH_MAX;
+		for (uint16_t offset = 1; (offset <= COMPRESS_WINDOW_SIZE) && (offset <= in); offset++)
+		{
+			uint16_t len = 0;
+			while ((len < max_len) && (page[in - offset + len] == page[in + len]))
+				len++;
+			if (len > best_len)
+			{
+				best_len = len;
+				best_offset = offset;
+				if (len == max_len)
+					break;
+			}
+		}
+
+		if ((best_len >= COMPRESS_MATCH_MIN) || (literal_count == COMPRESS_LITERAL_MAX))
+		{
+			// flush pending literals
+			if (literal_count > 0)
+			{
+				if (out + 1 + literal_count > buffer_size)
+					return 0;
+				output[out++] = literal_count - 1;
+				memcpy(&output[out], &page[literal_start], literal_count);
+				out += literal_count;
+				literal_count = 0;
+			}
+		}
+
+		if (best_len >= COMPRESS_MATCH_MIN)
+		{
+			if (out + 2 > buffer_size)
+				return 0;
+			output[out++] = 0x80 | (best_len - COMPRESS_MATCH_MIN);
+			output[out++] = best_offset - 1;
+			in += best_len;
+		}
+		else
+		{
+			if (literal_count == 0)
+				literal_start = in;
+			literal_count++;
+			in++;
+		}
+	}
+
+	if (literal_count > 0)
+	{
+		if (out + 1 + literal_count > buffer_size)
+			return 0;
+		output[out++] = literal_count - 1;
+		memcpy(&output[out], &page[literal_start], literal_count);
+		out += literal_count;
+	}
+
+	if (out >= page_size)
+		return 0;
+
+	// check the bootloader can decode it in place
+	uint8_t check[1024];
+	if (buffer_size > sizeof(check))
+		return 0;
+	memcpy(check, output, out);
+	if ((!DecompressPageInPlace(check, buffer_size, page_size, out)) || (memcmp(check, page, page_size) != 0))
+		return 0;
+
+	return out;
+}
+
+
+/**************************************************************************************************
+* Patch encoding. A patch rebuilds a page from literal data and copies of the flash contents
+* already on the device. Matches are found with a hash chain index of the base image.
+*/
+#define	PATCH_HASH_BITS				16
+#define	PATCH_CHAIN_LIMIT			256
+
+int32_t		patch_hash_head[1 << PATCH_HASH_BITS];
+int32_t		*patch_hash_chain = NULL;
+uint8_t		*patch_image = NULL;
+uint32_t	patch_image_size = 0;
+uint16_t	patch_page_size = 0;
+
+
+uint32_t PatchHash(uint8_t *data)
+{
+	uint32_t key = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+	return (key * 2654435761u) >> (32 - PATCH_HASH_BITS);
+}
+
+/**************************************************************************************************
+* Index the base image (current device flash contents) for patch encoding
+*/
+void PatchIndexBuild(uint8_t *image, uint32_t image_size, uint16_t page_size)
+{
+	patch_image = image;
+	patch_image_size = image_size;
+	patch_page_size = page_size;
+
+	free(patch_hash_chain);
+	patch_hash_chain = malloc(image_size * sizeof(int32_t));
+	memset(patch_hash_head, 0xFF, sizeof(patch_hash_head));
+
+	// insert in reverse so that chains run from low to high addresses
+	for (int32_t i = image_size - 4; i >= 0; i--)
+	{
+		uint32_t h = PatchHash(&image[i]);
+		patch_hash_chain[i] = patch_hash_head[h];
+		patch_hash_head[h] = i;
+	}
+}
+
+/**************************************************************************************************
+* Encode a page as a patch against the indexed image. Only pages marked in page_valid may be copied
+* from. Pages that are copied from are marked in pages_used, if not NULL. Returns the patch length,
+* or 0 if the patch can't be decoded in place in a buffer of buffer_size bytes.
+*/
+uint16_t EncodePatch(uint8_t *page, bool *page_valid, uint8_t *output, uint16_t buffer_size, bool *pages_used)
+{
+	uint16_t	in = 0;
+	uint16_t	out = 0;
+	uint16_t	literal_start = 0;
+	uint16_t	literal_count = 0;
+
+	while (in < patch_page_size)
+	{
+		// find longest copy from valid pages
+		uint32_t best_len = 0;
+		uint32_t best_addr = 0;
+		if (in + 4 <= patch_page_size)
+		{
+			int32_t candidate = patch_hash_head[PatchHash(&page[in])];
+			int chain = PATCH_CHAIN_LIMIT;
+			while ((candidate >= 0) && (chain-- > 0))
+			{
+				uint32_t len = 0;
+				while ((in + len < patch_page_size) &&
+					   (candidate + len < patch_image_size) &&
+					   (page_valid[(candidate + len) / patch_page_size]) &&
+					   (patch_image[candidate + len] == page[in + len]))
+					len++;
+				if (len > best_len)
+				{
+					best_len = len;
+					best_addr = candidate;
+					if (in + len == patch_page_size)
+						break;
+				}
+				candidate = patch_hash_chain[candidate];
+			}
+		}
+
+		if ((best_len >= PATCH_COPY_MIN) || (literal_count == PATCH_LITERAL_MAX))
+		{
+			if (literal_count > 0)
+			{
+				if (out + 1 + literal_count > buffer_size)
+					return 0;
+				output[out++] = literal_count - 1;
+				memcpy(&output[out], &page[literal_start], literal_count);
+				out += literal_count;
+				literal_count = 0;
+			}
+		}
+
+		if (best_len >= PATCH_COPY_MIN)
+		{
+			if (out + 5 > buffer_size)
+				return 0;
+			output[out++] = 0x80 | ((best_len - 1) >> 8);
+			output[out++] = (best_len - 1) & 0xFF;
+			output[out++] = best_addr & 0xFF;
+			output[out++] = (best_addr >> 8) & 0xFF;
+			output[out++] = (best_addr >> 16) & 0xFF;
+			if (pages_used != NULL)
+			{
+				for (uint32_t p = best_addr / patch_page_size; p <= (best_addr + best_len - 1) / patch_page_size; p++)
+					pages_used[p] = true;
+			}
+			in += best_len;
+		}
+		else
+		{
+			if (literal_count == 0)
+				literal_start = in;
+			literal_count++;
+			in++;
+		}
+	}
+
+	if (literal_count > 0)
+	{
+		if (out + 1 + literal_count > buffer_size)
+			return 0;
+		output[out++] = literal_count - 1;
+		memcpy(&output[out], &page[literal_start], literal_count);
+		out += literal_count;
+	}
+
+	// check the bootloader can decode it in place
+	uint8_t check[1024];
+	if (buffer_size > sizeof(check))
+		return 0;
+	memcpy(check, output, out);
+	if ((!PatchPageInPlace(check, buffer_size, patch_page_size, out, patch_image, patch_image_size)) ||
+		(memcmp(check, page, patch_page_size) != 0))
+		return 0;
+
+	return out;
+}
+
+/**************************************************************************************************
+* Rebuild a page in place from a patch, exactly as the bootloader does. flash holds the device's
+* flash contents. Returns false if the patch is corrupt or the output would overwrite input that
+* has not been read yet.
+*/
+bool PatchPageInPlace(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length, uint8_t *flash, uint32_t flash_size)
+{
+	if (length == 0)
+		return true;
+	if (length > buffer_size)
+		return false;
+
+	uint8_t *in = buffer + buffer_size - length;
+	uint8_t *in_end = buffer + buffer_size;
+	uint8_t *out = buffer;
+	uint8_t *out_end = buffer + page_size;
+	memmove(in, buffer, length);
+
+	while (in < in_end)
+	{
+		uint8_t token = *in++;
+		uint16_t count;
+
+		if (token < 0x80)		// literal run
+		{
+			count = token + 1;
+			if ((in + count > in_end) || (out + count > out_end))
+				return false;
+			while (count--)
+				*out++ = *in++;
+		}
+		else					// copy from flash
+		{
+			if (in + 4 > in_end)
+				return false;
+			count = (((uint16_t)(token & 0x7F) << 8) | in[0]) + 1;
+			uint32_t addr = in[1] | ((uint32_t)in[2] << 8) | ((uint32_t)in[3] << 16);
+			in += 4;
+			if ((out + count > out_end) || (addr + count > flash_size))
+				return false;
+			if (out + count > in)
+				return false;
+			memcpy(out, &flash[addr], count);
+			out += count;
+		}
+
+		if (out > in)
+			return false;
+	}
+
+	return (out == out_end);
+}
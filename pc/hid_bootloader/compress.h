@@ -0,0 +1,27 @@
+// compress.h
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+
+// compressed page format, must match firmware decompress.h
+#define	COMPRESS_LITERAL_MAX		128
+#define	COMPRESS_MATCH_MIN			3
+#define	COMPRESS_MATCH_MAX			130
+#define	COMPRESS_WINDOW_SIZE		256
+
+// patch format, must match firmware decompress.h
+#define	PATCH_LITERAL_MAX			128
+#define	PATCH_COPY_MIN				8		// copy token is 5 bytes, shorter copies aren't worth it
+#define	PATCH_COPY_MAX				32768
+
+
+extern uint16_t CompressPage(uint8_t *page, uint16_t page_size, uint8_t *output, uint16_t buffer_size);
+extern bool DecompressPageInPlace(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length);
+
+extern void PatchIndexBuild(uint8_t *image, uint32_t image_size, uint16_t page_size);
+extern uint16_t EncodePatch(uint8_t *page, bool *page_valid, uint8_t *output, uint16_t buffer_size, bool *pages_used);
+extern bool PatchPageInPlace(uint8_t *buffer, uint16_t buffer_size, uint16_t page_size, uint16_t length, uint8_t *flash, uint32_t flash_size);
+
+
+#endif
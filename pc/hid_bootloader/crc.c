@@ -135,4 +135,88 @@ uint32_t xmega_nvm_crc32(uint8_t *buffer, uint32_t buffer_length)
 	}
 
 	return crc_reg;
-}
\ No newline at end of file
+}
+/**************************************************************************************************
+* Shift the XMEGA CRC register once without feeding in data, which multiplies it by x modulo the
+* polynomial
+*/
+uint32_t xmega_crc_shift(uint32_t crc_reg)
+{
+	uint32_t help_a = (crc_reg << 1) & 0x00FFFFFE;
+	uint32_t help_b = (crc_reg & (1 << 23)) ? 0x00FFFFFF : 0;
+
+	return (help_a ^ (help_b & XMEGA_CRC32_POLY)) & 0x00FFFFFF;
+}
+
+/**************************************************************************************************
+* Product of two CRC register values modulo the polynomial
+*/
+uint32_t xmega_crc_mul(uint32_t a, uint32_t b)
+{
+	uint32_t res = 0;
+
+	for (int bit = 23; bit >= 0; bit--)
+	{
+		res = xmega_crc_shift(res);
+		if (b & (1UL << bit))
+			res ^= a;
+	}
+	return res;
+}
+
+/**************************************************************************************************
+* Continue an XMEGA NVM CRC over length bytes of erased (0xFF) flash. Each word shifts the register
+* and adds 0xFFFF, so after n words it is crc_reg * x^n + 0xFFFF * (1 + x + ... + x^(n-1)). Both
+* are built by squaring, in log2(n) steps instead of n.
+*/
+uint32_t xmega_nvm_crc32_erased(uint32_t crc_reg, uint32_t length)
+{
+	uint32_t words = length / 2;
+	uint32_t power = 1;			// x^m
+	uint32_t sum = 0;			// 1 + x + ... + x^(m-1)
+
+	for (int bit = 31; bit >= 0; bit--)
+	{
+		sum ^= xmega_crc_mul(power, sum);
+		power = xmega_crc_mul(power, power);
+		if (words & (1UL << bit))
+		{
+			sum = xmega_crc_shift(sum) ^ 1;
+			power = xmega_crc_shift(power);
+		}
+	}
+	return xmega_crc_mul(crc_reg, power) ^ xmega_crc_mul(0xFFFF, sum);
+}
+
+/**************************************************************************************************
+* Change in the XMEGA NVM CRC of length bytes when the change_length bytes at offset are XORed
+* with change. The CRC is linear, so only the changed words and the shifts after them matter.
+*/
+uint32_t xmega_nvm_crc32_delta(uint32_t length, uint32_t offset, uint8_t *change, uint32_t change_length)
+{
+	uint32_t first = offset / 2;
+	uint32_t last = (offset + change_length - 1) / 2;
+	uint32_t delta = 0;
+
+	for (uint32_t word = first; word <= last; word++)
+	{
+		uint32_t value = 0;
+		for (uint32_t i = 0; i < change_length; i++)
+		{
+			if ((offset + i) / 2 == word)
+				value |= (uint32_t)change[i] << (((offset + i) & 1) * 8);
+		}
+		delta = xmega_crc_shift(delta) ^ value;
+	}
+
+	// x^(words after the last change)
+	uint32_t shifts = (length / 2) - last - 1;
+	uint32_t power = 1;
+	for (int bit = 31; bit >= 0; bit--)
+	{
+		power = xmega_crc_mul(power, power);
+		if (shifts & (1UL << bit))
+			power = xmega_crc_shift(power);
+	}
+	return xmega_crc_mul(delta, power);
+}
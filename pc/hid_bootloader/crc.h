@@ -2,3 +2,5 @@
 
 extern uint32_t crc32(uint8_t *buffer, uint32_t buffer_length);
 extern uint32_t xmega_nvm_crc32(uint8_t *buffer, uint32_t buffer_length);
+extern uint32_t xmega_nvm_crc32_erased(uint32_t crc_reg, uint32_t length);
+extern uint32_t xmega_nvm_crc32_delta(uint32_t length, uint32_t offset, uint8_t *change, uint32_t change_length);
@@ -0,0 +1,612 @@
+// daemon.c
+//
+// Long running flashing service. Firmware images are loaded once at start up and kept in memory,
+// and other processes submit programming jobs over a local socket. Jobs run through the host
+// library (hidbl.c), so any number of devices can be programmed at once with the same hub
+// scheduling as gang mode, and bootloaders that are not reset stay open between jobs.
+//
+// The socket is an AF_UNIX stream socket, supported by Winsock since Windows 10 1803. Building it
+// needs afunix.h from the Windows 10 SDK (10.0.17134 or later), so the daemon is only compiled in
+// when HIDBL_DAEMON is defined. The project defines it when the SDK it builds with has afunix.h,
+// and compilers with __has_include find the header themselves. Each line sent to it is one job:
+//
+//	<job id> <image name> <serial|*> [verify] [reset]
+//
+// where * programs every attached bootloader that is not already busy. Events are sent back on
+// the same connection, one per line:
+//
+//	<job id> accepted <devices>
+//	<job id> <serial> <stage> [<done>/<total>]
+//	<job id> <serial> ok <ms>
+//	<job id> <serial> failed <stage>
+//	<job id> complete <passed>/<devices>
+//	<job id> error <message>
+//
+// Only the main thread touches jobs once they are posted. Connection threads parse jobs and post
+// them to the library context.
+//
+// Attached bootloaders are enumerated once at start up and then tracked from device notifications,
+// with their serial numbers read as they arrive, so a job only looks its devices up in the list.
+
+#if (!defined(HIDBL_DAEMON)) && defined(__has_include)
+#if __has_include(<afunix.h>)
+#define	HIDBL_DAEMON
+#endif
+#endif
+
+#include <stdio.h>
+#ifdef HIDBL_DAEMON
+#include <winsock2.h>
+#include <afunix.h>
+#endif
+#include <windows.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "gang.h"
+#include "sched.h"
+#include "engine.h"
+#include "hidbl.h"
+#include "hotplug.h"
+#include "daemon.h"
+
+
+#ifdef HIDBL_DAEMON
+
+DAEMON_IMAGE_t		daemon_images[DAEMON_MAX_IMAGES];
+int					daemon_image_count = 0;
+HIDBL_DEVICE_INFO_t	daemon_found[DAEMON_MAX_DEVICES];		// devices of the job being started
+HIDBL_DEVICE_INFO_t	daemon_devices[DAEMON_MAX_DEVICES];		// attached bootloaders
+int					daemon_device_count = 0;
+CRITICAL_SECTION	daemon_devices_lock;					// the list is updated by the hotplug thread
+unsigned short		daemon_vid, daemon_pid;
+HIDBL_CONTEXT_t		*daemon_ctx = NULL;
+SOCKET				daemon_listener = INVALID_SOCKET;
+DAEMON_JOB_t		daemon_stop;					// posted when the listener fails
+bool				daemon_stopping = false;
+
+
+/**************************************************************************************************
+* Send one event line to a client. Clients that have gone away are ignored.
+*/
+void DaemonSend(DAEMON_CONN_t *conn, const char *format, ...)
+{
+	char line[DAEMON_LINE_SIZE];
+	va_list args;
+
+	va_start(args, format);
+	int len = _vsnprintf(line, sizeof(line) - 2, format, args);
+	va_end(args);
+	if ((len < 0) || (len > (int)sizeof(line) - 2))
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	EnterCriticalSection(&conn->lock);
+	int sent = 0;
+	while (sent < len)
+	{
+		int n = send(conn->s, &line[sent], len - sent, 0);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+	LeaveCriticalSection(&conn->lock);
+}
+
+/**************************************************************************************************
+* Drop a reference to a connection, closing it when the last one is gone
+*/
+void DaemonRelease(DAEMON_CONN_t *conn)
+{
+	if (InterlockedDecrement(&conn->refs) != 0)
+		return;
+	closesocket(conn->s);
+	DeleteCriticalSection(&conn->lock);
+	free(conn);
+}
+
+/**************************************************************************************************
+* Serial number to report for a device, the bootloader's once it has been read
+*/
+const char *DaemonSerial(DAEMON_TASK_t *task, HIDBL_JOB_t *hj)
+{
+	if ((hj != NULL) && (hj->target.serial[0] != '\0'))
+		return hj->target.serial;
+	if (task->usb_serial[0] != '\0')
+		return task->usb_serial;
+	return "-";
+}
+
+/**************************************************************************************************
+* All of a job's devices have finished
+*/
+void DaemonJobComplete(DAEMON_JOB_t *job)
+{
+	DaemonSend(job->conn, "%s complete %d/%d", job->id, job->passed, job->count);
+	quiet_printf("Job %s: %d of %d devices programmed.\n", job->id, job->passed, job->count);
+	DaemonRelease(job->conn);
+	free(job);
+}
+
+/**************************************************************************************************
+* Add a device to the list, or update its serial number if it is already there. The list lock
+* must be held.
+*/
+void DaemonAddDevice(const char *path, const char *serial)
+{
+	int i;
+
+	for (i = 0; i < daemon_device_count; i++)
+	{
+		if (_stricmp(daemon_devices[i].path, path) == 0)
+			break;
+	}
+	if (i >= DAEMON_MAX_DEVICES)
+		return;
+	if (i == daemon_device_count)
+		daemon_device_count++;
+
+	memset(&daemon_devices[i], 0, sizeof(HIDBL_DEVICE_INFO_t));
+	strncpy(daemon_devices[i].path, path, MAX_PATH - 1);
+	strncpy(daemon_devices[i].serial, serial, BUFFER_SIZE - 1);
+}
+
+/**************************************************************************************************
+* Read the USB serial number of a device that has just arrived. The arrival can be reported
+* slightly before the device is ready to open, so it is retried briefly.
+*/
+bool DaemonReadSerial(const char *path, char *serial, size_t size)
+{
+	wchar_t wstr[MAX_STR];
+
+	for (int i = 0; i < HOTPLUG_OPEN_RETRIES; i++)
+	{
+		hid_device *handle = hid_open_path(path);
+		if (handle != NULL)
+		{
+			serial[0] = '\0';
+			if (hid_get_serial_number_string(handle, wstr, MAX_STR) == 0)
+			{
+				_snprintf(serial, size - 1, "%ls", wstr);
+				serial[size - 1] = '\0';
+			}
+			hid_close(handle);
+			return true;
+		}
+		Sleep(HOTPLUG_OPEN_RETRY_MS);
+	}
+	return false;
+}
+
+/**************************************************************************************************
+* Hotplug callback, keeps the device list up to date and has the library close devices that are
+* unplugged. Runs on the hotplug thread.
+*/
+void DaemonDeviceChanged(const char *path, bool arrived)
+{
+	char serial[BUFFER_SIZE];
+
+	if (arrived && (!DaemonReadSerial(path, serial, sizeof(serial))))
+		return;
+
+	EnterCriticalSection(&daemon_devices_lock);
+	if (arrived)
+		DaemonAddDevice(path, serial);
+	else
+	{
+		for (int i = 0; i < daemon_device_count; i++)
+		{
+			if (_stricmp(daemon_devices[i].path, path) == 0)
+			{
+				daemon_devices[i] = daemon_devices[--daemon_device_count];
+				break;
+			}
+		}
+	}
+	LeaveCriticalSection(&daemon_devices_lock);
+
+	if ((!arrived) && (daemon_ctx != NULL))
+		HidblRemoveDevice(daemon_ctx, path);
+}
+
+/**************************************************************************************************
+* Start tracking attached bootloaders. Notifications are registered for before enumerating, so
+* that none can arrive unnoticed in between.
+*/
+bool DaemonWatchDevices(void)
+{
+	InitializeCriticalSection(&daemon_devices_lock);
+	if (!HotplugWatch(daemon_vid, daemon_pid, DaemonDeviceChanged))
+		return false;
+
+	int count = HidblEnumerate(daemon_vid, daemon_pid, daemon_found, DAEMON_MAX_DEVICES);
+	EnterCriticalSection(&daemon_devices_lock);
+	for (int i = 0; i < count; i++)
+		DaemonAddDevice(daemon_found[i].path, daemon_found[i].serial);
+	LeaveCriticalSection(&daemon_devices_lock);
+	return true;
+}
+
+/**************************************************************************************************
+* Find the devices for a job and submit them to the library
+*/
+void DaemonStartJob(DAEMON_JOB_t *job)
+{
+	wchar_t wstr[MAX_STR];
+	PLAN_IMAGE_t *image = NULL;
+	bool any = (strcmp(job->serial, "*") == 0);
+	bool busy = false;
+	int found = 0;
+
+	for (int i = 0; i < daemon_image_count; i++)
+	{
+		if (strcmp(daemon_images[i].name, job->image) == 0)
+			image = &daemon_images[i].image;
+	}
+	if (image == NULL)
+	{
+		DaemonSend(job->conn, "%s error unknown image %s", job->id, job->image);
+		DaemonRelease(job->conn);
+		free(job);
+		return;
+	}
+
+	// copy the devices that were asked for out of the list
+	EnterCriticalSection(&daemon_devices_lock);
+	for (int i = 0; i < daemon_device_count; i++)
+	{
+		if ((!any) && (_stricmp(daemon_devices[i].serial, job->serial) != 0))
+			continue;
+		mbstowcs(wstr, daemon_devices[i].serial, MAX_STR - 1);
+		wstr[MAX_STR - 1] = L'\0';
+		if (!SerialSelected(wstr))
+			continue;
+		if (HidblBusy(daemon_ctx, daemon_devices[i].path))
+		{
+			busy = true;
+			continue;
+		}
+		daemon_found[found++] = daemon_devices[i];
+		if (!any)
+			break;
+	}
+	LeaveCriticalSection(&daemon_devices_lock);
+
+	if (found == 0)
+	{
+		DaemonSend(job->conn, "%s error %s", job->id, busy ? "device busy" : "no device found");
+		DaemonRelease(job->conn);
+		free(job);
+		return;
+	}
+
+	// events only arrive from the next HidblPoll(), so the job can't finish during this loop
+	job->count = found;
+	job->remaining = found;
+	DaemonSend(job->conn, "%s accepted %d", job->id, found);
+	int options = (job->verify ? HIDBL_OPT_VERIFY : 0) | (job->reset ? HIDBL_OPT_RESET : 0);
+	for (int i = 0; i < found; i++)
+	{
+		DAEMON_TASK_t *task = calloc(1, sizeof(DAEMON_TASK_t));
+		if (task != NULL)
+		{
+			task->job = job;
+			strcpy(task->usb_serial, daemon_found[i].serial);
+			if (HidblSubmit(daemon_ctx, daemon_found[i].path, image, options, task) != NULL)
+				continue;
+		}
+		DaemonSend(job->conn, "%s %s failed queue", job->id, (daemon_found[i].serial[0] != '\0') ? daemon_found[i].serial : "-");
+		free(task);
+		job->remaining--;
+	}
+	if (job->remaining == 0)
+		DaemonJobComplete(job);
+}
+
+/**************************************************************************************************
+* Library callback, runs on the main thread from HidblPoll()
+*/
+void DaemonEvent(HIDBL_CONTEXT_t *ctx, HIDBL_EVENT_t *event)
+{
+	DAEMON_TASK_t *task = (DAEMON_TASK_t *)event->user;
+
+	switch (event->type)
+	{
+	case HIDBL_EVENT_USER:
+		if (event->user == &daemon_stop)
+			daemon_stopping = true;
+		else
+			DaemonStartJob((DAEMON_JOB_t *)event->user);
+		break;
+
+	case HIDBL_EVENT_STAGE:
+		task->progress = 0;
+		DaemonSend(task->job->conn, "%s %s %s", task->job->id, DaemonSerial(task, NULL), event->stage);
+		break;
+
+	case HIDBL_EVENT_PROGRESS:
+	{
+		int percent = (event->done * 100) / event->total;
+		if ((percent >= task->progress + DAEMON_PROGRESS_STEP) || (event->done == event->total))
+		{
+			task->progress = percent;
+			DaemonSend(task->job->conn, "%s %s %s %d/%d", task->job->id, DaemonSerial(task, NULL), event->stage, event->done, event->total);
+		}
+		break;
+	}
+
+	case HIDBL_EVENT_DONE:
+	{
+		DAEMON_JOB_t *job = task->job;
+		HIDBL_JOB_t *hj = event->job;
+		if (hj->result)
+		{
+			job->passed++;
+			DaemonSend(job->conn, "%s %s ok %lu", job->id, DaemonSerial(task, hj), hj->time_ms);
+		}
+		else
+			DaemonSend(job->conn, "%s %s failed %s", job->id, DaemonSerial(task, hj), hj->stage);
+		HidblFreeJob(hj);
+		free(task);
+		if (--job->remaining == 0)
+			DaemonJobComplete(job);
+		break;
+	}
+	}
+}
+
+/**************************************************************************************************
+* Parse one line from a client and hand it to the engine thread
+*/
+void DaemonParseJob(DAEMON_CONN_t *conn, char *line)
+{
+	char word[16];
+	int pos, n;
+
+	int len = (int)strlen(line);
+	if ((len > 0) && (line[len - 1] == '\r'))
+		line[--len] = '\0';
+	if (sscanf(line, "%15s", word) != 1)		// blank line
+		return;
+
+	DAEMON_JOB_t *job = calloc(1, sizeof(DAEMON_JOB_t));
+	if (job == NULL)
+	{
+		DaemonSend(conn, "- error out of memory");
+		return;
+	}
+	job->conn = conn;
+	job->verify = opt_verify;
+	job->reset = opt_reset;
+
+	if (sscanf(line, "%31s %31s %64s%n", job->id, job->image, job->serial, &pos) != 3)
+	{
+		DaemonSend(conn, "%s error expected <job id> <image> <serial|*> [verify] [reset]", (job->id[0] != '\0') ? job->id : "-");
+		free(job);
+		return;
+	}
+	while (sscanf(&line[pos], "%15s%n", word, &n) == 1)
+	{
+		if (strcmp(word, "verify") == 0)
+			job->verify = true;
+		else if (strcmp(word, "reset") == 0)
+			job->reset = true;
+		else
+		{
+			DaemonSend(conn, "%s error unknown option %s", job->id, word);
+			free(job);
+			return;
+		}
+		pos += n;
+	}
+
+	InterlockedIncrement(&conn->refs);
+	if (!HidblPost(daemon_ctx, job))
+	{
+		DaemonSend(conn, "%s error daemon not running", job->id);
+		DaemonRelease(conn);
+		free(job);
+	}
+}
+
+/**************************************************************************************************
+* Connection thread, reads jobs one line at a time until the client disconnects
+*/
+DWORD WINAPI DaemonConnection(LPVOID param)
+{
+	DAEMON_CONN_t *conn = (DAEMON_CONN_t *)param;
+	char buffer[DAEMON_LINE_SIZE];
+	int used = 0;
+
+	for (;;)
+	{
+		int n = recv(conn->s, &buffer[used], sizeof(buffer) - 1 - used, 0);
+		if (n <= 0)
+			break;
+		used += n;
+
+		char *start = buffer;
+		char *end;
+		while ((end = memchr(start, '\n', used - (int)(start - buffer))) != NULL)
+		{
+			*end = '\0';
+			DaemonParseJob(conn, start);
+			start = end + 1;
+		}
+		used -= (int)(start - buffer);
+		memmove(buffer, start, used);
+
+		if (used == sizeof(buffer) - 1)
+		{
+			DaemonSend(conn, "- error line too long");
+			used = 0;
+		}
+	}
+
+	DaemonRelease(conn);
+	return 0;
+}
+
+/**************************************************************************************************
+* Listener thread, starts a connection thread for each client
+*/
+DWORD WINAPI DaemonListen(LPVOID param)
+{
+	for (;;)
+	{
+		SOCKET s = accept(daemon_listener, NULL, NULL);
+		if (s == INVALID_SOCKET)
+			break;
+
+		DAEMON_CONN_t *conn = calloc(1, sizeof(DAEMON_CONN_t));
+		if (conn == NULL)
+		{
+			closesocket(s);
+			continue;
+		}
+		conn->s = s;
+		conn->refs = 1;
+		InitializeCriticalSection(&conn->lock);
+
+		HANDLE thread = CreateThread(NULL, 0, DaemonConnection, conn, 0, NULL);
+		if (thread == NULL)
+			DaemonRelease(conn);
+		else
+			CloseHandle(thread);
+	}
+
+	HidblPost(daemon_ctx, &daemon_stop);
+	return 0;
+}
+
+/**************************************************************************************************
+* Load the images named on the command line, each given as name=file
+*/
+bool DaemonLoadImages(char **image_args, int image_count)
+{
+	if (image_count > DAEMON_MAX_IMAGES)
+	{
+		silent_printf("Too many images, at most %d can be loaded.\n", DAEMON_MAX_IMAGES);
+		return false;
+	}
+
+	for (int i = 0; i < image_count; i++)
+	{
+		char *file = strchr(image_args[i], '=');
+		if ((file == NULL) || (file == image_args[i]) || (file - image_args[i] >= DAEMON_NAME_SIZE))
+		{
+			silent_printf("Bad image %s, expected <name>=<firmware.hex|firmware.plan>\n", image_args[i]);
+			return false;
+		}
+
+		DAEMON_IMAGE_t *di = &daemon_images[daemon_image_count];
+		memset(di, 0, sizeof(DAEMON_IMAGE_t));
+		memcpy(di->name, image_args[i], file - image_args[i]);
+		file++;
+
+		if (!HidblLoadImage(file, basefile, opt_compress, true, &di->image))
+		{
+			silent_printf("Unable to load %s.\n", file);
+			return false;
+		}
+		quiet_printf("%s:\t%s, version %u.%02u, CRC 0x%lX, %d operations%s\n", di->name, file,
+					 di->image.fw_info->version_major, di->image.fw_info->version_minor, di->image.crc,
+					 di->image.entry_count, di->image.erase ? "" : ", delta");
+		daemon_image_count++;
+	}
+
+	return true;
+}
+
+/**************************************************************************************************
+* Run as a flashing daemon, taking jobs on socket_path until the socket fails
+*/
+int RunDaemon(char *socket_path, unsigned short vid, unsigned short pid, char **image_args, int image_count, int hub_budget)
+{
+	WSADATA wsa;
+	SOCKADDR_UN addr;
+
+	daemon_vid = vid;
+	daemon_pid = pid;
+	if (!DaemonLoadImages(image_args, image_count))
+		return 1;
+	if (!DaemonWatchDevices())
+	{
+		silent_printf("Unable to register for device notifications.\n");
+		return 1;
+	}
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+	{
+		silent_printf("Unable to start Winsock.\n");
+		return 1;
+	}
+
+	// an existing file is not replaced, in case the path is wrong
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	daemon_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((daemon_listener == INVALID_SOCKET) ||
+		(bind(daemon_listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) ||
+		(listen(daemon_listener, SOMAXCONN) == SOCKET_ERROR))
+	{
+		silent_printf("Unable to listen on %s, remove it if it was left by an earlier run.\n", socket_path);
+		WSACleanup();
+		return 1;
+	}
+
+	daemon_ctx = HidblCreate(DAEMON_MAX_DEVICES, hub_budget, DaemonEvent, NULL);
+	if (daemon_ctx == NULL)
+	{
+		closesocket(daemon_listener);
+		WSACleanup();
+		return 1;
+	}
+
+	HANDLE thread = CreateThread(NULL, 0, DaemonListen, NULL, 0, NULL);
+	if (thread == NULL)
+	{
+		HidblDestroy(daemon_ctx);
+		closesocket(daemon_listener);
+		WSACleanup();
+		return 1;
+	}
+	CloseHandle(thread);
+
+	silent_printf("Listening on %s with %d images.\n", socket_path, daemon_image_count);
+
+	// jobs already running are finished before stopping
+	while ((HidblPoll(daemon_ctx, ENGINE_POLL_MS) != 0) || (!daemon_stopping))
+		;
+
+	silent_printf("Listener failed, daemon stopped.\n");
+	HidblDestroy(daemon_ctx);
+	for (int i = 0; i < daemon_image_count; i++)
+		FreePlanImage(&daemon_images[i].image);
+	closesocket(daemon_listener);
+	WSACleanup();
+	return 1;
+}
+
+#else
+
+/**************************************************************************************************
+* Built without the daemon, AF_UNIX sockets need a newer Windows SDK
+*/
+int RunDaemon(char *socket_path, unsigned short vid, unsigned short pid, char **image_args, int image_count, int hub_budget)
+{
+	silent_printf("Built without daemon support, build with the Windows 10 SDK 10.0.17134 or later (or define HIDBL_DAEMON).\n");
+	return 1;
+}
+
+#endif
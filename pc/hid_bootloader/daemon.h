@@ -0,0 +1,51 @@
+// daemon.h
+
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+
+#define	DAEMON_MAX_IMAGES			16
+#define	DAEMON_MAX_DEVICES			256		// devices attached at once
+#define	DAEMON_NAME_SIZE			32
+#define	DAEMON_LINE_SIZE			256
+#define	DAEMON_PROGRESS_STEP		10		// percent between progress events
+
+
+// firmware image loaded at start up
+typedef struct {
+	char			name[DAEMON_NAME_SIZE];
+	PLAN_IMAGE_t	image;
+} DAEMON_IMAGE_t;
+
+// client connection, shared by the connection thread and its jobs
+typedef struct {
+	SOCKET				s;
+	CRITICAL_SECTION	lock;				// one event is sent at a time
+	volatile LONG		refs;
+} DAEMON_CONN_t;
+
+// job submitted by a client, freed when its last device finishes
+typedef struct {
+	DAEMON_CONN_t	*conn;
+	char			id[DAEMON_NAME_SIZE];
+	char			image[DAEMON_NAME_SIZE];
+	char			serial[BUFFER_SIZE];	// * for every idle device
+	bool			verify;
+	bool			reset;
+	int				count;
+	int				remaining;
+	int				passed;
+} DAEMON_JOB_t;
+
+// one device of a job
+typedef struct {
+	DAEMON_JOB_t	*job;
+	char			usb_serial[BUFFER_SIZE];
+	int				progress;				// last percent reported
+} DAEMON_TASK_t;
+
+
+extern int RunDaemon(char *socket_path, unsigned short vid, unsigned short pid, char **image_args, int image_count, int hub_budget);
+
+
+#endif
@@ -0,0 +1,813 @@
+// engine.c
+//
+// Event driven programming engine. Every device handle is opened for overlapped I/O and associated
+// with one I/O completion port. Each device runs the update as a state machine with one transfer in
+// flight at a time, and a single thread advances whichever device completes next. This keeps
+// hundreds of devices busy without a thread per device.
+//
+// Devices are grouped by hub, and only the hub's budget of devices stream page data or read back
+// flash at once (see sched.c). The rest wait for a slot while others are programming flash.
+//
+// The engine talks to the HID class driver directly rather than through hidapi, whose calls block
+// until the transfer is complete.
+
+#include <stdio.h>
+#include <windows.h>
+#include <winioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "crc.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "trace.h"
+#include "gang.h"
+#include "sched.h"
+#include "engine.h"
+
+
+// from inc/ddk/hidclass.h, part of the Windows DDK
+#define HID_IN_CTL_CODE(id)			CTL_CODE(FILE_DEVICE_KEYBOARD, (id), METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define HID_OUT_CTL_CODE(id)		CTL_CODE(FILE_DEVICE_KEYBOARD, (id), METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define IOCTL_HID_SET_FEATURE		HID_IN_CTL_CODE(100)
+#define IOCTL_HID_GET_FEATURE		HID_OUT_CTL_CODE(100)
+#define IOCTL_HID_FLUSH_QUEUE		CTL_CODE(FILE_DEVICE_KEYBOARD, 101, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+
+/**************************************************************************************************
+* Start an overlapped transfer. Completion is reported through the port.
+*/
+bool EngineIssue(ENGINE_DEVICE_t *ed, ENGINE_OP_t op)
+{
+	BOOL res = FALSE;
+
+	memset(&ed->ol, 0, sizeof(ed->ol));
+	ed->op = op;
+	ed->cancelled = false;
+	ed->deadline = GetTickCount() + ENGINE_TIMEOUT_MS;
+	ed->op_start = TimingClock();
+
+	switch (op)
+	{
+	case ENGINE_OP_SET_FEATURE:
+		ed->cmd_start = ed->op_start;
+		res = DeviceIoControl(ed->handle, IOCTL_HID_SET_FEATURE, &ed->cmd, sizeof(ed->cmd), NULL, 0, NULL, &ed->ol);
+		break;
+
+	case ENGINE_OP_GET_FEATURE:
+		memset(&ed->status, 0, sizeof(ed->status));
+		res = DeviceIoControl(ed->handle, IOCTL_HID_GET_FEATURE, &ed->status, sizeof(ed->status), &ed->status, sizeof(ed->status), NULL, &ed->ol);
+		break;
+
+	case ENGINE_OP_READ_REPORT:
+		res = ReadFile(ed->handle, ed->report, BUFFER_SIZE, NULL, &ed->ol);
+		break;
+
+	case ENGINE_OP_WRITE_REPORT:
+		res = WriteFile(ed->handle, ed->report, BUFFER_SIZE, NULL, &ed->ol);
+		break;
+
+	case ENGINE_OP_FLUSH:
+		res = DeviceIoControl(ed->handle, IOCTL_HID_FLUSH_QUEUE, NULL, 0, NULL, 0, NULL, &ed->ol);
+		break;
+
+	default:
+		break;
+	}
+
+	if ((!res) && (GetLastError() != ERROR_IO_PENDING))
+	{
+		ed->op = ENGINE_OP_NONE;
+		return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Send a bootloader command, optionally followed by reading its response report. Older bootloaders
+* queue a report after commands without a response too, so the HID driver's buffer is flushed
+* first or the read would return one of those instead.
+*/
+bool EngineCommand(ENGINE_DEVICE_t *ed, uint8_t command, uint32_t params, bool want_response)
+{
+	ed->cmd.report_id = 0;
+	ed->cmd.command = command;
+	ed->cmd.params.u32 = params;
+	ed->want_response = want_response;
+	return EngineIssue(ed, want_response ? ENGINE_OP_FLUSH : ENGINE_OP_SET_FEATURE);
+}
+
+bool EngineSendEntry(ENGINE_DEVICE_t *ed);
+bool EngineVerifyNext(ENGINE_DEVICE_t *ed);
+void EngineFail(ENGINE_DEVICE_t *ed);
+
+/**************************************************************************************************
+* Move on to a new stage of the update
+*/
+void EngineSetStage(ENGINE_DEVICE_t *ed, const char *stage)
+{
+	ed->dev->stage = stage;
+	if (ed->engine->progress != NULL)
+		ed->engine->progress(ed, 0, 0);
+}
+
+/**************************************************************************************************
+* Continue after a step that returned. False means the device failed, unless it already finished.
+*/
+void EngineCheck(ENGINE_DEVICE_t *ed, bool ok)
+{
+	if ((!ok) && (ed->state != ENGINE_DONE) && (ed->state != ENGINE_FAILED))
+		EngineFail(ed);
+}
+
+/**************************************************************************************************
+* Get a streaming slot on the device's hub. False if the device has to wait for one, it is
+* resumed when another device releases its slot.
+*/
+bool EngineAcquireSlot(ENGINE_DEVICE_t *ed)
+{
+	if (ed->slot)
+		return true;
+	if (!SchedAcquire(&ed->engine->sched, ed->hub, ed->index))
+	{
+		ed->parked = true;
+		ed->park_start = TimingClock();
+		return false;
+	}
+	ed->slot = true;
+	return true;
+}
+
+/**************************************************************************************************
+* Release the device's streaming slot, passing it on to a waiting device on the same hub
+*/
+void EngineReleaseSlot(ENGINE_DEVICE_t *ed)
+{
+	if (!ed->slot)
+		return;
+	ed->slot = false;
+
+	int next = SchedRelease(&ed->engine->sched, ed->hub);
+	if (next == -1)
+		return;
+
+	ENGINE_DEVICE_t *waiting = &ed->engine->devices[next];
+	waiting->parked = false;
+	waiting->slot = true;
+	TraceRecord(waiting->index, TRACE_SLOT_WAIT, TRACE_NO_COMMAND, NULL, 0, waiting->park_start, true);
+	if (waiting->abort)
+		EngineFail(waiting);
+	else if (waiting->state == ENGINE_VERIFY)
+		EngineCheck(waiting, EngineVerifyNext(waiting));
+	else
+		EngineCheck(waiting, EngineSendEntry(waiting));
+}
+
+/**************************************************************************************************
+* Close a device that has no transfer in flight. A device that was updated without being reset can
+* be kept open for the next update.
+*/
+void EngineClose(ENGINE_DEVICE_t *ed)
+{
+	EngineReleaseSlot(ed);
+	if ((ed->handle != INVALID_HANDLE_VALUE) && ((!ed->keep_open) || (ed->state != ENGINE_DONE) || ed->reset))
+	{
+		CloseHandle(ed->handle);
+		ed->handle = INVALID_HANDLE_VALUE;
+	}
+	TimingEnd(ed->dev->timing);
+	ed->dev->time_ms = GetTickCount() - ed->start;
+	ed->engine->active--;
+	if (ed->engine->finished != NULL)
+		ed->engine->finished(ed);
+}
+
+/**************************************************************************************************
+* Device failed at its current stage
+*/
+void EngineFail(ENGINE_DEVICE_t *ed)
+{
+	if (ed->abort)
+		ed->dev->stage = "cancelled";
+	ed->state = ENGINE_FAILED;
+	ed->dev->result = false;
+	EngineClose(ed);
+}
+
+/**************************************************************************************************
+* Reset the target if requested, then finish
+*/
+bool EngineFinish(ENGINE_DEVICE_t *ed)
+{
+	if (ed->reset && (ed->state != ENGINE_RESET))
+	{
+		EngineSetStage(ed, "reset");
+		TimingPhase(ed->dev->timing, TIMING_RESET);
+		ed->state = ENGINE_RESET;
+		BL_TARGET_t *target = &ed->dev->target;
+		bool boot_record = (!target->has_caps) || (target->caps.features & CAP_BOOT_RECORD);
+		return EngineCommand(ed, CMD_RESET_MCU, boot_record ? PlanImageLength(ed->image) : 0, false);
+	}
+
+	ed->state = ENGINE_DONE;
+	ed->dev->stage = "done";
+	ed->dev->result = true;
+	EngineClose(ed);
+	return true;
+}
+
+/**************************************************************************************************
+* Send the next report or command for the current plan entry, or move on to the CRC check when
+* all entries have been written. Entries the bootloader can't decode are expanded and written one
+* raw page at a time, like WriteEntryRaw() does.
+*/
+bool EngineSendEntry(ENGINE_DEVICE_t *ed)
+{
+	BL_TARGET_t *target = &ed->dev->target;
+
+	if (ed->entry >= ed->image->entry_count)
+	{
+		TimingPhase(ed->dev->timing, TIMING_CRC);
+		ed->state = ENGINE_CRC;
+		return EngineCommand(ed, CMD_READ_FLASH_CRCS, 0, true);
+	}
+
+	PLAN_ENTRY_t *entry = &ed->image->entries[ed->entry];
+	bool raw = !TargetEncoding(target, entry->encoding);
+	uint8_t *data = &ed->image->payload[entry->payload_offset];
+	int length = (entry->encoding == PLAN_ENCODING_FILL) ? 0 : entry->length;
+	if (raw)
+	{
+		if ((ed->byte == 0) && (!ExpandEntryPage(ed->image, entry, ed->page_data)))
+			return false;
+		data = ed->page_data;
+		length = ed->image->fw_info->page_size_b;
+	}
+
+	if (ed->byte < length)
+	{
+		if (ed->state != ENGINE_PAGE_DATA)		// waiting for a slot counts as streaming
+			TimingPhase(ed->dev->timing, TIMING_STREAM);
+		ed->state = ENGINE_PAGE_DATA;
+		if (!EngineAcquireSlot(ed))
+			return true;
+		ed->report[0] = 0;	// mandatory report ID
+		memset(&ed->report[1], 0xFF, HID_DATA_BYTES);
+		memcpy(&ed->report[1], &data[ed->byte], min(HID_DATA_BYTES, length - ed->byte));
+		ed->byte += HID_DATA_BYTES;
+		return EngineIssue(ed, ENGINE_OP_WRITE_REPORT);
+	}
+
+	// fill runs are split to what the bootloader takes in one command
+	PLAN_ENTRY_t part = *entry;
+	part.page = entry->page + ed->sub;
+	part.count = entry->count - ed->sub;
+	if (raw)
+	{
+		part.encoding = PLAN_ENCODING_RAW;
+		part.count = 1;
+	}
+	else
+		part.count = min(part.count, (target->caps.max_batch != 0) ? min(target->caps.max_batch, FILL_MAX_PAGES) : FILL_BATCH_PAGES);
+	ed->part = part.count;
+
+	// the device doesn't need the bus while it writes flash
+	EngineReleaseSlot(ed);
+	TimingPhase(ed->dev->timing, TIMING_NVM);
+	ed->state = ENGINE_PAGE_WRITE;
+	PlanEntryCommand(&part, &ed->cmd);
+	ed->want_response = false;
+	return EngineIssue(ed, ENGINE_OP_SET_FEATURE);
+}
+
+/**************************************************************************************************
+* Check if the device can blank check pages itself. Bootloaders without it have their unpopulated
+* pages read back instead, like VerifyFirmware() does.
+*/
+bool EngineBlankCheck(ENGINE_DEVICE_t *ed)
+{
+	return ed->dev->target.has_caps && (ed->dev->target.caps.features & CAP_BLANK_CHECK);
+}
+
+/**************************************************************************************************
+* Blank check the next run of unpopulated pages or read back the next part of a page
+*/
+bool EngineVerifyNext(ENGINE_DEVICE_t *ed)
+{
+	PLAN_IMAGE_t *image = ed->image;
+	int num_pages = image->fw_info->flash_size_b / image->fw_info->page_size_b;
+
+	if (ed->page >= num_pages)
+		return EngineFinish(ed);
+
+	if (((ed->next >= image->page_count) || (image->pages[ed->next].page != ed->page)) && EngineBlankCheck(ed))
+	{
+		if (ed->next < image->page_count)
+			ed->run = image->pages[ed->next].page - ed->page;
+		else
+			ed->run = num_pages - ed->page;
+		ed->run = min(ed->run, BLANK_CHECK_MAX_PAGES);
+		return EngineCommand(ed, CMD_BLANK_CHECK, ed->page | (ed->run << 16), true);
+	}
+
+	ed->run = 0;
+	if (!EngineAcquireSlot(ed))
+		return true;
+	return EngineCommand(ed, CMD_READ_FLASH, (ed->page * image->fw_info->page_size_b) + ed->offset, true);
+}
+
+/**************************************************************************************************
+* Check the target matches the image once its capabilities are known, then start writing
+*/
+bool EngineCheckTarget(ENGINE_DEVICE_t *ed)
+{
+	PLAN_IMAGE_t *image = ed->image;
+	BL_TARGET_t *target = &ed->dev->target;
+
+	EngineSetStage(ed, "check");
+	if (memcmp(&image->fw_info->mcu_signature, target->mcu_id, 3) != 0)
+		return false;
+	if (target->has_caps && (target->caps.page_size != image->fw_info->page_size_b))
+		return false;
+	if (!image->erase)
+	{
+		if (!TargetEncoding(target, PLAN_ENCODING_PATCH))
+			return false;
+		TimingPhase(ed->dev->timing, TIMING_LOAD);
+		ed->state = ENGINE_BASE_CRC;
+		return EngineCommand(ed, CMD_READ_FLASH_CRCS, 0, true);
+	}
+	EngineSetStage(ed, "write");
+	TimingPhase(ed->dev->timing, TIMING_ERASE);
+	ed->state = ENGINE_ERASE;
+	return EngineCommand(ed, CMD_ERASE_APP_SECTION, 0, false);
+}
+
+/**************************************************************************************************
+* The last command or report of the current state is complete, decide what to do next
+*/
+bool EngineStep(ENGINE_DEVICE_t *ed)
+{
+	PLAN_IMAGE_t *image = ed->image;
+	uint8_t *response = &ed->report[1];
+	uint32_t value = response[0] | (response[1] << 8) | (response[2] << 16) | (response[3] << 24);
+
+	switch (ed->state)
+	{
+	case ENGINE_SERIAL:
+		response[HID_DATA_BYTES - 1] = '\0';		// ensure string is null terminated
+		memcpy(ed->dev->target.serial, response, HID_DATA_BYTES);
+		ed->state = ENGINE_INFO;
+		return EngineCommand(ed, CMD_READ_MCU_IDS, 0, true);
+
+	case ENGINE_INFO:
+		memcpy(ed->dev->target.mcu_id, response, 4);
+		ed->dev->target.has_caps = false;
+		memset(&ed->dev->target.caps, 0, sizeof(ed->dev->target.caps));
+		ed->state = ENGINE_CAPS;
+		return EngineCommand(ed, CMD_READ_CAPABILITIES, 0, true);
+
+	case ENGINE_CAPS:
+		if (response[0] >= CAPS_VERSION)
+		{
+			memcpy(&ed->dev->target.caps, response, sizeof(ed->dev->target.caps));
+			ed->dev->target.has_caps = true;
+		}
+		return EngineCheckTarget(ed);
+
+	case ENGINE_BASE_CRC:
+		if (value != image->base_crc)
+			return false;
+		EngineSetStage(ed, "write");
+		// fall through
+
+	case ENGINE_ERASE:
+		ed->state = ENGINE_SET_POINTER;
+		return EngineCommand(ed, CMD_SET_POINTER, 0, false);
+
+	case ENGINE_SET_POINTER:
+		ed->entry = 0;
+		ed->byte = 0;
+		ed->sub = 0;
+		return EngineSendEntry(ed);
+
+	case ENGINE_PAGE_DATA:
+		return EngineSendEntry(ed);
+
+	case ENGINE_PAGE_WRITE:
+		ed->byte = 0;
+		ed->sub += ed->part;
+		if (ed->sub < image->entries[ed->entry].count)
+			return EngineSendEntry(ed);
+		ed->entry++;
+		ed->sub = 0;
+		if (ed->engine->progress != NULL)
+			ed->engine->progress(ed, ed->entry, image->entry_count);
+		return EngineSendEntry(ed);
+
+	case ENGINE_CRC:
+		if (value != image->crc)
+			return false;
+		if (!ed->verify)
+			return EngineFinish(ed);
+		EngineSetStage(ed, "verify");
+		TimingPhase(ed->dev->timing, TIMING_VERIFY);
+		ed->state = ENGINE_VERIFY;
+		ed->page = 0;
+		ed->next = 0;
+		ed->offset = 0;
+		return EngineVerifyNext(ed);
+
+	case ENGINE_VERIFY:
+		if (ed->run != 0)
+		{
+			if (value != 0xFFFFFFFF)
+				return false;
+			ed->page += ed->run;
+			if (ed->engine->progress != NULL)
+				ed->engine->progress(ed, ed->page, image->fw_info->flash_size_b / image->fw_info->page_size_b);
+		}
+		else
+		{
+			memcpy(&ed->page_data[ed->offset], response, TargetReadBytes(&ed->dev->target));
+			ed->offset += TargetReadBytes(&ed->dev->target);
+			if (ed->offset >= image->fw_info->page_size_b)
+			{
+				if ((ed->next < image->page_count) && (image->pages[ed->next].page == ed->page))
+				{
+					if (crc32(ed->page_data, image->fw_info->page_size_b) != image->pages[ed->next].crc)
+						return false;
+					ed->next++;
+				}
+				else
+				{
+					for (int i = 0; i < image->fw_info->page_size_b; i++)
+					{
+						if (ed->page_data[i] != 0xFF)
+							return false;
+					}
+				}
+				ed->page++;
+
+				// tagged reads don't end on a page boundary, the start of the next page that came
+				// with the last one is kept when that page is read back too
+				bool read_back = (ed->next < image->page_count) && (image->pages[ed->next].page == ed->page);
+				ed->offset -= image->fw_info->page_size_b;
+				if (read_back || (!EngineBlankCheck(ed)))
+					memmove(ed->page_data, &ed->page_data[image->fw_info->page_size_b], ed->offset);
+				else
+					ed->offset = 0;
+				EngineReleaseSlot(ed);
+				if (ed->engine->progress != NULL)
+					ed->engine->progress(ed, ed->page, image->fw_info->flash_size_b / image->fw_info->page_size_b);
+			}
+		}
+		return EngineVerifyNext(ed);
+
+	case ENGINE_RESET:
+		return EngineFinish(ed);
+
+	default:
+		return false;
+	}
+}
+
+/**************************************************************************************************
+* Add a completed transfer to the trace
+*/
+void EngineTrace(ENGINE_DEVICE_t *ed, ENGINE_OP_t op, bool ok, DWORD bytes)
+{
+	if (!TraceEnabled())
+		return;
+
+	switch (op)
+	{
+	case ENGINE_OP_SET_FEATURE:
+		TraceRecord(ed->index, TRACE_SET_FEATURE, ed->cmd.command, &ed->cmd, sizeof(ed->cmd), ed->op_start, ok);
+		break;
+
+	case ENGINE_OP_GET_FEATURE:
+		TraceRecord(ed->index, TRACE_GET_FEATURE, ed->cmd.command, &ed->status, sizeof(ed->status), ed->op_start, ok);
+		break;
+
+	case ENGINE_OP_READ_REPORT:
+		TraceRecord(ed->index, TRACE_READ, ed->cmd.command, &ed->report[1], HID_DATA_BYTES, ed->op_start, ok);
+		break;
+
+	case ENGINE_OP_WRITE_REPORT:
+		TraceRecord(ed->index, TRACE_WRITE, TRACE_NO_COMMAND, ed->report, BUFFER_SIZE, ed->op_start, ok);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**************************************************************************************************
+* Handle a completed transfer
+*/
+void EngineComplete(ENGINE_DEVICE_t *ed, bool ok, DWORD bytes)
+{
+	ENGINE_OP_t op = ed->op;
+	ed->op = ENGINE_OP_NONE;
+	EngineTrace(ed, op, ok && (!ed->cancelled), bytes);
+
+	if ((!ok) || ed->abort)
+	{
+		EngineFail(ed);
+		return;
+	}
+
+	switch (op)
+	{
+	case ENGINE_OP_FLUSH:
+		if (!EngineIssue(ed, ENGINE_OP_SET_FEATURE))
+			EngineFail(ed);
+		return;
+
+	case ENGINE_OP_SET_FEATURE:
+		if (!EngineIssue(ed, ENGINE_OP_GET_FEATURE))
+			EngineFail(ed);
+		return;
+
+	case ENGINE_OP_GET_FEATURE:
+		if ((bytes >= sizeof(ed->status) - 1) && (ed->status.result != 0) && (ed->state == ENGINE_CAPS))
+		{
+			// older bootloaders reject the command and are programmed the original way
+			EngineCheck(ed, EngineCheckTarget(ed));
+			return;
+		}
+		if ((bytes < sizeof(ed->status) - 1) || (ed->status.result != 0))
+		{
+			EngineFail(ed);
+			return;
+		}
+		TimingCommand(ed->dev->timing, ed->cmd.command, ed->cmd_start);
+		if (ed->want_response)
+		{
+			if (!EngineIssue(ed, ENGINE_OP_READ_REPORT))
+				EngineFail(ed);
+			return;
+		}
+		break;
+
+	case ENGINE_OP_READ_REPORT:
+		if (bytes == 0)
+		{
+			EngineFail(ed);
+			return;
+		}
+		TimingRecord(ed->dev->timing, TIMING_RESPONSE, ed->op_start);
+		TimingBytes(ed->dev->timing, 0, HID_DATA_BYTES);
+		break;
+
+	case ENGINE_OP_WRITE_REPORT:
+		TimingRecord(ed->dev->timing, TIMING_WRITE, ed->op_start);
+		TimingBytes(ed->dev->timing, HID_DATA_BYTES, 0);
+		break;
+
+	default:
+		break;
+	}
+
+	EngineCheck(ed, EngineStep(ed));
+}
+
+/**************************************************************************************************
+* Start updating a device with image. The device is opened unless it was kept open by its last
+* update.
+*/
+void EngineStart(ENGINE_DEVICE_t *ed, PLAN_IMAGE_t *image, bool verify, bool reset)
+{
+	ed->image = image;
+	ed->verify = verify;
+	ed->reset = reset;
+	ed->start = GetTickCount();
+	ed->dev->result = false;
+	ed->dev->stage = "open";
+	ed->state = ENGINE_IDLE;
+	ed->abort = false;
+	ed->engine->active++;
+	TimingBegin(ed->dev->timing);
+
+	if (ed->handle == INVALID_HANDLE_VALUE)
+	{
+		TimingPhase(ed->dev->timing, TIMING_ENUMERATE);
+		ed->handle = CreateFileA(ed->dev->path, GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+								 NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+		if (ed->handle == INVALID_HANDLE_VALUE)
+		{
+			EngineFail(ed);
+			return;
+		}
+		if (CreateIoCompletionPort(ed->handle, ed->engine->port, (ULONG_PTR)ed, 0) == NULL)
+		{
+			EngineFail(ed);
+			return;
+		}
+	}
+
+	EngineSetStage(ed, "info");
+	TimingPhase(ed->dev->timing, TIMING_INFO);
+	ed->state = ENGINE_SERIAL;
+	if (!EngineCommand(ed, CMD_READ_SERIAL, 0, true))
+		EngineFail(ed);
+}
+
+/**************************************************************************************************
+* Check if a device has an update in progress
+*/
+bool EngineBusy(ENGINE_DEVICE_t *ed)
+{
+	return (ed->state != ENGINE_IDLE) && (ed->state != ENGINE_DONE) && (ed->state != ENGINE_FAILED);
+}
+
+/**************************************************************************************************
+* Stop a device's update. It fails at the next transfer to complete, or when it is given a
+* streaming slot if it is waiting for one.
+*/
+void EngineCancel(ENGINE_DEVICE_t *ed)
+{
+	if (!EngineBusy(ed))
+		return;
+	ed->abort = true;
+	if ((ed->op != ENGINE_OP_NONE) && (!ed->cancelled))
+	{
+		CancelIoEx(ed->handle, &ed->ol);
+		ed->cancelled = true;
+	}
+}
+
+/**************************************************************************************************
+* Cancel transfers that have taken too long. The cancelled transfer completes with an error and
+* the device fails.
+*/
+void EngineCheckTimeouts(ENGINE_t *engine)
+{
+	DWORD now = GetTickCount();
+
+	for (int i = 0; i < engine->device_count; i++)
+	{
+		ENGINE_DEVICE_t *ed = &engine->devices[i];
+		if ((ed->op != ENGINE_OP_NONE) && (!ed->cancelled) && ((LONG)(now - ed->deadline) > 0))
+		{
+			CancelIoEx(ed->handle, &ed->ol);
+			ed->cancelled = true;
+		}
+	}
+}
+
+/**************************************************************************************************
+* Create the completion port and room for up to max_devices devices. hub_budget is the number of
+* devices per hub that may stream at once, 0 to estimate it.
+*/
+bool EngineOpen(ENGINE_t *engine, int max_devices, int hub_budget)
+{
+	memset(engine, 0, sizeof(ENGINE_t));
+	engine->devices = calloc(max_devices, sizeof(ENGINE_DEVICE_t));
+	if (engine->devices == NULL)
+		return false;
+	engine->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if ((engine->port == NULL) || (!SchedInit(&engine->sched, max_devices, hub_budget)))
+	{
+		if (engine->port != NULL)
+			CloseHandle(engine->port);
+		engine->port = NULL;
+		free(engine->devices);
+		engine->devices = NULL;
+		return false;
+	}
+
+	engine->max_devices = max_devices;
+	engine->last_check = GetTickCount();
+	return true;
+}
+
+/**************************************************************************************************
+* Close any devices kept open and free the engine. No update may be in progress.
+*/
+void EngineShutdown(ENGINE_t *engine)
+{
+	for (int i = 0; i < engine->device_count; i++)
+	{
+		if (engine->devices[i].handle != INVALID_HANDLE_VALUE)
+			CloseHandle(engine->devices[i].handle);
+	}
+
+	SchedFree(&engine->sched);
+	if (engine->port != NULL)
+		CloseHandle(engine->port);
+	engine->port = NULL;
+	free(engine->devices);
+	engine->devices = NULL;
+	engine->device_count = 0;
+}
+
+/**************************************************************************************************
+* Add a device to the engine and find its hub, reusing the entry of a removed device. NULL if the
+* engine is full.
+*/
+ENGINE_DEVICE_t *EngineAddDevice(ENGINE_t *engine, GANG_DEVICE_t *dev)
+{
+	char key[SCHED_HUB_KEY_SIZE];
+	int i;
+
+	for (i = 0; i < engine->device_count; i++)
+	{
+		if (engine->devices[i].dev == NULL)
+			break;
+	}
+	if (i >= engine->max_devices)
+		return NULL;
+
+	ENGINE_DEVICE_t *ed = &engine->devices[i];
+	memset(ed, 0, sizeof(ENGINE_DEVICE_t));
+	ed->engine = engine;
+	ed->dev = dev;
+	ed->index = i;
+	ed->handle = INVALID_HANDLE_VALUE;
+	SchedHubKey(dev->path, key, sizeof(key));
+	ed->hub = SchedAddDevice(&engine->sched, key);
+	if (i == engine->device_count)
+		engine->device_count++;
+	return ed;
+}
+
+/**************************************************************************************************
+* Close a device that has gone away, or is no longer wanted, and free its entry. No update may be
+* in progress.
+*/
+void EngineRemoveDevice(ENGINE_DEVICE_t *ed)
+{
+	if (ed->handle != INVALID_HANDLE_VALUE)
+		CloseHandle(ed->handle);
+	ed->handle = INVALID_HANDLE_VALUE;
+	SchedRemoveDevice(&ed->engine->sched, ed->hub);
+	ed->dev = NULL;
+}
+
+/**************************************************************************************************
+* Wait up to timeout ms for a transfer to complete and handle it. Other threads can hand work to
+* the engine thread with PostQueuedCompletionStatus() and a non-zero key, which is returned along
+* with the byte count in posted_bytes.
+*/
+ULONG_PTR EnginePoll(ENGINE_t *engine, DWORD timeout, DWORD *posted_bytes)
+{
+	DWORD bytes = 0;
+	ULONG_PTR key = 0;
+	OVERLAPPED *ol = NULL;
+	ULONG_PTR posted = 0;
+
+	if (timeout > ENGINE_POLL_MS)
+		timeout = ENGINE_POLL_MS;
+	BOOL res = GetQueuedCompletionStatus(engine->port, &bytes, &key, &ol, timeout);
+	if (ol != NULL)
+		EngineComplete((ENGINE_DEVICE_t *)key, res != FALSE, bytes);
+	else if (res)
+	{
+		posted = key;
+		if (posted_bytes != NULL)
+			*posted_bytes = bytes;
+	}
+
+	if (GetTickCount() - engine->last_check >= ENGINE_POLL_MS)
+	{
+		EngineCheckTimeouts(engine);
+		engine->last_check = GetTickCount();
+	}
+	return posted;
+}
+
+/**************************************************************************************************
+* Program devices with image from one thread, with up to max_active devices in progress at once.
+* hub_budget is the number of devices per hub that may stream at once, 0 to estimate it.
+*/
+bool EngineRun(PLAN_IMAGE_t *image, GANG_DEVICE_t *devices, int count, int max_active, int hub_budget, bool verify, bool reset)
+{
+	ENGINE_t engine;
+
+	if (!EngineOpen(&engine, count, hub_budget))
+		return false;
+
+	for (int i = 0; i < count; i++)
+		EngineAddDevice(&engine, &devices[i]);
+
+	int next = 0;
+	for (;;)
+	{
+		while ((engine.active < max_active) && (next < count))
+			EngineStart(&engine.devices[next++], image, verify, reset);
+		if (engine.active == 0)
+			break;
+		EnginePoll(&engine, ENGINE_POLL_MS, NULL);
+	}
+
+	EngineShutdown(&engine);
+	return true;
+}
@@ -0,0 +1,104 @@
+// engine.h
+
+#ifndef __ENGINE_H
+#define __ENGINE_H
+
+
+#define	ENGINE_TIMEOUT_MS			5000	// longest any single transfer may take
+#define	ENGINE_POLL_MS				100		// how often timeouts are checked
+
+
+typedef enum {
+	ENGINE_IDLE = 0,
+	ENGINE_SERIAL,
+	ENGINE_INFO,
+	ENGINE_CAPS,
+	ENGINE_BASE_CRC,
+	ENGINE_ERASE,
+	ENGINE_SET_POINTER,
+	ENGINE_PAGE_DATA,
+	ENGINE_PAGE_WRITE,
+	ENGINE_CRC,
+	ENGINE_VERIFY,
+	ENGINE_RESET,
+	ENGINE_DONE,
+	ENGINE_FAILED,
+} ENGINE_STATE_t;
+
+// overlapped operation in flight, at most one per device
+typedef enum {
+	ENGINE_OP_NONE = 0,
+	ENGINE_OP_SET_FEATURE,
+	ENGINE_OP_GET_FEATURE,
+	ENGINE_OP_READ_REPORT,
+	ENGINE_OP_WRITE_REPORT,
+	ENGINE_OP_FLUSH,						// discard unread IN reports before a command with a response
+} ENGINE_OP_t;
+
+typedef struct ENGINE_s ENGINE_t;
+
+typedef struct {
+	OVERLAPPED		ol;
+	HANDLE			handle;
+	ENGINE_t		*engine;
+	GANG_DEVICE_t	*dev;					// NULL once removed
+	PLAN_IMAGE_t	*image;
+	bool			verify;
+	bool			reset;
+	bool			keep_open;				// leave the handle open after a successful update
+	void			*user;					// for the caller's use
+	int				index;
+	int				hub;					// scheduler hub index
+	bool			slot;					// holds a streaming slot on the hub
+	bool			parked;					// waiting for a streaming slot
+	ENGINE_STATE_t	state;
+	ENGINE_OP_t		op;
+	bool			want_response;
+	bool			cancelled;				// transfer cancelled, completion pending
+	bool			abort;					// EngineCancel() called
+	DWORD			start;
+	DWORD			deadline;
+	uint64_t		op_start;				// timing of the transfer in flight
+	uint64_t		cmd_start;				// timing of the command in progress
+	uint64_t		park_start;				// trace of the wait for a streaming slot
+	BLCOMMAND_t		cmd;
+	BLSTATUS_t		status;
+	uint8_t			report[BUFFER_SIZE];	// report ID followed by data
+	int				entry;					// write: current plan entry
+	int				byte;					// write: next byte of entry payload, or of the expanded page
+	int				sub;					// write: pages of the current entry written
+	int				part;					// write: pages in the command in progress
+	int				page;					// verify: current page
+	int				next;					// verify: next populated page in image pages
+	int				run;					// verify: pages in blank check, 0 when reading back
+	uint16_t		offset;					// verify: next byte of page to read back
+	uint8_t			page_data[PLAN_MAX_PAGE_SIZE + HID_DATA_BYTES];	// read back, or an entry expanded to a raw page
+} ENGINE_DEVICE_t;
+
+// one completion port and the devices driven through it, any number can run at once
+struct ENGINE_s {
+	HANDLE			port;
+	ENGINE_DEVICE_t	*devices;
+	int				device_count;
+	int				max_devices;
+	int				active;					// devices with an update in progress
+	DWORD			last_check;				// last timeout check
+	SCHED_t			sched;
+	void			(*progress)(ENGINE_DEVICE_t *ed, int done, int total);	// optional
+	void			(*finished)(ENGINE_DEVICE_t *ed);						// optional
+	void			*user;					// for the caller's use
+};
+
+
+extern bool EngineOpen(ENGINE_t *engine, int max_devices, int hub_budget);
+extern void EngineShutdown(ENGINE_t *engine);
+extern ENGINE_DEVICE_t *EngineAddDevice(ENGINE_t *engine, GANG_DEVICE_t *dev);
+extern void EngineRemoveDevice(ENGINE_DEVICE_t *ed);
+extern void EngineStart(ENGINE_DEVICE_t *ed, PLAN_IMAGE_t *image, bool verify, bool reset);
+extern bool EngineBusy(ENGINE_DEVICE_t *ed);
+extern void EngineCancel(ENGINE_DEVICE_t *ed);
+extern ULONG_PTR EnginePoll(ENGINE_t *engine, DWORD timeout, DWORD *posted_bytes);
+extern bool EngineRun(PLAN_IMAGE_t *image, GANG_DEVICE_t *devices, int count, int max_active, int hub_budget, bool verify, bool reset);
+
+
+#endif
@@ -0,0 +1,233 @@
+// gang.c
+//
+// Gang programming. Every attached bootloader with a matching VID/PID is opened by path and
+// programmed by a pool of worker threads. The loaded image and plan are only read while the workers
+// run, so all devices share them. Device specific state lives in GANG_DEVICE_t.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "trace.h"
+#include "gang.h"
+#include "sched.h"
+#include "engine.h"
+
+
+GANG_DEVICE_t	*gang_devices = NULL;
+int				gang_device_count = 0;
+volatile LONG	gang_next_device = 0;
+PLAN_IMAGE_t	*gang_image = NULL;
+
+
+/**************************************************************************************************
+* Run the whole update pipeline on one device
+*/
+void GangProgramDevice(GANG_DEVICE_t *dev)
+{
+	DWORD start = GetTickCount();
+	dev->result = false;
+	timing_session = dev->timing;
+	TimingBegin(timing_session);
+	trace_device = (int)(dev - gang_devices);
+
+	dev->stage = "open";
+	TimingPhase(timing_session, TIMING_ENUMERATE);
+	hid_device *handle = hid_open_path(dev->path);
+	if (handle == NULL)
+	{
+		TimingEnd(timing_session);
+		dev->time_ms = GetTickCount() - start;
+		return;
+	}
+
+	dev->stage = "info";
+	if (!GetBootloaderInfo(handle, &dev->target))
+		goto done;
+
+	dev->stage = "check";
+	if (!CheckTarget(handle, &dev->target, gang_image))
+		goto done;
+
+	dev->stage = "write";
+	if (!UpdateFirmware(handle, &dev->target, gang_image))
+		goto done;
+
+	dev->stage = "verify";
+	if (opt_verify && (!VerifyFirmware(handle, &dev->target, gang_image)))
+		goto done;
+
+	dev->stage = "reset";
+	if (opt_reset && (!ResetTarget(handle, &dev->target, gang_image)))
+		goto done;
+
+	dev->stage = "done";
+	dev->result = true;
+
+done:
+	TimingEnd(timing_session);
+	hid_close(handle);
+	dev->time_ms = GetTickCount() - start;
+}
+
+/**************************************************************************************************
+* Worker thread, takes the next unclaimed device until there are none left
+*/
+DWORD WINAPI GangWorker(LPVOID param)
+{
+	LONG i;
+	while ((i = InterlockedIncrement(&gang_next_device) - 1) < gang_device_count)
+		GangProgramDevice(&gang_devices[i]);
+	return 0;
+}
+
+/**************************************************************************************************
+* Find all matching bootloaders, limited to the selected serial numbers if any
+*/
+bool GangEnumerate(unsigned short vid, unsigned short pid)
+{
+	struct hid_device_info *devs, *cur;
+	bool timing = (timing_session != NULL);
+
+	devs = hid_enumerate(vid, pid);
+	gang_device_count = 0;
+	for (cur = devs; cur != NULL; cur = cur->next)
+	{
+		if (SerialSelected(cur->serial_number))
+			gang_device_count++;
+	}
+
+	if (gang_device_count == 0)
+	{
+		hid_free_enumeration(devs);
+		return false;
+	}
+
+	gang_devices = calloc(gang_device_count, sizeof(GANG_DEVICE_t));
+	if (gang_devices == NULL)
+	{
+		hid_free_enumeration(devs);
+		return false;
+	}
+
+	int i = 0;
+	for (cur = devs; cur != NULL; cur = cur->next)
+	{
+		if (!SerialSelected(cur->serial_number))
+			continue;
+		gang_devices[i].path = _strdup(cur->path);
+		if (cur->serial_number != NULL)	// replaced by the bootloader's serial once it is read
+			_snprintf(gang_devices[i].target.serial, sizeof(gang_devices[i].target.serial) - 1, "%ls", cur->serial_number);
+		TraceDevice(i, (gang_devices[i].target.serial[0] != '\0') ? gang_devices[i].target.serial : cur->path);
+		gang_devices[i].stage = "open";
+		if (timing)
+			gang_devices[i].timing = calloc(1, sizeof(TIMING_t));	// without one the device just isn't timed
+		i++;
+	}
+
+	hid_free_enumeration(devs);
+	return true;
+}
+
+/**************************************************************************************************
+* Program every attached bootloader with image. Up to workers devices are programmed
+* at once, 0 for all of them. Devices are driven by a thread each or, with use_engine, all from
+* this thread by the event driven engine, which also limits how many devices on each hub stream
+* at once to hub_budget (0 to estimate it).
+*/
+bool GangProgram(PLAN_IMAGE_t *image, unsigned short vid, unsigned short pid, int workers, bool use_engine, int hub_budget)
+{
+	HANDLE threads[GANG_MAX_WORKERS];
+
+	if (hid_init() != 0)
+		return false;
+
+	// each worker times its own device, added to the caller's timing at the end
+	TIMING_t *timing = timing_session;
+	TimingPhase(timing, TIMING_ENUMERATE);
+	bool found = GangEnumerate(vid, pid);
+	TimingEnd(timing);
+	if (!found)
+	{
+		silent_printf("Unable to find target device.\n");
+		return false;
+	}
+
+	if ((workers <= 0) || (workers > gang_device_count))
+		workers = gang_device_count;
+	if ((!use_engine) && (workers > GANG_MAX_WORKERS))
+		workers = GANG_MAX_WORKERS;
+	quiet_printf("Found %d devices, programming %d at a time.\n", gang_device_count, workers);
+
+	// per device output from the workers would be interleaved, results are reported at the end
+	bool save_quiet = opt_quiet;
+	bool save_silent = opt_silent;
+	opt_quiet = true;
+	opt_silent = true;
+
+	DWORD start = GetTickCount();
+	gang_image = image;
+	if (use_engine)
+		EngineRun(image, gang_devices, gang_device_count, workers, hub_budget, opt_verify, opt_reset);	// on failure no device is started
+	else
+	{
+		gang_next_device = 0;
+		int started = 0;
+		for (int i = 0; i < workers; i++)
+		{
+			threads[started] = CreateThread(NULL, 0, GangWorker, NULL, 0, NULL);
+			if (threads[started] != NULL)
+				started++;
+		}
+		if (started == 0)		// no threads, do it ourselves
+			GangWorker(NULL);
+		WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+		for (int i = 0; i < started; i++)
+			CloseHandle(threads[i]);
+		timing_session = timing;		// this thread may have been a worker
+	}
+	DWORD elapsed = GetTickCount() - start;
+
+	opt_quiet = save_quiet;
+	opt_silent = save_silent;
+
+	// results
+	int passed = 0;
+	silent_printf("Device\tSerial\t\t\t\tTime\tResult\n");
+	for (int i = 0; i < gang_device_count; i++)
+	{
+		GANG_DEVICE_t *dev = &gang_devices[i];
+		const char *serial = dev->target.serial;
+		if (serial[0] == '\0')
+			serial = "(unknown)";
+		if (dev->result)
+		{
+			passed++;
+			silent_printf("%d\t%-24s\t%lu.%lus\tOK\n", i, serial, dev->time_ms / 1000, (dev->time_ms % 1000) / 100);
+		}
+		else
+			silent_printf("%d\t%-24s\t%lu.%lus\tFAILED (%s)\n", i, serial, dev->time_ms / 1000, (dev->time_ms % 1000) / 100, dev->stage);
+		quiet_printf("\t%s\n", dev->path);
+	}
+	silent_printf("%d of %d devices programmed in %lu.%lus.\n", passed, gang_device_count, elapsed / 1000, (elapsed % 1000) / 100);
+
+	for (int i = 0; i < gang_device_count; i++)
+	{
+		TimingMerge(timing, gang_devices[i].timing);
+		free(gang_devices[i].timing);
+		free(gang_devices[i].path);
+	}
+	free(gang_devices);
+	gang_devices = NULL;
+
+	return (passed == gang_device_count);
+}
@@ -0,0 +1,24 @@
+// gang.h
+
+#ifndef __GANG_H
+#define __GANG_H
+
+
+#define	GANG_MAX_WORKERS			64		// WaitForMultipleObjects() limit
+
+
+// per device state for gang programming
+typedef struct {
+	char		*path;
+	BL_TARGET_t	target;
+	bool		result;
+	const char	*stage;					// last stage started, the one that failed if result is false
+	DWORD		time_ms;
+	TIMING_t	*timing;				// NULL unless timing
+} GANG_DEVICE_t;
+
+
+extern bool GangProgram(PLAN_IMAGE_t *image, unsigned short vid, unsigned short pid, int workers, bool use_engine, int hub_budget);
+
+
+#endif
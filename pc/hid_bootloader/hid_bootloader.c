@@ -14,30 +14,120 @@
 #include "bootloader.h"
 #include "getopt.h"
 #include "opt_output.h"
+#include "plan.h"
+#include "crc.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "trace.h"
+#include "gang.h"
+#include "sim.h"
+#include "hotplug.h"
+#include "sched.h"
+#include "engine.h"
+#include "daemon.h"
+#include "replay.h"
+#include "simdev.h"
+#include "bench.h"
+#include "micro.h"
+#include "compress.h"
 
 
-#define MAX_STR				255
-#define	BUFFER_SIZE			(64+1)		// +1 for mandatory HID report ID
+bool CompilePlan(void);
+bool ListDevices(unsigned short vid, unsigned short pid);
+bool ProgramDevice(hid_device *handle, bool loaded);
+int WaitAndProgram(bool loaded);
+const wchar_t *DeviceError(hid_device *handle);
+void TagStatus(BLSTATUS_t *status);
 
 
-bool ExecuteHIDCommand(hid_device *handle, BLCOMMAND_t *cmd);
-bool ExecuteHIDCommandWithResponse(hid_device *handle, BLCOMMAND_t *cmd, uint8_t *buffer, uint8_t buffer_size);
-bool UpdateFirmware(hid_device *handle);
-bool VerifyFirmware(hid_device *handle);
-bool GetBootloaderInfo(hid_device *handle);
-
-
-uint8_t target_mcu_id[4] = { 0, 0, 0, 0 };
-uint8_t	target_mcu_fuses[6] = { 0, 0, 0, 0, 0, 0 };
+BL_TARGET_t target;
+PLAN_IMAGE_t image;
 char *hexfile = NULL;
+char *basefile = NULL;
+char *planfile = NULL;
+char *patch_file = NULL;
+char *timing_file = NULL;
+char *trace_file = NULL;
+char *record_file = NULL;
+char *replay_file = NULL;
+char *bench_file = NULL;
+char *baseline_file = NULL;
+char *micro_results_file = NULL;
+char **micro_images = NULL;
+int micro_image_count = 0;
+char *daemon_socket = NULL;
+char **daemon_image_specs = NULL;
+int daemon_image_args = 0;
 unsigned short vid, pid;
+__declspec(thread) BL_TAGS_t *target_tags = NULL;	// completion table of the device on this thread, NULL if untagged
 
 bool opt_reset = false;
 bool opt_quiet = false;
 bool opt_silent = false;
+__declspec(thread) bool opt_thread_silent = false;
 bool opt_verify = false;
+bool opt_compress = false;
+bool opt_gang = false;
+bool opt_engine = false;
+int opt_workers = 0;
+int opt_hub_budget = 0;
+int opt_sim_hubs = 0;
+int opt_sim_per_hub = 0;
+bool opt_list = false;
+bool opt_wait = false;
+bool opt_keep = false;
+bool opt_timing = false;
+bool opt_bench = false;
+
+wchar_t serial_filter[MAX_SERIALS][MAX_STR];
+int serial_filter_count = 0;
+
+TIMING_t timing_total;
 
 
+/**************************************************************************************************
+* Print command line help
+*/
+void print_usage(void)
+{
+	printf("Usage: [-egkqrstvwz] [-b <budget>] [-d <base.hex>] [-j <workers>] [-n <serial>] [-R <session.rec>] [-T <timing.json>] [-x <trace.json>] <vid> <pid> <firmware.hex|firmware.plan>\n");
+	printf("       [-qsz] [-d <base.hex>] -o <firmware.plan> <firmware.hex>\n");
+	printf("       [-qs] -p <patched.hex> <firmware.hex>\n");
+	printf("       -l [-n <serial>] <vid> <pid>\n");
+	printf("       [-qs] [-d <base.hex>] -P <session.rec>\n");
+	printf("       [-qs] [-c <baseline.csv>] -B <results.csv>\n");
+	printf("       [-qs] -M <results.csv> [image.hex ...]\n");
+	printf("       [-vz] [-b <budget>] [-d <base.hex>] -S <hubs>x<devices> <firmware.hex|firmware.plan>\n");
+	printf("       [-qrsvz] [-b <budget>] [-d <base.hex>] [-n <serial>] -D <socket> <vid> <pid> <name>=<firmware.hex|firmware.plan> ...\n");
+	printf("\nOptions:\n");
+	printf("\t-B\tbenchmark update and verify against a simulated bootloader on a USB timing model\n");
+	printf("\t-b\tdevices per transaction translator streaming at once with -e (default estimated from its devices)\n");
+	printf("\t-c\tcompare the benchmark with an earlier results table, fail on regressions\n");
+	printf("\t-d\tdelta update, base.hex is the firmware currently on the device\n");
+	printf("\t-D\trun as a daemon, taking jobs for the named images on a local socket\n");
+	printf("\t-e\tgang mode using one event driven thread for all devices\n");
+	printf("\t-g\tgang mode, program every attached bootloader in parallel\n");
+	printf("\t-j\tnumber of devices to program at once in gang mode (default all)\n");
+	printf("\t-k\tkeep running, program each bootloader as it is attached\n");
+	printf("\t-l\tlist attached bootloaders\n");
+	printf("\t-M\tmicrobenchmark hex parsing, info lookup and CRCs on the images and a generated 256KB one\n");
+	printf("\t-n\tonly use the device with this serial number, repeat to select several in gang mode\n");
+	printf("\t-o\tcompile firmware to a plan file for faster programming\n");
+	printf("\t-p\tpost-link, fill in the v2 info (length, CRC, build ID, page map) embedded in the firmware\n");
+	printf("\t-P\treplay a recorded session against a simulated bootloader, flash erased or holding base.hex\n");
+	printf("\t-q\tquiet (less output)\n");
+	printf("\t-r\treset after loading firmware, recording its length and CRC so the bootloader starts it at power up\n");
+	printf("\t-R\trecord the session, every transfer with its data and timing, for replay with -P\n");
+	printf("\t-s\tsilent (no output, return code only)\n");
+	printf("\t-S\tsimulate gang programming on transaction translators of devices, with and without scheduling\n");
+	printf("\t-t\treport where the time went: phases, command latencies, busy polls and throughput\n");
+	printf("\t-T\twrite the timing report to a JSON file\n");
+	printf("\t-v\tverify firmware by reading back\n");
+	printf("\t-w\twait for a bootloader to be attached\n");
+	printf("\t-x\trecord every USB transfer and write a timeline for chrome://tracing or Perfetto\n");
+	printf("\t-z\tcompress pages for transfer\n");
+}
+
 /**************************************************************************************************
 * Handle command line args
 */
@@ -45,14 +135,99 @@ int parse_args(int argc, char *argv[])
 {
 	int c;
 
-	while ((c = getopt(argc, argv, "rqsv")) != -1)
+	while ((c = getopt(argc, argv, "b:B:c:d:D:egj:klM:n:o:p:P:rR:qsS:tT:vwx:z")) != -1)
 	{
 		switch (c)
 		{
+		case 'b':
+			opt_hub_budget = atoi(optarg);
+			if (opt_hub_budget < 1)
+			{
+				printf("Bad hub budget (%s)\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'B':
+			bench_file = optarg;
+			opt_bench = true;
+			break;
+
+		case 'c':
+			baseline_file = optarg;
+			opt_bench = true;
+			break;
+
+		case 'd':
+			basefile = optarg;
+			break;
+
+		case 'D':
+			daemon_socket = optarg;
+			break;
+
+		case 'e':
+			opt_engine = true;
+			opt_gang = true;
+			break;
+
+		case 'g':
+			opt_gang = true;
+			break;
+
+		case 'j':
+			opt_workers = atoi(optarg);
+			if (opt_workers < 1)
+			{
+				printf("Bad number of workers (%s)\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'k':
+			opt_keep = true;
+			opt_wait = true;
+			break;
+
+		case 'l':
+			opt_list = true;
+			break;
+
+		case 'M':
+			micro_results_file = optarg;
+			break;
+
+		case 'n':
+			if (serial_filter_count >= MAX_SERIALS)
+			{
+				printf("Too many serial numbers.\n");
+				return 1;
+			}
+			mbstowcs(serial_filter[serial_filter_count], optarg, MAX_STR - 1);
+			serial_filter[serial_filter_count][MAX_STR - 1] = L'\0';
+			serial_filter_count++;
+			break;
+
+		case 'o':
+			planfile = optarg;
+			break;
+
+		case 'p':
+			patch_file = optarg;
+			break;
+
+		case 'P':
+			replay_file = optarg;
+			break;
+
 		case 'r':
 			opt_reset = true;
 			break;
 
+		case 'R':
+			record_file = optarg;
+			break;
+
 		case 'q':
 			opt_quiet = true;
 			break;
@@ -62,10 +237,39 @@ int parse_args(int argc, char *argv[])
 			opt_quiet = true;
 			break;
 
+		case 'S':
+			if ((sscanf(optarg, "%dx%d", &opt_sim_hubs, &opt_sim_per_hub) != 2) || (opt_sim_hubs < 1) || (opt_sim_per_hub < 1))
+			{
+				printf("Bad simulation size (%s)\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 't':
+			opt_timing = true;
+			break;
+
+		case 'T':
+			timing_file = optarg;
+			opt_timing = true;
+			break;
+
 		case 'v':
 			opt_verify = true;
 			break;
 
+		case 'w':
+			opt_wait = true;
+			break;
+
+		case 'x':
+			trace_file = optarg;
+			break;
+
+		case 'z':
+			opt_compress = true;
+			break;
+
 		case '?':
 			printf("Unknown option -%c.\n", optopt);
 			return 1;
@@ -73,10 +277,55 @@ int parse_args(int argc, char *argv[])
 	}
 
 
+	// microbenchmarks take any number of images
+	if (micro_results_file != NULL)
+	{
+		micro_images = &argv[optind];
+		micro_image_count = argc - optind;
+		return 0;
+	}
+
+	// a replay only needs the recording, and a benchmark uses its own images
+	if ((replay_file != NULL) || opt_bench)
+	{
+		if (argc != optind)
+		{
+			print_usage();
+			return 1;
+		}
+		return 0;
+	}
+
+	// compiling a plan, patching or simulating only needs the firmware file
+	if ((planfile != NULL) || (patch_file != NULL) || (opt_sim_hubs != 0))
+	{
+		if (argc - optind != 1)
+		{
+			print_usage();
+			return 1;
+		}
+		hexfile = argv[optind];
+		return 0;
+	}
+
+	// a daemon takes any number of images after the VID and PID
+	int last = argc;
+	if (daemon_socket != NULL)
+	{
+		if (argc - optind < 3)
+		{
+			print_usage();
+			return 1;
+		}
+		last = optind + 2;
+		daemon_image_specs = &argv[last];
+		daemon_image_args = argc - last;
+	}
+
 	// non option arguments
 	int j = 0;
 	long int temp;
-	for (int i = optind; i < argc; i++)
+	for (int i = optind; i < last; i++)
 	{
 		//printf("Opt: %s\n", argv[i]);
 		switch (j)
@@ -112,14 +361,21 @@ int parse_args(int argc, char *argv[])
 		j++;
 	}
 
-	if (j < 3)
+	if ((j < 3) && ((!opt_list && (daemon_socket == NULL)) || (j < 2)))
+	{
+		print_usage();
+		return 1;
+	}
+
+	if ((serial_filter_count > 1) && (!opt_gang) && (!opt_list) && (daemon_socket == NULL))
 	{
-		printf("Usage: [-qrsv] <vid> <pid> <firmware.hex>\n");
-		printf("\nOptions:\n");
-		printf("\t-q\tquiet (less output)\n");
-		printf("\t-r\treset after loading firmware\n");
-		printf("\t-s\tsilent (no output, return code only)\n");
-		printf("\t-v\tverify firmware by reading back\n");
+		printf("Selecting several serial numbers needs gang mode.\n");
+		return 1;
+	}
+
+	if ((record_file != NULL) && (opt_gang || (daemon_socket != NULL)))
+	{
+		printf("Only single device sessions can be recorded.\n");
 		return 1;
 	}
 
@@ -133,67 +389,352 @@ int parse_args(int argc, char *argv[])
 int main(int argc, char* argv[])
 {
 	int res;
-	wchar_t wstr[MAX_STR];
 
 	res = parse_args(argc, argv);
 	if (res != 0)
 		return res;
 
-	// find target HID device
-	hid_device *handle;
-	handle = hid_open(vid, pid, NULL);
+	if (planfile != NULL)
+		return CompilePlan() ? 0 : 1;
 
-	if (handle == NULL)
+	if (patch_file != NULL)
+		return PatchFirmwareInfo(hexfile, patch_file) ? 0 : 1;
+
+	if (micro_results_file != NULL)
+		return RunMicrobenchmarks(micro_results_file, micro_images, micro_image_count) ? 0 : 1;
+
+	if (opt_bench)
+		return RunBenchmark(bench_file, baseline_file) ? 0 : 1;
+
+	if (replay_file != NULL)
+		return ReplaySession(replay_file, basefile) ? 0 : 1;
+
+	if (opt_sim_hubs != 0)
+	{
+		if (!LoadFirmware(NULL, hexfile, &image))
+			return 1;
+		return SimulateGang(&image, opt_sim_hubs, opt_sim_per_hub, opt_hub_budget, opt_verify) ? 0 : 1;
+	}
+
+	if (opt_list)
+		return ListDevices(vid, pid) ? 0 : 1;
+
+	if (daemon_socket != NULL)
+		return RunDaemon(daemon_socket, vid, pid, daemon_image_specs, daemon_image_args, opt_hub_budget);
+
+	if (opt_timing)
+		timing_session = &timing_total;
+	if ((trace_file != NULL) && (!TraceStart(TRACE_DEFAULT_EVENTS)))
 	{
-		silent_printf("Unable to find target device.\n");
+		silent_printf("Unable to allocate the trace buffer.\n");
+		return 1;
+	}
+	if ((record_file != NULL) && (!ReplayCaptureStart(record_file)))
 		return 1;
+
+	bool ok;
+	if (opt_gang)
+	{
+		// all devices share one image, so it can't depend on what any single device holds
+		if (!LoadFirmware(NULL, hexfile, &image))
+			return 1;
+		ok = GangProgram(&image, vid, pid, opt_workers, opt_engine, opt_hub_budget);
+	}
+	else
+	{
+		// without a base image the plan doesn't depend on the device, so load it before looking for one
+		bool loaded = (basefile == NULL);
+		if (loaded && (!LoadFirmware(NULL, hexfile, &image)))
+			return 1;
+
+		if (opt_wait)
+			ok = (WaitAndProgram(loaded) == 0);
+		else
+		{
+			// find target HID device
+			TimingBegin(timing_session);
+			TimingPhase(timing_session, TIMING_ENUMERATE);
+			hid_device *handle;
+			handle = hid_open(vid, pid, (serial_filter_count != 0) ? serial_filter[0] : NULL);
+
+			if (handle == NULL)
+			{
+				silent_printf("Unable to find target device.\n");
+				ok = false;
+			}
+			else
+			{
+				ok = ProgramDevice(handle, loaded);
+				hid_close(handle);
+			}
+			TimingEnd(timing_session);
+		}
+	}
+
+	if (opt_timing)
+	{
+		TimingReport(&timing_total);
+		if ((timing_file != NULL) && (!TimingWriteJSON(&timing_total, timing_file)))
+			ok = false;
+	}
+	if (trace_file != NULL)
+	{
+		if (!TraceWrite(trace_file))
+			ok = false;
+		TraceStop();
 	}
+	if ((record_file != NULL) && (!ReplayCaptureStop()))
+		ok = false;
+	return ok ? 0 : 1;
+}
+
+/**************************************************************************************************
+* Run the update on an open device. If the firmware isn't loaded yet it is loaded for this device.
+*/
+bool ProgramDevice(hid_device *handle, bool loaded)
+{
+	wchar_t wstr[MAX_STR];
+	int res;
+
+	TimingPhase(timing_session, TIMING_INFO);
 	quiet_printf("Target found.\n");
 	res = hid_get_manufacturer_string(handle, wstr, MAX_STR);
 	quiet_printf("Manufacturer:\t%ls\n", wstr);
 	res = hid_get_product_string(handle, wstr, MAX_STR);
 	quiet_printf("Product:\t%ls\n", wstr);
-	//res = hid_get_serial_number_string(handle, wstr, MAX_STR);
-	//quiet_printf("Serial:\t%ls\n", wstr);
+	res = hid_get_serial_number_string(handle, wstr, MAX_STR);
+	if ((res == 0) && (wstr[0] != L'\0'))		// older bootloaders don't have a serial number descriptor
+	{
+		quiet_printf("USB serial:\t%ls\n", wstr);
+		if (TraceEnabled())
+		{
+			char name[MAX_STR];
+			_snprintf(name, sizeof(name) - 1, "%ls", wstr);
+			name[sizeof(name) - 1] = '\0';
+			TraceDevice(trace_device, name);
+		}
+	}
 
 	// get bootloader info
-	if (!GetBootloaderInfo(handle))
-		return 1;
+	if (!GetBootloaderInfo(handle, &target))
+		return false;
 
-	// read .hex file
-	if (!ReadHexFile(hexfile))
-		return 1;
-	
-	// check firmware is suitable for target
-	if (memcmp(&fw_info->mcu_signature, target_mcu_id, 3) != 0)
+	if ((!loaded) && (!LoadFirmware(handle, hexfile, &image)))
+		return false;
+
+	ReplayCaptureTarget(&target, image.fw_info);
+	if (!CheckTarget(handle, &target, &image))
+		return false;
+
+	if (!UpdateFirmware(handle, &target, &image))
+		return false;
+
+	if (opt_verify && (!VerifyFirmware(handle, &target, &image)))
+		return false;
+
+	// firmware written OK, reset target
+	if (opt_reset && (!ResetTarget(handle, &target, &image)))
+		return false;
+
+	silent_printf("Firmware update complete.\n");
+	return true;
+}
+
+/**************************************************************************************************
+* Program a bootloader as soon as it is attached. With -k keep going with each one attached after
+* it, otherwise return after the first.
+*/
+int WaitAndProgram(bool loaded)
+{
+	int count = 0;
+	int passed = 0;
+
+	// start listening first so that no device can be missed
+	if (!HotplugStart(vid, pid))
 	{
-		silent_printf("MCU signature does not match firmware image.\n");
+		silent_printf("Unable to register for device notifications.\n");
 		return 1;
 	}
-	quiet_printf("MCU signature matches firmware image.\n");
 
-	if (!UpdateFirmware(handle))
-		return 1;
+	hid_device *handle = HotplugOpenPresent(vid, pid);
+	for (;;)
+	{
+		if (handle == NULL)
+		{
+			silent_printf("Waiting for device...\n");
+			handle = HotplugWait();
+			if (handle == NULL)
+				break;
+		}
 
-	if (opt_verify && (!VerifyFirmware(handle)))
-		return 1;
+		TimingBegin(timing_session);
+		trace_device = count;
+		bool res = ProgramDevice(handle, loaded);
+		TimingEnd(timing_session);
+		hid_close(handle);
+		handle = NULL;
+		count++;
+		if (res)
+			passed++;
 
-	// firmware written OK, reset target
-	if (opt_reset)
+		if (!opt_keep)
+		{
+			HotplugStop();
+			return res ? 0 : 1;
+		}
+		silent_printf("%d of %d devices programmed.\n\n", passed, count);
+	}
+
+	HotplugStop();
+	return (passed == count) ? 0 : 1;
+}
+
+/**************************************************************************************************
+* Check if a device serial number was selected on the command line. With no serial numbers given
+* every device is selected.
+*/
+bool SerialSelected(const wchar_t *serial)
+{
+	if (serial_filter_count == 0)
+		return true;
+	if (serial == NULL)
+		return false;
+
+	for (int i = 0; i < serial_filter_count; i++)
+	{
+		if (_wcsicmp(serial, serial_filter[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+/**************************************************************************************************
+* List attached bootloaders from their USB descriptors, without opening them
+*/
+bool ListDevices(unsigned short vid, unsigned short pid)
+{
+	struct hid_device_info *devs, *cur;
+	int count = 0;
+
+	devs = hid_enumerate(vid, pid);
+	for (cur = devs; cur != NULL; cur = cur->next)
+	{
+		if (!SerialSelected(cur->serial_number))
+			continue;
+		if ((cur->serial_number != NULL) && (cur->serial_number[0] != L'\0'))
+			printf("%ls\t%s\n", cur->serial_number, cur->path);
+		else
+			printf("(no serial)\t\t\t%s\n", cur->path);
+		count++;
+	}
+	hid_free_enumeration(devs);
+
+	quiet_printf("%d devices found.\n", count);
+	return (count != 0);
+}
+
+/**************************************************************************************************
+* Load firmware image or plan file and decide how to write it to the target. With no handle a
+* base image always produces a delta plan. An image built from a .hex file uses the plan buffers,
+* so it is only valid until the next one is loaded.
+*/
+bool LoadFirmware(hid_device *handle, char *filename, PLAN_IMAGE_t *image)
+{
+	if (IsPlanFile(filename))
 	{
-		quiet_printf("Resetting MCU...\n");
-		BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
-		cmd.command = CMD_RESET_MCU;
-		if (!ExecuteHIDCommand(handle, &cmd))
+		if (!LoadPlanFile(filename, image))
+			return false;
+	}
+	else
+	{
+		// read base image for delta updates
+		TimingPhase(timing_session, TIMING_LOAD);
+		uint32_t base_crc = 0;
+		if (basefile != NULL)
 		{
-			silent_printf("Failed to reset target.\n");
-			silent_printf("%ls\n", hid_error(handle));
+			if (!ReadHexFile(basefile))
+				return false;
+			memcpy(delta_base_buffer, firmware_buffer, sizeof(delta_base_buffer));
+			base_crc = firmware_crc;
+		}
+
+		// read .hex file
+		if (!ReadHexFile(filename))
 			return false;
+
+		if ((basefile != NULL) && ((handle == NULL) || CheckDeviceCRC(handle, base_crc)))
+		{
+			if (handle != NULL)
+				quiet_printf("Device matches base image, doing delta update.\n");
+			if (!PlanDelta(delta_base_buffer, base_crc))
+				return false;
+		}
+		else
+		{
+			if (basefile != NULL)
+				silent_printf("Device does not match base image, doing full update.\n");
+			if (!PlanPages(opt_compress))
+				return false;
 		}
+		GetPlanImage(image);
 	}
 
-	silent_printf("Firmware update complete.\n");
-	return 0;
+	return true;
+}
+
+/**************************************************************************************************
+* Check the loaded firmware is suitable for the target
+*/
+bool CheckTarget(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image)
+{
+	TimingPhase(timing_session, TIMING_LOAD);
+	if (memcmp(&image->fw_info->mcu_signature, target->mcu_id, 3) != 0)
+	{
+		silent_printf("MCU signature does not match firmware image.\n");
+		return false;
+	}
+	quiet_printf("MCU signature matches firmware image.\n");
+
+	if (target->has_caps && (target->caps.page_size != image->fw_info->page_size_b))
+	{
+		silent_printf("Firmware page size does not match the bootloader.\n");
+		return false;
+	}
+
+	if ((!image->erase) && (!TargetEncoding(target, PLAN_ENCODING_PATCH)))
+	{
+		silent_printf("Bootloader does not support delta updates.\n");
+		return false;
+	}
+
+	if ((!image->erase) && (!CheckDeviceCRC(handle, image->base_crc)))
+	{
+		silent_printf("Device does not match the base image of the delta plan.\n");
+		return false;
+	}
+
+	return true;
+}
+
+/**************************************************************************************************
+* Compile firmware image to a plan file
+*/
+bool CompilePlan(void)
+{
+	if (!LoadFirmware(NULL, hexfile, &image))
+		return false;
+
+	return WritePlanFile(planfile, &image);
+}
+
+/**************************************************************************************************
+* Last error of a device. Transfers to the benchmark's simulated bootloader have no handle.
+*/
+const wchar_t *DeviceError(hid_device *handle)
+{
+	if (handle == NULL)
+		return L"simulated device";
+	return hid_error(handle);
 }
 
 /**************************************************************************************************
@@ -203,10 +744,14 @@ bool CheckBusy(hid_device *handle)
 {
 	BLSTATUS_t buffer;
 	buffer.report_id = 0;
-	int i = hid_get_feature_report(handle, (unsigned char *)&buffer, sizeof(buffer));
-	if ((i == 6) && (buffer.busy_flags == 0))
-		return true;
-	return false;
+	uint64_t start = TimingClock();
+	int i = (bench_device != NULL) ? BenchGetFeatureReport((unsigned char *)&buffer, sizeof(buffer)) :
+									 hid_get_feature_report(handle, (unsigned char *)&buffer, sizeof(buffer));
+	TraceRecord(trace_device, TRACE_GET_FEATURE, TRACE_NO_COMMAND, &buffer, (i > 0) ? sizeof(buffer) : 0, start, (i != -1));
+	if (i != sizeof(buffer) - 1)	// size-1 because report ID not transmitted
+		return false;
+	TagStatus(&buffer);
+	return (buffer.busy_flags != 0);
 }
 
 /**************************************************************************************************
@@ -214,78 +759,376 @@ bool CheckBusy(hid_device *handle)
 */
 bool WaitNotBusy(hid_device *handle)
 {
+	uint64_t start = TimingNow(timing_session);
 	uint8_t timeout = 100;
 	while (CheckBusy(handle))
 	{
+		if (timing_session != NULL)
+			timing_session->busy_polls++;
 		if (--timeout == 0)
 			return false;
 		//Sleep(10);
 	}
+	TimingRecord(timing_session, TIMING_BUSY_WAIT, start);
 	return true;
 }
 
 /**************************************************************************************************
-* Execute a HID bootloader command
+* Note the number of the last IN report the bootloader queued, from its status
 */
-bool ExecuteHIDCommand(hid_device *handle, BLCOMMAND_t *cmd)
+void TagStatus(BLSTATUS_t *status)
+{
+	if ((target_tags != NULL) && target_tags->enabled)
+		target_tags->queued_seq = (status->page_ptr >> STATUS_SEQ_SHIFT) & STATUS_SEQ_MASK;
+}
+
+/**************************************************************************************************
+* Execute a HID bootloader command, returning the status read after it
+*/
+bool ExecuteHIDCommandStatus(hid_device *handle, BLCOMMAND_t *cmd, BLSTATUS_t *status)
 {
-	int res = hid_send_feature_report(handle, (unsigned char *)cmd, sizeof(BLCOMMAND_t));
+	uint64_t start = TimingClock();
+	int res = (bench_device != NULL) ? BenchSendFeatureReport((unsigned char *)cmd, sizeof(BLCOMMAND_t)) :
+									   hid_send_feature_report(handle, (unsigned char *)cmd, sizeof(BLCOMMAND_t));
+	TraceRecord(trace_device, TRACE_SET_FEATURE, cmd->command, cmd, sizeof(BLCOMMAND_t), start, (res != -1));
 	if (res == -1)
 	{
 		silent_printf("hid_send_feature_report failed.\n");
-		silent_printf("%ls\n", hid_error(handle));
+		silent_printf("%ls\n", DeviceError(handle));
 		return false;
 	}
 
-	BLSTATUS_t status;
-	status.report_id = 0;
-	res = hid_get_feature_report(handle, (uint8_t *)&status, sizeof(status));
-	if ((res != sizeof(status) - 1) || (status.result != 0))	// size-1 because report ID not transmitted
+	status->report_id = 0;
+	uint64_t get_start = TimingClock();
+	res = (bench_device != NULL) ? BenchGetFeatureReport((uint8_t *)status, sizeof(BLSTATUS_t)) :
+								   hid_get_feature_report(handle, (uint8_t *)status, sizeof(BLSTATUS_t));
+	bool ok = (res == sizeof(BLSTATUS_t) - 1) && (status->result == 0);	// size-1 because report ID not transmitted
+	TraceRecord(trace_device, TRACE_GET_FEATURE, cmd->command, status, (res > 0) ? sizeof(BLSTATUS_t) : 0, get_start, ok);
+	if (!ok)
 		return false;
+	TagStatus(status);
+	TimingCommand(timing_session, cmd->command, start);
 	return true;
 }
 
 /**************************************************************************************************
-* Execute a HID bootloader command and get response.
+* Execute a HID bootloader command
+*/
+bool ExecuteHIDCommand(hid_device *handle, BLCOMMAND_t *cmd)
+{
+	BLSTATUS_t status;
+	return ExecuteHIDCommandStatus(handle, cmd, &status);
+}
+
+/**************************************************************************************************
+* Read one IN report
+*/
+int ReadHIDReport(hid_device *handle, uint8_t command, uint8_t *buffer, uint8_t buffer_size, int milliseconds)
+{
+	uint64_t start = TimingClock();
+	int res = (bench_device != NULL) ? BenchReadTimeout(buffer, buffer_size, milliseconds) :
+									   hid_read_timeout(handle, buffer, buffer_size, milliseconds);
+	if ((res != 0) || (milliseconds != 0))
+		TraceRecord(trace_device, TRACE_READ, command, buffer, max(res, 0), start, (res > 0));
+	if ((res > 0) && (command != TRACE_NO_COMMAND))
+	{
+		TimingRecord(timing_session, TIMING_RESPONSE, start);
+		TimingBytes(timing_session, 0, res);
+	}
+	return res;
+}
+
+/**************************************************************************************************
+* Send a command with a response without waiting for it. Returns the completion table slot, or -1.
+* Reports nobody is waiting for, e.g. from erasing, are thrown away first.
+*/
+int SubmitHIDCommand(hid_device *handle, BLCOMMAND_t *cmd, uint8_t *buffer, uint8_t buffer_size)
+{
+	BL_TAGS_t *tags = target_tags;
+	int slot;
+	int i;
+
+	for (slot = 0; slot < TAG_SLOTS; slot++)
+		if (!tags->slots[slot].pending)
+			break;
+	if (slot >= TAG_SLOTS)
+		return -1;
+
+	// read the reports that are still on their way, the host's driver may have dropped the oldest
+	// so each one is placed by its number
+	bool waiting = false;
+	for (i = 0; i < TAG_SLOTS; i++)
+		waiting |= tags->slots[i].pending;
+	while ((!waiting) && (tags->read_seq != tags->queued_seq))
+	{
+		uint8_t report[BUFFER_SIZE];
+		uint8_t unread = (tags->queued_seq - tags->read_seq) & STATUS_SEQ_MASK;
+		int res = ReadHIDReport(handle, TRACE_NO_COMMAND, report, sizeof(report), 100);
+		if (res <= 0)	// -1 == failure, 0 == no report available
+		{
+			silent_printf("hid_read failed.\n");
+			silent_printf("%ls\n", DeviceError(handle));
+			return -1;
+		}
+		uint8_t ahead = (report[RESPONSE_SEQ_BYTE] - tags->read_seq) & STATUS_SEQ_MASK;
+		if ((res > RESPONSE_SEQ_BYTE) && (report[RESPONSE_SEQ_BYTE] <= STATUS_SEQ_MASK) && (ahead != 0) && (ahead <= unread))
+			tags->read_seq = report[RESPONSE_SEQ_BYTE];
+		else
+			tags->read_seq = (tags->read_seq + 1) & STATUS_SEQ_MASK;
+	}
+
+	uint8_t queued = tags->queued_seq;
+	BLSTATUS_t status;
+	if (!ExecuteHIDCommandStatus(handle, cmd, &status))
+		return -1;
+	if (tags->queued_seq == queued)
+	{
+		silent_printf("No response queued for command %02X.\n", cmd->command);
+		return -1;
+	}
+
+	BL_SLOT_t *s = &tags->slots[slot];
+	s->pending = true;
+	s->done = false;
+	s->seq = tags->queued_seq;
+	s->command = cmd->command;
+	s->buffer = buffer;
+	s->buffer_size = buffer_size;
+	return slot;
+}
+
+/**************************************************************************************************
+* Wait for a submitted command's response. Reports are numbered in the order they are read, and
+* completed in whichever slot they belong to.
+*/
+bool CompleteHIDCommand(hid_device *handle, int slot)
+{
+	BL_TAGS_t *tags = target_tags;
+	uint8_t report[BUFFER_SIZE];
+	int i;
+
+	while (!tags->slots[slot].done)
+	{
+		BL_SLOT_t *s = NULL;
+		uint8_t seq = (tags->read_seq + 1) & STATUS_SEQ_MASK;
+		for (i = 0; i < TAG_SLOTS; i++)
+		{
+			if (tags->slots[i].pending && (!tags->slots[i].done) && (tags->slots[i].seq == seq))
+				s = &tags->slots[i];
+		}
+
+		int res = ReadHIDReport(handle, (s != NULL) ? s->command : TRACE_NO_COMMAND, report, sizeof(report), 100);
+		if (res <= 0)	// -1 == failure, 0 == no report available
+		{
+			silent_printf("hid_read failed.\n");
+			silent_printf("%ls\n", DeviceError(handle));
+			break;
+		}
+		tags->read_seq = seq;
+		if (s == NULL)
+			continue;
+
+		if (report[RESPONSE_SEQ_BYTE] != seq)
+		{
+			silent_printf("Response %u to command %02X is numbered %u.\n", seq, s->command, report[RESPONSE_SEQ_BYTE]);
+			break;
+		}
+		memcpy(s->buffer, report, min(res, s->buffer_size));
+		s->done = true;
+	}
+
+	bool ok = tags->slots[slot].done;
+	if (!ok)
+	{
+		for (i = 0; i < TAG_SLOTS; i++)
+			tags->slots[i].pending = false;
+	}
+	tags->slots[slot].pending = false;
+	return ok;
+}
+
+/**************************************************************************************************
+* Execute a HID bootloader command and get response. Untagged bootloaders answer with whatever
+* report is next, so unread reports are cleared out first.
 */
 bool ExecuteHIDCommandWithResponse(hid_device *handle, BLCOMMAND_t *cmd, uint8_t *buffer, uint8_t buffer_size)
 {
+	if ((target_tags != NULL) && target_tags->enabled)
+	{
+		int slot = SubmitHIDCommand(handle, cmd, buffer, buffer_size);
+		return (slot >= 0) && CompleteHIDCommand(handle, slot);
+	}
+
 	// clear out any unread reports
-	while ((hid_read_timeout(handle, buffer, buffer_size, 0)) > 0);
+	if (bench_device != NULL)
+		while (BenchReadTimeout(buffer, buffer_size, 0) > 0);
+	else
+		while ((hid_read_timeout(handle, buffer, buffer_size, 0)) > 0);
 	
 	if (!ExecuteHIDCommand(handle, cmd))
 		return false;
 
-	int res = hid_read_timeout(handle, buffer, buffer_size, 100);
+	uint64_t start = TimingClock();
+	int res = (bench_device != NULL) ? BenchReadTimeout(buffer, buffer_size, 100) :
+									   hid_read_timeout(handle, buffer, buffer_size, 100);
+	TraceRecord(trace_device, TRACE_READ, cmd->command, buffer, max(res, 0), start, (res > 0));
 	if ((res == -1) || (res == 0))	// -1 == failure, 0 == no report available
 	{
 		silent_printf("hid_read failed.\n");
-		silent_printf("%ls\n", hid_error(handle));
+		silent_printf("%ls\n", DeviceError(handle));
 		return false;
 	}
+	TimingRecord(timing_session, TIMING_RESPONSE, start);
+	TimingBytes(timing_session, 0, res);
 
 	return true;
 }
 
 /**************************************************************************************************
-* Write loaded firmware image to target
+* Bytes of data in a flash, EEPROM or user signature row read. Tagged bootloaders use the last byte
+* of the report for the response's number.
 */
-bool UpdateFirmware(hid_device *handle)
+uint8_t TargetReadBytes(BL_TARGET_t *target)
+{
+	if (target->has_caps && (target->caps.features & CAP_TAGGED))
+		return RESPONSE_DATA_BYTES;
+	return HID_DATA_BYTES;
+}
+
+/**************************************************************************************************
+* Check if the target can decode a plan entry's encoding. Bootloaders that don't report their
+* capabilities only take raw pages.
+*/
+bool TargetEncoding(BL_TARGET_t *target, uint8_t encoding)
+{
+	static const uint8_t encodings[] = { ENC_RAW, ENC_COMPRESSED, ENC_FILL, ENC_PATCH, ENC_PATCH };
+
+	if (!target->has_caps)
+		return encoding == PLAN_ENCODING_RAW;
+	if (encoding >= sizeof(encodings))
+		return false;
+	return (target->caps.encodings & encodings[encoding]) != 0;
+}
+
+/**************************************************************************************************
+* Send data to the RAM page buffer, one report at a time
+*/
+bool SendPageData(hid_device *handle, uint8_t *data, uint16_t length, int page)
 {
-	BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
 	uint8_t buffer[BUFFER_SIZE];
-	int num_pages = fw_info->flash_size_b / fw_info->page_size_b;
 
-	quiet_printf("Pages:\t%d\n", num_pages);
+	TimingPhase(timing_session, TIMING_STREAM);
+	for (int byte = 0; byte < length; byte += HID_DATA_BYTES)
+	{
+		buffer[0] = 0;	// mandatory report ID
+		memset(&buffer[1], 0xFF, HID_DATA_BYTES);
+		memcpy(&buffer[1], &data[byte], min(HID_DATA_BYTES, length - byte));
+		uint64_t start = TimingClock();
+		int res = (bench_device != NULL) ? BenchWrite(buffer, BUFFER_SIZE) : hid_write(handle, buffer, BUFFER_SIZE);
+		TraceRecord(trace_device, TRACE_WRITE, TRACE_NO_COMMAND, buffer, BUFFER_SIZE, start, (res != -1));
+		if (res == -1)
+		{
+			silent_printf("\nFailed to write to RAM buffer (page %d, byte %d).\n", page, byte);
+			silent_printf("%ls\n", DeviceError(handle));
+			return false;
+		}
+		TimingRecord(timing_session, TIMING_WRITE, start);
+		TimingBytes(timing_session, HID_DATA_BYTES, 0);
+	}
+	return true;
+}
 
-	// erase app section
-	silent_printf("Erasing application section\n");
-	cmd.command = CMD_ERASE_APP_SECTION;
-	if ((!ExecuteHIDCommand(handle, &cmd)) || (!WaitNotBusy(handle)))
+/**************************************************************************************************
+* Run a command that writes the RAM buffer to flash. Unless the bootloader waits for the NVM
+* controller itself and has a second page buffer, wait for the write to finish before going on.
+*/
+bool WritePageCommand(hid_device *handle, BLCOMMAND_t *cmd, int page, bool overlap)
+{
+	TimingPhase(timing_session, TIMING_NVM);
+	if ((!ExecuteHIDCommand(handle, cmd)) || ((!overlap) && (!WaitNotBusy(handle))))
+	{
+		silent_printf("\nFailed to write to page %d.\n", page);
+		silent_printf("%ls\n", DeviceError(handle));
+		return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Expand a fill or compressed plan entry to one raw page. page_data needs room for page_size +
+* HID_DATA_BYTES bytes. False for other encodings or a corrupt page.
+*/
+bool ExpandEntryPage(PLAN_IMAGE_t *image, PLAN_ENTRY_t *entry, uint8_t *page_data)
+{
+	uint16_t page_size = image->fw_info->page_size_b;
+
+	switch (entry->encoding)
 	{
-		silent_printf("Failed to erase application section.\n");
+	case PLAN_ENCODING_FILL:
+		for (uint16_t j = 0; j < page_size; j += 2)
+		{
+			page_data[j] = entry->pattern & 0xFF;
+			page_data[j + 1] = entry->pattern >> 8;
+		}
+		return true;
+
+	case PLAN_ENCODING_COMPRESSED:
+		memcpy(page_data, &image->payload[entry->payload_offset], entry->length);
+		return DecompressPageInPlace(page_data, page_size + HID_DATA_BYTES, page_size, entry->length);
+
+	default:
 		return false;
 	}
+}
+
+/**************************************************************************************************
+* Write a plan entry whose encoding the bootloader can't decode, expanded to raw pages
+*/
+bool WriteEntryRaw(hid_device *handle, PLAN_IMAGE_t *image, PLAN_ENTRY_t *entry, bool overlap)
+{
+	BLCOMMAND_t cmd = { .report_id = 0, .command = CMD_WRITE_PAGE, .params.u32 = 0 };
+	uint16_t page_size = image->fw_info->page_size_b;
+	uint8_t page_data[PLAN_MAX_PAGE_SIZE + HID_DATA_BYTES];
+
+	for (int i = 0; i < entry->count; i++)
+	{
+		if (!ExpandEntryPage(image, entry, page_data))
+		{
+			silent_printf("\nUnable to expand page %d to raw data (encoding %u).\n", entry->page, entry->encoding);
+			return false;
+		}
+		if (!SendPageData(handle, page_data, page_size, entry->page + i))
+			return false;
+		cmd.params.u16[0] = entry->page + i;
+		if (!WritePageCommand(handle, &cmd, entry->page + i, overlap))
+			return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Write loaded firmware image to target, taking the fastest path the bootloader supports
+*/
+bool UpdateFirmware(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image)
+{
+	BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
+	uint8_t buffer[BUFFER_SIZE];
+	int num_pages = image->fw_info->flash_size_b / image->fw_info->page_size_b;
+	bool overlap = target->has_caps && (target->caps.features & CAP_NVM_WAIT) && (target->caps.page_buffers >= 2);
+	int max_batch = (target->has_caps && (target->caps.max_batch != 0)) ? min(target->caps.max_batch, FILL_MAX_PAGES) : FILL_BATCH_PAGES;
+
+	// erase app section
+	if (image->erase)
+	{
+		TimingPhase(timing_session, TIMING_ERASE);
+		silent_printf("Erasing application section\n");
+		cmd.command = CMD_ERASE_APP_SECTION;
+		if ((!ExecuteHIDCommand(handle, &cmd)) || ((!overlap) && (!WaitNotBusy(handle))))
+		{
+			silent_printf("Failed to erase application section.\n");
+			return false;
+		}
+	}
 
 	cmd.command = CMD_SET_POINTER;
 	cmd.params.u16[0] = 0;
@@ -295,30 +1138,38 @@ bool UpdateFirmware(hid_device *handle)
 	// write app section
 	silent_printf("Writing firmware image");
 	uint8_t	c = 0;
-	for (int page = 0; page < num_pages; page++)
+	for (int i = 0; i < image->entry_count; i++)
 	{
-		// load page into RAM buffer
-		for (int byte = 0; byte < fw_info->page_size_b; byte += HID_DATA_BYTES)
+		PLAN_ENTRY_t *entry = &image->entries[i];
+
+		if (!TargetEncoding(target, entry->encoding))
 		{
-			buffer[0] = 0;	// mandatory report ID
-			memcpy(&buffer[1], &firmware_buffer[(page*fw_info->page_size_b) + byte], HID_DATA_BYTES);
-			int res = hid_write(handle, buffer, BUFFER_SIZE);
-			if (res == -1)
-			{
-				silent_printf("\nFailed to write to RAM buffer (page %d, byte %d).\n", page, byte);
-				silent_printf("%ls\n", hid_error(handle));
+			if (!WriteEntryRaw(handle, image, entry, overlap))
 				return false;
+		}
+		else if (entry->encoding == PLAN_ENCODING_FILL)
+		{
+			// split runs longer than the bootloader takes in one command
+			PLAN_ENTRY_t run = *entry;
+			while (run.count > 0)
+			{
+				PLAN_ENTRY_t part = run;
+				part.count = min(run.count, max_batch);
+				PlanEntryCommand(&part, &cmd);
+				if (!WritePageCommand(handle, &cmd, part.page, overlap))
+					return false;
+				run.page += part.count;
+				run.count -= part.count;
 			}
 		}
-
-		// write RAM buffer to page
-		cmd.command = CMD_WRITE_PAGE;
-		cmd.params.u16[0] = page;
-		if ((!ExecuteHIDCommand(handle, &cmd)) || (!WaitNotBusy(handle)))
+		else
 		{
-			silent_printf("\nFailed to write to page %d.\n", page);
-			silent_printf("%ls\n", hid_error(handle));
-			return false;
+			// load page into RAM buffer, then write it
+			if (!SendPageData(handle, &image->payload[entry->payload_offset], entry->length, entry->page))
+				return false;
+			PlanEntryCommand(entry, &cmd);
+			if (!WritePageCommand(handle, &cmd, entry->page, overlap))
+				return false;
 		}
 
 		c++;
@@ -327,9 +1178,12 @@ bool UpdateFirmware(hid_device *handle)
 			quiet_printf(".");
 	}
 	silent_printf("\n");
+	quiet_printf("USB frames:\t%d of %d sent (%d saved)\n", image->reports, (num_pages * image->fw_info->page_size_b) / HID_DATA_BYTES,
+				 ((num_pages * image->fw_info->page_size_b) / HID_DATA_BYTES) - image->reports);
 
 
 	// verify CRC
+	TimingPhase(timing_session, TIMING_CRC);
 	cmd.command = CMD_READ_FLASH_CRCS;
 	if (!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
 	{
@@ -340,8 +1194,8 @@ bool UpdateFirmware(hid_device *handle)
 	uint32_t app_crc;
 	app_crc = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24);
 	quiet_printf("Target CRC:\t0x%lX\n", app_crc);
-	quiet_printf("Local CRC:\t0x%lX\n", firmware_crc);
-	if (app_crc != firmware_crc)
+	quiet_printf("Local CRC:\t0x%lX\n", image->crc);
+	if (app_crc != image->crc)
 	{
 		silent_printf("Firmware image CRC does not match device.\n");
 		return false;
@@ -351,86 +1205,270 @@ bool UpdateFirmware(hid_device *handle)
 }
 
 /**************************************************************************************************
-* Read back firmware from device for byte-by-byte comparison
+* Check if the application section CRC on the device matches
+*/
+bool CheckDeviceCRC(hid_device *handle, uint32_t crc)
+{
+	BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
+	uint8_t buffer[BUFFER_SIZE];
+
+	cmd.command = CMD_READ_FLASH_CRCS;
+	if (!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
+		return false;
+
+	uint32_t app_crc = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24);
+	return (app_crc == crc);
+}
+
+/**************************************************************************************************
+* Read back part of the flash. Tagged bootloaders get several reads outstanding at once, as many
+* as they can queue IN reports for.
+*/
+bool ReadFlash(hid_device *handle, BL_TARGET_t *target, uint32_t addr, uint8_t *data, uint16_t length)
+{
+	BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
+	uint8_t buffer[BUFFER_SIZE];
+	int slots[TAG_SLOTS];
+	uint8_t step = TargetReadBytes(target);
+	uint16_t sent = 0;
+	uint16_t done;
+
+	cmd.command = CMD_READ_FLASH;
+	if ((target_tags == NULL) || (!target_tags->enabled))
+	{
+		for (done = 0; done < length; done += step)
+		{
+			cmd.params.u32 = addr + done;
+			if (!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
+				return false;
+			memcpy(&data[done], buffer, min(step, length - done));
+		}
+		return true;
+	}
+
+	int window = max(target->caps.in_queue, 1);
+	window = min(window, TAG_SLOTS) * step;
+	for (done = 0; done < length; done += step)
+	{
+		while ((sent < length) && (sent - done < window))
+		{
+			cmd.params.u32 = addr + sent;
+			int slot = SubmitHIDCommand(handle, &cmd, &data[sent], (uint8_t)min(step, length - sent));
+			if (slot < 0)
+			{
+				memset(target_tags->slots, 0, sizeof(target_tags->slots));
+				return false;
+			}
+			slots[(sent / step) % TAG_SLOTS] = slot;
+			sent += step;
+		}
+		if (!CompleteHIDCommand(handle, slots[(done / step) % TAG_SLOTS]))
+			return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Verify firmware on device. Populated pages are read back and checked against the page CRCs in
+* the plan, runs of unpopulated pages are blank checked by the device.
 */
-bool VerifyFirmware(hid_device *handle)
+bool VerifyFirmware(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image)
 {
 	BLCOMMAND_t cmd;
 	cmd.report_id = 0;
-	cmd.command = CMD_READ_FLASH;
 	uint8_t buffer[BUFFER_SIZE];
+	uint8_t page_data[1024 + HID_DATA_BYTES];
+	int num_pages = image->fw_info->flash_size_b / image->fw_info->page_size_b;
+	bool blank_check = (!target->has_caps) || (target->caps.features & CAP_BLANK_CHECK);
+	int next = 0;		// next populated page in image->pages
+	uint16_t step = TargetReadBytes(target);
+	uint16_t carry = 0;	// bytes of this page read along with the previous one
 
+	TimingPhase(timing_session, TIMING_VERIFY);
 	silent_printf("Verifying firmware image");
-	uint32_t addr = 0;
+	int page = 0;
 	uint8_t	c = 0;
-	while (addr < fw_info->flash_size_b)
+	while (page < num_pages)
 	{
-		cmd.params.u32 = addr;
-		if (!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
-		{
-			silent_printf("\nRead failed at address 0x%08X\n", addr);
-			return false;
-		}
-		
-		for (uint8_t i = 0; i < 64; i++)
+		bool blank = (next >= image->page_count) || (image->pages[next].page != page);
+
+		if (blank && blank_check)
 		{
-			if (buffer[i] != firmware_buffer[addr])
+			int run = 1;
+			if (next < image->page_count)
+				run = image->pages[next].page - page;
+			else
+				run = num_pages - page;
+			run = min(run, BLANK_CHECK_MAX_PAGES);
+
+			cmd.command = CMD_BLANK_CHECK;
+			cmd.params.u16[0] = page;
+			cmd.params.u16[1] = run;
+			if (ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
 			{
-				silent_printf("\nVerify failed at address 0x%08X\n", addr);
-				return false;
+				uint32_t addr = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (buffer[3] << 24);
+				if (addr != 0xFFFFFFFF)
+				{
+					silent_printf("\nVerify failed at address 0x%08X (not blank)\n", addr);
+					return false;
+				}
+				page += run;
+				continue;
 			}
-			addr++;
+			// older bootloaders don't support blank checking, fall back to reading back
+			blank_check = false;
 		}
 
-		if (!opt_quiet)
+		// tagged reads don't end on a page boundary, when the next page is read back too the last
+		// one runs on into it instead of leaving a short read for it
+		uint32_t addr = page * image->fw_info->page_size_b;
+		uint16_t length = image->fw_info->page_size_b - carry;
+		int following = blank ? next : next + 1;
+		if ((page + 1 < num_pages) &&
+			((!blank_check) || ((following < image->page_count) && (image->pages[following].page == page + 1))))
+			length = ((length + step - 1) / step) * step;
+		if (!ReadFlash(handle, target, addr + carry, &page_data[carry], length))
+		{
+			silent_printf("\nRead failed in page %d (0x%08X)\n", page, addr);
+			return false;
+		}
+		for (uint16_t byte = carry; byte < carry + length; byte += step)
 		{
 			c++;
 			c &= 0x0F;
 			if (c == 0)
-				printf(".");
+				quiet_printf(".");
+		}
+
+		if (blank)
+		{
+			for (uint16_t i = 0; i < image->fw_info->page_size_b; i++)
+			{
+				if (page_data[i] != 0xFF)
+				{
+					silent_printf("\nVerify failed at address 0x%08X (not blank)\n", addr + i);
+					return false;
+				}
+			}
+		}
+		else
+		{
+			if (crc32(page_data, image->fw_info->page_size_b) != image->pages[next].crc)
+			{
+				silent_printf("\nVerify failed in page %d (0x%08X)\n", page, addr);
+				return false;
+			}
+			next++;
 		}
+		carry = carry + length - image->fw_info->page_size_b;
+		memmove(page_data, &page_data[image->fw_info->page_size_b], carry);
+		page++;
 	}
 	silent_printf("\n");
 	
 	return true;
 }
 
+/**************************************************************************************************
+* Reset target MCU into the application
+*/
+bool ResetTarget(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image)
+{
+	TimingPhase(timing_session, TIMING_RESET);
+	quiet_printf("Resetting MCU...\n");
+	BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
+	cmd.command = CMD_RESET_MCU;
+	if ((!target->has_caps) || (target->caps.features & CAP_BOOT_RECORD))
+		cmd.params.u32 = PlanImageLength(image);	// boot record, older bootloaders ignore it
+	if (!ExecuteHIDCommand(handle, &cmd))
+	{
+		silent_printf("Failed to reset target.\n");
+		silent_printf("%ls\n", DeviceError(handle));
+		return false;
+	}
+	return true;
+}
+
 /**************************************************************************************************
 * Check device serial number, MCU ID and fuses
 */
-bool GetBootloaderInfo(hid_device *handle)
+bool GetBootloaderInfo(hid_device *handle, BL_TARGET_t *target)
 {
 	BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
 	uint8_t buffer[BUFFER_SIZE];
 
+	TimingPhase(timing_session, TIMING_INFO);
+	target_tags = NULL;		// a new device, untagged until its capabilities are read
+
 	// serial number
 	cmd.command = CMD_READ_SERIAL;
 	if (!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
 		return false;
 	buffer[BUFFER_SIZE - 1] = '\0';		// ensure string is null terminated
-	quiet_printf("Serial:\t\t%s\n", buffer);
+	memcpy(target->serial, buffer, sizeof(target->serial));
+	quiet_printf("Serial:\t\t%s\n", target->serial);
 
 	// MCU ID
 	cmd.command = CMD_READ_MCU_IDS;
 	if (!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
 		return false;
-	target_mcu_id[0] = buffer[0];
-	target_mcu_id[1] = buffer[1];
-	target_mcu_id[2] = buffer[2];
-	target_mcu_id[3] = buffer[3];
-	quiet_printf("MCU ID:\t\t%02X%02X%02X-%c\n", target_mcu_id[0], target_mcu_id[1], target_mcu_id[2], target_mcu_id[3] + 'A');
+	target->mcu_id[0] = buffer[0];
+	target->mcu_id[1] = buffer[1];
+	target->mcu_id[2] = buffer[2];
+	target->mcu_id[3] = buffer[3];
+	quiet_printf("MCU ID:\t\t%02X%02X%02X-%c\n", target->mcu_id[0], target->mcu_id[1], target->mcu_id[2], target->mcu_id[3] + 'A');
 
 	// MCU fuses
 	cmd.command = CMD_READ_FUSES;
 	if (!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer)))
 		return false;
-	target_mcu_fuses[0] = buffer[0];
-	target_mcu_fuses[1] = buffer[1];
-	target_mcu_fuses[2] = buffer[2];
-	target_mcu_fuses[3] = buffer[3];
-	target_mcu_fuses[4] = buffer[4];
-	target_mcu_fuses[5] = buffer[5];
-	quiet_printf("MCU fuses:\t%02X %02X %02X %02X %02X %02X\n", target_mcu_fuses[0], target_mcu_fuses[1], target_mcu_fuses[2], target_mcu_fuses[3], target_mcu_fuses[4], target_mcu_fuses[5]);
+	target->mcu_fuses[0] = buffer[0];
+	target->mcu_fuses[1] = buffer[1];
+	target->mcu_fuses[2] = buffer[2];
+	target->mcu_fuses[3] = buffer[3];
+	target->mcu_fuses[4] = buffer[4];
+	target->mcu_fuses[5] = buffer[5];
+	quiet_printf("MCU fuses:\t%02X %02X %02X %02X %02X %02X\n", target->mcu_fuses[0], target->mcu_fuses[1], target->mcu_fuses[2], target->mcu_fuses[3], target->mcu_fuses[4], target->mcu_fuses[5]);
+
+	GetCapabilities(handle, target);
+	return true;
+}
+
+/**************************************************************************************************
+* Read what the bootloader supports. Older bootloaders reject the command and are programmed the
+* original way, polling busy after every write and trying blank checks.
+*/
+bool GetCapabilities(hid_device *handle, BL_TARGET_t *target)
+{
+	BLCOMMAND_t cmd = { .report_id = 0, .params.u32 = 0 };
+	uint8_t buffer[BUFFER_SIZE];
+
+	target->has_caps = false;
+	memset(&target->caps, 0, sizeof(target->caps));
+
+	cmd.command = CMD_READ_CAPABILITIES;
+	if ((!ExecuteHIDCommandWithResponse(handle, &cmd, buffer, sizeof(buffer))) || (buffer[0] < CAPS_VERSION))
+	{
+		quiet_printf("Capabilities:\tnot reported, using the legacy flow\n");
+		return false;
+	}
+	memcpy(&target->caps, buffer, sizeof(target->caps));
+	target->has_caps = true;
+
+	// the response was the last report queued, numbering carries on from it
+	memset(&target->tags, 0, sizeof(target->tags));
+	if (target->caps.features & CAP_TAGGED)
+	{
+		target->tags.enabled = true;
+		target->tags.queued_seq = buffer[RESPONSE_SEQ_BYTE] & STATUS_SEQ_MASK;
+		target->tags.read_seq = target->tags.queued_seq;
+		target_tags = &target->tags;
+	}
 
+	quiet_printf("Bootloader:\tversion %u, features %04X, encodings %02X\n", target->caps.bootloader_version,
+				 target->caps.features, target->caps.encodings);
+	quiet_printf("Page buffers:\t%u, batches of %u pages\n", target->caps.page_buffers, target->caps.max_batch);
+	quiet_printf("NVM timing:\tpage write %u ms, erase and write %u ms, section erase %u ms\n", target->caps.page_write_ms,
+				 target->caps.page_erase_write_ms, target->caps.app_erase_ms);
 	return true;
 }
\ No newline at end of file
@@ -0,0 +1,67 @@
+// hid_bootloader.h
+
+#ifndef __HID_BOOTLOADER_H
+#define __HID_BOOTLOADER_H
+
+
+#define MAX_STR				255
+#define	BUFFER_SIZE			(64+1)		// +1 for mandatory HID report ID
+#define	MAX_SERIALS			64
+#define	TAG_SLOTS			8			// commands with responses outstanding at once
+
+
+// a command waiting for its response, matched by the number of its IN report
+typedef struct {
+	bool		pending;
+	bool		done;
+	uint8_t		seq;
+	uint8_t		command;
+	uint8_t		*buffer;
+	uint8_t		buffer_size;
+} BL_SLOT_t;
+
+// completion table for bootloaders with tagged responses
+typedef struct {
+	bool		enabled;
+	uint8_t		queued_seq;				// last IN report queued by the bootloader, from the status
+	uint8_t		read_seq;				// last IN report read
+	BL_SLOT_t	slots[TAG_SLOTS];
+} BL_TAGS_t;
+
+// per device information read from the bootloader
+typedef struct {
+	char		serial[BUFFER_SIZE];
+	uint8_t		mcu_id[4];
+	uint8_t		mcu_fuses[6];
+	bool		has_caps;				// false for bootloaders without CMD_READ_CAPABILITIES
+	BL_CAPS_t	caps;
+	BL_TAGS_t	tags;
+} BL_TARGET_t;
+
+
+extern char *basefile;
+extern bool opt_reset;
+extern bool opt_verify;
+extern bool opt_compress;
+extern __declspec(thread) BL_TAGS_t *target_tags;
+
+
+extern bool SerialSelected(const wchar_t *serial);
+extern bool ExecuteHIDCommand(hid_device *handle, BLCOMMAND_t *cmd);
+extern int SubmitHIDCommand(hid_device *handle, BLCOMMAND_t *cmd, uint8_t *buffer, uint8_t buffer_size);
+extern bool CompleteHIDCommand(hid_device *handle, int slot);
+extern bool ExecuteHIDCommandWithResponse(hid_device *handle, BLCOMMAND_t *cmd, uint8_t *buffer, uint8_t buffer_size);
+extern bool UpdateFirmware(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image);
+extern bool VerifyFirmware(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image);
+extern bool ResetTarget(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image);
+extern bool GetBootloaderInfo(hid_device *handle, BL_TARGET_t *target);
+extern bool GetCapabilities(hid_device *handle, BL_TARGET_t *target);
+extern uint8_t TargetReadBytes(BL_TARGET_t *target);
+extern bool TargetEncoding(BL_TARGET_t *target, uint8_t encoding);
+extern bool ExpandEntryPage(PLAN_IMAGE_t *image, PLAN_ENTRY_t *entry, uint8_t *page_data);
+extern bool CheckTarget(hid_device *handle, BL_TARGET_t *target, PLAN_IMAGE_t *image);
+extern bool CheckDeviceCRC(hid_device *handle, uint32_t crc);
+extern bool LoadFirmware(hid_device *handle, char *filename, PLAN_IMAGE_t *image);
+
+
+#endif
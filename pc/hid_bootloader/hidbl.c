@@ -0,0 +1,449 @@
+// hidbl.c
+//
+// Host library for the HID bootloader, a job API over the event driven engine. See hidbl.h for
+// the threading rules.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "gang.h"
+#include "sched.h"
+#include "engine.h"
+#include "hidbl.h"
+
+
+// the .hex reader and plan builder work in shared buffers, one image is built at a time
+SRWLOCK	hidbl_load_lock = SRWLOCK_INIT;
+
+
+/**************************************************************************************************
+* Load a .hex or plan file as an image owned by the caller, free it with FreePlanImage(). With a
+* base image a delta plan is built. quiet stops the readers describing the image, on this thread
+* only. Safe to call from any thread.
+*/
+bool HidblLoadImage(char *filename, char *basefile, bool compress, bool quiet, PLAN_IMAGE_t *image)
+{
+	PLAN_IMAGE_t loaded;
+	bool res = false;
+
+	AcquireSRWLockExclusive(&hidbl_load_lock);
+	bool save_thread_silent = opt_thread_silent;
+	opt_thread_silent = opt_thread_silent || quiet;
+
+	if (IsPlanFile(filename))
+	{
+		if (LoadPlanFile(filename, &loaded))
+		{
+			res = CopyPlanImage(image, &loaded);
+			ClosePlanImage(&loaded);
+		}
+	}
+	else
+	{
+		uint32_t base_crc = 0;
+		res = true;
+		if (basefile != NULL)
+		{
+			res = ReadHexFile(basefile);
+			memcpy(delta_base_buffer, firmware_buffer, sizeof(delta_base_buffer));
+			base_crc = firmware_crc;
+		}
+		if (res)
+			res = ReadHexFile(filename);
+		if (res)
+			res = (basefile != NULL) ? PlanDelta(delta_base_buffer, base_crc) : PlanPages(compress);
+		if (res)
+		{
+			GetPlanImage(&loaded);
+			res = CopyPlanImage(image, &loaded);
+		}
+	}
+
+	opt_thread_silent = save_thread_silent;
+	ReleaseSRWLockExclusive(&hidbl_load_lock);
+	return res;
+}
+
+/**************************************************************************************************
+* List attached bootloaders, returns the number found up to max
+*/
+int HidblEnumerate(unsigned short vid, unsigned short pid, HIDBL_DEVICE_INFO_t *list, int max)
+{
+	struct hid_device_info *devs, *cur;
+	int count = 0;
+
+	devs = hid_enumerate(vid, pid);
+	for (cur = devs; (cur != NULL) && (count < max); cur = cur->next)
+	{
+		memset(&list[count], 0, sizeof(HIDBL_DEVICE_INFO_t));
+		strncpy(list[count].path, cur->path, MAX_PATH - 1);
+		if (cur->serial_number != NULL)
+			_snprintf(list[count].serial, sizeof(list[count].serial) - 1, "%ls", cur->serial_number);
+		count++;
+	}
+	hid_free_enumeration(devs);
+	return count;
+}
+
+/**************************************************************************************************
+* Report an event to the context's callback
+*/
+void HidblEvent(HIDBL_CONTEXT_t *ctx, HIDBL_EVENT_TYPE_t type, HIDBL_JOB_t *job, void *user, const char *stage, int done, int total)
+{
+	HIDBL_EVENT_t event;
+
+	if (ctx->callback == NULL)
+		return;
+	event.type = type;
+	event.job = job;
+	event.user = user;
+	event.stage = stage;
+	event.done = done;
+	event.total = total;
+	ctx->callback(ctx, &event);
+}
+
+/**************************************************************************************************
+* Job is finished, the results must already be filled in. The callback may free the job.
+*/
+void HidblFinish(HIDBL_CONTEXT_t *ctx, HIDBL_JOB_t *job)
+{
+	InterlockedExchange(&job->state, HIDBL_JOB_DONE);
+	HidblEvent(ctx, HIDBL_EVENT_DONE, job, job->user, job->stage, 0, 0);
+}
+
+/**************************************************************************************************
+* Finish a job that could not be started
+*/
+void HidblReject(HIDBL_CONTEXT_t *ctx, HIDBL_JOB_t *job, const char *stage)
+{
+	job->result = false;
+	job->stage = stage;
+	job->time_ms = 0;
+	HidblFinish(ctx, job);
+}
+
+/**************************************************************************************************
+* Engine callback, a device moved on to a new stage or made progress within one
+*/
+void HidblEngineProgress(ENGINE_DEVICE_t *ed, int done, int total)
+{
+	HIDBL_CONTEXT_t *ctx = (HIDBL_CONTEXT_t *)ed->engine->user;
+	HIDBL_JOB_t *job = ctx->slots[ed->index].job;
+
+	HidblEvent(ctx, (total == 0) ? HIDBL_EVENT_STAGE : HIDBL_EVENT_PROGRESS, job, job->user, ed->dev->stage, done, total);
+}
+
+/**************************************************************************************************
+* Engine callback, a device finished
+*/
+void HidblEngineFinished(ENGINE_DEVICE_t *ed)
+{
+	HIDBL_CONTEXT_t *ctx = (HIDBL_CONTEXT_t *)ed->engine->user;
+	HIDBL_SLOT_t *slot = &ctx->slots[ed->index];
+	HIDBL_JOB_t *job = slot->job;
+
+	job->result = slot->dev.result;
+	job->stage = slot->dev.stage;
+	job->time_ms = slot->dev.time_ms;
+	job->target = slot->dev.target;
+	slot->job = NULL;
+	ctx->running--;
+	HidblFinish(ctx, job);
+}
+
+/**************************************************************************************************
+* Create a context for up to max_devices different devices. hub_budget is the number of devices
+* per hub that may stream at once, 0 to estimate it. callback may be NULL.
+*/
+HIDBL_CONTEXT_t *HidblCreate(int max_devices, int hub_budget, HIDBL_CALLBACK_t callback, void *user)
+{
+	if (hid_init() != 0)
+		return NULL;
+
+	HIDBL_CONTEXT_t *ctx = calloc(1, sizeof(HIDBL_CONTEXT_t));
+	if (ctx == NULL)
+		return NULL;
+	ctx->slots = calloc(max_devices, sizeof(HIDBL_SLOT_t));
+	if ((ctx->slots == NULL) || (!EngineOpen(&ctx->engine, max_devices, hub_budget)))
+	{
+		free(ctx->slots);
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->engine.progress = HidblEngineProgress;
+	ctx->engine.finished = HidblEngineFinished;
+	ctx->engine.user = ctx;
+	ctx->callback = callback;
+	ctx->user = user;
+	return ctx;
+}
+
+/**************************************************************************************************
+* Cancel any jobs, wait for them to finish and free the context
+*/
+void HidblDestroy(HIDBL_CONTEXT_t *ctx)
+{
+	ctx->closing = true;
+	for (int i = 0; i < ctx->engine.device_count; i++)
+	{
+		if (ctx->slots[i].job != NULL)
+			EngineCancel(ctx->slots[i].ed);
+	}
+	while (HidblPoll(ctx, ENGINE_POLL_MS) != 0)
+		;
+
+	EngineShutdown(&ctx->engine);
+	for (int i = 0; i < ctx->engine.max_devices; i++)
+		free(ctx->slots[i].dev.path);
+	free(ctx->slots);
+	free(ctx);
+}
+
+/**************************************************************************************************
+* Close a slot's device and free the slot. Its job must have finished.
+*/
+void HidblFreeSlot(HIDBL_SLOT_t *slot)
+{
+	EngineRemoveDevice(slot->ed);
+	free(slot->dev.path);
+	memset(slot, 0, sizeof(HIDBL_SLOT_t));
+}
+
+/**************************************************************************************************
+* Find a device's slot, adding it if it is new. When the context is full the first slot without a
+* job is given up, its device is just opened again by its next job. NULL if every slot is busy.
+*/
+HIDBL_SLOT_t *HidblFindSlot(HIDBL_CONTEXT_t *ctx, const char *path, bool add)
+{
+	int idle = -1;
+	int used = 0;
+
+	for (int i = 0; i < ctx->engine.device_count; i++)
+	{
+		HIDBL_SLOT_t *slot = &ctx->slots[i];
+		if (slot->dev.path == NULL)
+			continue;
+		if ((!slot->removed) && (_stricmp(slot->dev.path, path) == 0))
+			return slot;
+		if ((idle == -1) && (slot->job == NULL))
+			idle = i;
+		used++;
+	}
+	if (!add)
+		return NULL;
+	if (used >= ctx->engine.max_devices)
+	{
+		if (idle == -1)
+			return NULL;
+		HidblFreeSlot(&ctx->slots[idle]);
+	}
+
+	GANG_DEVICE_t dev;
+	memset(&dev, 0, sizeof(dev));
+	dev.path = _strdup(path);
+	if (dev.path == NULL)
+		return NULL;
+
+	// the engine entry and the slot share an index, which isn't known until the device is added
+	ENGINE_DEVICE_t *ed = EngineAddDevice(&ctx->engine, &dev);
+	if (ed == NULL)
+	{
+		free(dev.path);
+		return NULL;
+	}
+	HIDBL_SLOT_t *slot = &ctx->slots[ed->index];
+	slot->dev = dev;
+	slot->ed = ed;
+	ed->dev = &slot->dev;
+	ed->keep_open = true;
+	return slot;
+}
+
+/**************************************************************************************************
+* Start a submitted job on the engine thread
+*/
+void HidblStart(HIDBL_CONTEXT_t *ctx, HIDBL_JOB_t *job)
+{
+	InterlockedDecrement(&ctx->pending);
+	if (job->cancel || ctx->closing)
+	{
+		HidblReject(ctx, job, "cancelled");
+		return;
+	}
+
+	HIDBL_SLOT_t *slot = HidblFindSlot(ctx, job->path, true);
+	if (slot == NULL)
+	{
+		HidblReject(ctx, job, "open");
+		return;
+	}
+	if (slot->job != NULL)
+	{
+		HidblReject(ctx, job, "busy");
+		return;
+	}
+
+	slot->job = job;
+	memset(&slot->dev.target, 0, sizeof(slot->dev.target));
+	ctx->running++;
+	InterlockedExchange(&job->state, HIDBL_JOB_RUNNING);
+	EngineStart(slot->ed, job->image, (job->options & HIDBL_OPT_VERIFY) != 0, (job->options & HIDBL_OPT_RESET) != 0);
+}
+
+/**************************************************************************************************
+* Submit a job to update the device at path with image. Returns NULL if it couldn't be queued.
+* Safe to call from any thread, the job starts on the thread calling HidblPoll().
+*/
+HIDBL_JOB_t *HidblSubmit(HIDBL_CONTEXT_t *ctx, const char *path, PLAN_IMAGE_t *image, int options, void *user)
+{
+	HIDBL_JOB_t *job = calloc(1, sizeof(HIDBL_JOB_t));
+	if (job == NULL)
+		return NULL;
+	job->ctx = ctx;
+	strncpy(job->path, path, MAX_PATH - 1);
+	job->image = image;
+	job->options = options;
+	job->user = user;
+	job->state = HIDBL_JOB_QUEUED;
+	job->stage = "queued";
+
+	InterlockedIncrement(&ctx->pending);
+	if (!PostQueuedCompletionStatus(ctx->engine.port, HIDBL_PACKET_SUBMIT, (ULONG_PTR)job, NULL))
+	{
+		InterlockedDecrement(&ctx->pending);
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+/**************************************************************************************************
+* Ask for a job to be cancelled. It still finishes with a done event. Safe to call from any thread.
+*/
+void HidblCancel(HIDBL_JOB_t *job)
+{
+	InterlockedExchange(&job->cancel, 1);
+}
+
+/**************************************************************************************************
+* Check if a job has finished. Safe to call from any thread.
+*/
+bool HidblJobDone(HIDBL_JOB_t *job)
+{
+	return (InterlockedCompareExchange(&job->state, 0, 0) == HIDBL_JOB_DONE);
+}
+
+/**************************************************************************************************
+* Free a finished job
+*/
+void HidblFreeJob(HIDBL_JOB_t *job)
+{
+	free(job);
+}
+
+/**************************************************************************************************
+* Wake the thread calling HidblPoll() with a user event. user must not be NULL. Safe to call from
+* any thread.
+*/
+bool HidblPost(HIDBL_CONTEXT_t *ctx, void *user)
+{
+	if (user == NULL)
+		return false;
+	return PostQueuedCompletionStatus(ctx->engine.port, HIDBL_PACKET_USER, (ULONG_PTR)user, NULL) != FALSE;
+}
+
+/**************************************************************************************************
+* Check if a device has a job in progress
+*/
+bool HidblBusy(HIDBL_CONTEXT_t *ctx, const char *path)
+{
+	HIDBL_SLOT_t *slot = HidblFindSlot(ctx, path, false);
+	return (slot != NULL) && (slot->job != NULL);
+}
+
+/**************************************************************************************************
+* Tell the context a device has been unplugged, so that its handle is closed and its slot freed.
+* A job in progress on it is cancelled. Safe to call from any thread.
+*/
+bool HidblRemoveDevice(HIDBL_CONTEXT_t *ctx, const char *path)
+{
+	char *copy = _strdup(path);
+	if (copy == NULL)
+		return false;
+	if (!PostQueuedCompletionStatus(ctx->engine.port, HIDBL_PACKET_REMOVED, (ULONG_PTR)copy, NULL))
+	{
+		free(copy);
+		return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Device unplugged, free its slot now or once its job has finished
+*/
+void HidblRemoved(HIDBL_CONTEXT_t *ctx, char *path)
+{
+	HIDBL_SLOT_t *slot = HidblFindSlot(ctx, path, false);
+	free(path);
+	if (slot == NULL)
+		return;
+	if (slot->job == NULL)
+		HidblFreeSlot(slot);
+	else
+	{
+		slot->removed = true;
+		EngineCancel(slot->ed);
+	}
+}
+
+/**************************************************************************************************
+* Handle whatever happens in the next timeout ms, calling the callback for any events. Returns the
+* number of jobs that are not finished yet.
+*/
+int HidblPoll(HIDBL_CONTEXT_t *ctx, DWORD timeout)
+{
+	DWORD type = 0;
+
+	ULONG_PTR key = EnginePoll(&ctx->engine, timeout, &type);
+	if (key != 0)
+	{
+		if (type == HIDBL_PACKET_SUBMIT)
+			HidblStart(ctx, (HIDBL_JOB_t *)key);
+		else if (type == HIDBL_PACKET_USER)
+			HidblEvent(ctx, HIDBL_EVENT_USER, NULL, (void *)key, NULL, 0, 0);
+		else if (type == HIDBL_PACKET_REMOVED)
+			HidblRemoved(ctx, (char *)key);
+	}
+
+	for (int i = 0; i < ctx->engine.device_count; i++)
+	{
+		HIDBL_SLOT_t *slot = &ctx->slots[i];
+		if ((slot->job != NULL) && slot->job->cancel)
+			EngineCancel(slot->ed);
+		else if ((slot->job == NULL) && slot->removed)
+			HidblFreeSlot(slot);
+	}
+
+	return ctx->running + ctx->pending;
+}
+
+/**************************************************************************************************
+* Poll until every submitted job has finished
+*/
+void HidblRun(HIDBL_CONTEXT_t *ctx)
+{
+	while (HidblPoll(ctx, ENGINE_POLL_MS) != 0)
+		;
+}
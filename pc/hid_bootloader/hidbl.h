@@ -0,0 +1,113 @@
+// hidbl.h
+//
+// Host library for the HID bootloader, for programs that run updates themselves. Each context
+// owns an engine, and any number of contexts can be used at once. Nothing is printed, progress
+// and results are reported as events.
+//
+// Jobs are submitted from any thread and run by whichever thread calls HidblPoll(), which also
+// calls the callback. Only that thread may call HidblBusy() and HidblDestroy(). HidblCancel(),
+// HidblJobDone() and HidblRemoveDevice() can be called from any thread. A finished job is freed with HidblFreeJob(),
+// either from the callback or, with no callback, once HidblJobDone() returns true.
+//
+// Include after hidapi.h, intel_hex.h, bootloader.h, plan.h, hid_bootloader.h, timing.h, gang.h,
+// sched.h and engine.h. The program must define opt_quiet, opt_silent and opt_thread_silent (see
+// opt_output.h).
+
+#ifndef __HIDBL_H
+#define __HIDBL_H
+
+
+#define	HIDBL_OPT_VERIFY			0x01
+#define	HIDBL_OPT_RESET				0x02
+
+// completion packets posted to the engine thread, the byte count says which
+#define	HIDBL_PACKET_SUBMIT			1
+#define	HIDBL_PACKET_USER			2
+#define	HIDBL_PACKET_REMOVED		3
+
+
+typedef enum {
+	HIDBL_EVENT_STAGE = 0,				// job moved on to a new stage
+	HIDBL_EVENT_PROGRESS,				// done of total steps of the current stage complete
+	HIDBL_EVENT_DONE,					// job finished, see result
+	HIDBL_EVENT_USER,					// posted with HidblPost()
+} HIDBL_EVENT_TYPE_t;
+
+typedef enum {
+	HIDBL_JOB_QUEUED = 0,
+	HIDBL_JOB_RUNNING,
+	HIDBL_JOB_DONE,
+} HIDBL_JOB_STATE_t;
+
+typedef struct HIDBL_CONTEXT_s HIDBL_CONTEXT_t;
+
+// update of one device, owned by the caller from HidblSubmit() until HidblFreeJob()
+typedef struct {
+	HIDBL_CONTEXT_t		*ctx;
+	char				path[MAX_PATH];
+	PLAN_IMAGE_t		*image;
+	int					options;		// HIDBL_OPT_*
+	void				*user;			// for the caller's use
+	volatile LONG		state;			// HIDBL_JOB_STATE_t
+	volatile LONG		cancel;
+
+	// results, valid once the job is done
+	bool				result;
+	const char			*stage;			// stage that failed if result is false
+	DWORD				time_ms;
+	BL_TARGET_t			target;
+} HIDBL_JOB_t;
+
+typedef struct {
+	HIDBL_EVENT_TYPE_t	type;
+	HIDBL_JOB_t			*job;			// NULL for user events
+	void				*user;			// job's user pointer, or the one posted
+	const char			*stage;
+	int					done;
+	int					total;
+} HIDBL_EVENT_t;
+
+typedef void (*HIDBL_CALLBACK_t)(HIDBL_CONTEXT_t *ctx, HIDBL_EVENT_t *event);
+
+// device known to a context, kept so that its handle can stay open between jobs. Free when
+// dev.path is NULL.
+typedef struct {
+	GANG_DEVICE_t		dev;
+	ENGINE_DEVICE_t		*ed;
+	HIDBL_JOB_t			*job;			// job in progress
+	bool				removed;		// device went away, freed when its job finishes
+} HIDBL_SLOT_t;
+
+struct HIDBL_CONTEXT_s {
+	ENGINE_t			engine;
+	HIDBL_SLOT_t		*slots;
+	HIDBL_CALLBACK_t	callback;
+	void				*user;			// for the caller's use
+	int					running;
+	volatile LONG		pending;		// submitted, not yet started
+	bool				closing;
+};
+
+// attached bootloader found by HidblEnumerate()
+typedef struct {
+	char				path[MAX_PATH];
+	char				serial[BUFFER_SIZE];
+} HIDBL_DEVICE_INFO_t;
+
+
+extern bool HidblLoadImage(char *filename, char *basefile, bool compress, bool quiet, PLAN_IMAGE_t *image);
+extern int HidblEnumerate(unsigned short vid, unsigned short pid, HIDBL_DEVICE_INFO_t *list, int max);
+extern HIDBL_CONTEXT_t *HidblCreate(int max_devices, int hub_budget, HIDBL_CALLBACK_t callback, void *user);
+extern void HidblDestroy(HIDBL_CONTEXT_t *ctx);
+extern HIDBL_JOB_t *HidblSubmit(HIDBL_CONTEXT_t *ctx, const char *path, PLAN_IMAGE_t *image, int options, void *user);
+extern void HidblCancel(HIDBL_JOB_t *job);
+extern bool HidblJobDone(HIDBL_JOB_t *job);
+extern void HidblFreeJob(HIDBL_JOB_t *job);
+extern bool HidblPost(HIDBL_CONTEXT_t *ctx, void *user);
+extern bool HidblBusy(HIDBL_CONTEXT_t *ctx, const char *path);
+extern bool HidblRemoveDevice(HIDBL_CONTEXT_t *ctx, const char *path);
+extern int HidblPoll(HIDBL_CONTEXT_t *ctx, DWORD timeout);
+extern void HidblRun(HIDBL_CONTEXT_t *ctx);
+
+
+#endif
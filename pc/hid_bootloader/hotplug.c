@@ -0,0 +1,308 @@
+// hotplug.c
+//
+// Waits for bootloaders to be attached. A message only window registers for HID device interface
+// arrival notifications, so the update can start as soon as Windows reports a matching device,
+// without polling hid_enumerate().
+//
+// HotplugWatch() runs a second window on its own thread and reports arrivals and removals to a
+// callback, for programs that keep a list of attached devices.
+
+#include <stdio.h>
+#include <windows.h>
+#include <dbt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "hotplug.h"
+
+
+// GUID_DEVINTERFACE_HID
+static const GUID hotplug_hid_guid = { 0x4D1E55B2, 0xF16F, 0x11CF, { 0x88, 0xCB, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
+
+HWND		hotplug_window = NULL;
+HDEVNOTIFY	hotplug_notify = NULL;
+char		hotplug_match[32];						// vid_xxxx&pid_xxxx
+char		hotplug_queue[HOTPLUG_QUEUE_SIZE][MAX_PATH];
+int			hotplug_queue_head = 0;
+int			hotplug_queue_count = 0;
+char		hotplug_skip_path[MAX_PATH];			// device already opened by HotplugOpenPresent()
+
+HOTPLUG_CALLBACK_t	hotplug_watch_callback = NULL;
+char		hotplug_watch_match[32];
+HANDLE		hotplug_watch_ready = NULL;				// set once the watcher thread has registered
+bool		hotplug_watch_ok = false;
+
+
+/**************************************************************************************************
+* Check if a device path has the VID and PID we are waiting for
+*/
+bool HotplugPathMatches(const char *path, const char *match)
+{
+	char lower[MAX_PATH];
+	int i;
+
+	for (i = 0; (path[i] != '\0') && (i < MAX_PATH - 1); i++)
+		lower[i] = (char)tolower((unsigned char)path[i]);
+	lower[i] = '\0';
+	return (strstr(lower, match) != NULL);
+}
+
+/**************************************************************************************************
+* Receives device change notifications, matching arrivals are queued for HotplugWait()
+*/
+LRESULT CALLBACK HotplugWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
+{
+	if ((msg == WM_DEVICECHANGE) && (wparam == DBT_DEVICEARRIVAL))
+	{
+		DEV_BROADCAST_HDR *hdr = (DEV_BROADCAST_HDR *)lparam;
+		if ((hdr != NULL) && (hdr->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE))
+		{
+			DEV_BROADCAST_DEVICEINTERFACE_A *dev = (DEV_BROADCAST_DEVICEINTERFACE_A *)hdr;
+			if (HotplugPathMatches(dev->dbcc_name, hotplug_match) && (hotplug_queue_count < HOTPLUG_QUEUE_SIZE))
+			{
+				int i = (hotplug_queue_head + hotplug_queue_count) % HOTPLUG_QUEUE_SIZE;
+				strncpy(hotplug_queue[i], dev->dbcc_name, MAX_PATH - 1);
+				hotplug_queue[i][MAX_PATH - 1] = '\0';
+				hotplug_queue_count++;
+			}
+		}
+		return TRUE;
+	}
+	return DefWindowProcA(hwnd, msg, wparam, lparam);
+}
+
+/**************************************************************************************************
+* Receives device change notifications for HotplugWatch(), on the watcher thread
+*/
+LRESULT CALLBACK HotplugWatchProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
+{
+	if ((msg == WM_DEVICECHANGE) && ((wparam == DBT_DEVICEARRIVAL) || (wparam == DBT_DEVICEREMOVECOMPLETE)))
+	{
+		DEV_BROADCAST_HDR *hdr = (DEV_BROADCAST_HDR *)lparam;
+		if ((hdr != NULL) && (hdr->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE))
+		{
+			DEV_BROADCAST_DEVICEINTERFACE_A *dev = (DEV_BROADCAST_DEVICEINTERFACE_A *)hdr;
+			if (HotplugPathMatches(dev->dbcc_name, hotplug_watch_match))
+				hotplug_watch_callback(dev->dbcc_name, (wparam == DBT_DEVICEARRIVAL));
+		}
+		return TRUE;
+	}
+	return DefWindowProcA(hwnd, msg, wparam, lparam);
+}
+
+/**************************************************************************************************
+* Create a message only window registered for HID device interface notifications. Notifications
+* are delivered to the thread that calls this.
+*/
+HWND HotplugCreateWindow(const char *class_name, LRESULT (CALLBACK *proc)(HWND, UINT, WPARAM, LPARAM), HDEVNOTIFY *notify)
+{
+	WNDCLASSA wc;
+	DEV_BROADCAST_DEVICEINTERFACE_A filter;
+
+	memset(&wc, 0, sizeof(wc));
+	wc.lpfnWndProc = proc;
+	wc.hInstance = GetModuleHandleA(NULL);
+	wc.lpszClassName = class_name;
+	if (RegisterClassA(&wc) == 0)
+		return NULL;
+
+	HWND window = CreateWindowExA(0, wc.lpszClassName, "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+	if (window == NULL)
+		return NULL;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.dbcc_size = sizeof(filter);
+	filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+	filter.dbcc_classguid = hotplug_hid_guid;
+	*notify = RegisterDeviceNotificationA(window, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+	if (*notify == NULL)
+	{
+		DestroyWindow(window);
+		return NULL;
+	}
+	return window;
+}
+
+/**************************************************************************************************
+* Start listening for devices. Call before looking for devices that are already attached, so that
+* none can arrive unnoticed in between.
+*/
+bool HotplugStart(unsigned short vid, unsigned short pid)
+{
+	sprintf(hotplug_match, "vid_%04x&pid_%04x", vid, pid);
+	hotplug_skip_path[0] = '\0';
+
+	hotplug_window = HotplugCreateWindow("hid_bootloader_hotplug", HotplugWndProc, &hotplug_notify);
+	return (hotplug_window != NULL);
+}
+
+/**************************************************************************************************
+* Watcher thread, pumps the notification window's messages for the life of the process
+*/
+DWORD WINAPI HotplugWatchThread(LPVOID param)
+{
+	HDEVNOTIFY notify = NULL;
+	MSG msg;
+
+	HWND window = HotplugCreateWindow("hid_bootloader_watch", HotplugWatchProc, &notify);
+	hotplug_watch_ok = (window != NULL);
+	SetEvent(hotplug_watch_ready);
+	if (window == NULL)
+		return 0;
+
+	while (GetMessageA(&msg, NULL, 0, 0) > 0)
+	{
+		TranslateMessage(&msg);
+		DispatchMessageA(&msg);
+	}
+	return 0;
+}
+
+/**************************************************************************************************
+* Report matching devices being attached and removed to callback, from a thread of its own. Call
+* before looking for devices that are already attached, so that none can arrive unnoticed.
+*/
+bool HotplugWatch(unsigned short vid, unsigned short pid, HOTPLUG_CALLBACK_t callback)
+{
+	sprintf(hotplug_watch_match, "vid_%04x&pid_%04x", vid, pid);
+	hotplug_watch_callback = callback;
+
+	hotplug_watch_ready = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (hotplug_watch_ready == NULL)
+		return false;
+	HANDLE thread = CreateThread(NULL, 0, HotplugWatchThread, NULL, 0, NULL);
+	if (thread == NULL)
+	{
+		CloseHandle(hotplug_watch_ready);
+		return false;
+	}
+	WaitForSingleObject(hotplug_watch_ready, INFINITE);
+	CloseHandle(hotplug_watch_ready);
+	CloseHandle(thread);
+	return hotplug_watch_ok;
+}
+
+/**************************************************************************************************
+* Stop listening for devices
+*/
+void HotplugStop(void)
+{
+	if (hotplug_notify != NULL)
+		UnregisterDeviceNotification(hotplug_notify);
+	if (hotplug_window != NULL)
+		DestroyWindow(hotplug_window);
+	hotplug_notify = NULL;
+	hotplug_window = NULL;
+}
+
+/**************************************************************************************************
+* Open a device that was attached before we started waiting, NULL if there isn't one
+*/
+hid_device *HotplugOpenPresent(unsigned short vid, unsigned short pid)
+{
+	struct hid_device_info *devs, *cur;
+	hid_device *handle = NULL;
+
+	devs = hid_enumerate(vid, pid);
+	for (cur = devs; (cur != NULL) && (handle == NULL); cur = cur->next)
+	{
+		if (!SerialSelected(cur->serial_number))
+			continue;
+		handle = hid_open_path(cur->path);
+		if (handle != NULL)
+		{
+			strncpy(hotplug_skip_path, cur->path, MAX_PATH - 1);
+			hotplug_skip_path[MAX_PATH - 1] = '\0';
+		}
+	}
+	hid_free_enumeration(devs);
+	return handle;
+}
+
+/**************************************************************************************************
+* Open a newly attached device. The arrival can be reported slightly before the device is ready
+* to open, so it is retried briefly.
+*/
+hid_device *HotplugOpen(const char *path)
+{
+	wchar_t wstr[MAX_STR];
+
+	for (int i = 0; i < HOTPLUG_OPEN_RETRIES; i++)
+	{
+		hid_device *handle = hid_open_path(path);
+		if (handle != NULL)
+		{
+			if (hid_get_serial_number_string(handle, wstr, MAX_STR) != 0)
+				wstr[0] = L'\0';
+			if (SerialSelected(wstr))
+				return handle;
+			hid_close(handle);
+			return NULL;
+		}
+		Sleep(HOTPLUG_OPEN_RETRY_MS);
+	}
+	return NULL;
+}
+
+/**************************************************************************************************
+* Remove a device opened by HotplugOpenPresent() from the queue. It may have arrived between
+* HotplugStart() and being opened, in which case its notification is already pending.
+*/
+void HotplugSkipPresent(void)
+{
+	MSG msg;
+
+	while (PeekMessageA(&msg, NULL, 0, 0, PM_REMOVE))
+	{
+		TranslateMessage(&msg);
+		DispatchMessageA(&msg);
+	}
+
+	for (int i = 0; i < hotplug_queue_count; i++)
+	{
+		char *path = hotplug_queue[(hotplug_queue_head + i) % HOTPLUG_QUEUE_SIZE];
+		if (_stricmp(path, hotplug_skip_path) == 0)
+			path[0] = '\0';		// ignored by HotplugWait()
+	}
+	hotplug_skip_path[0] = '\0';
+}
+
+/**************************************************************************************************
+* Wait for a matching device to be attached and open it. Returns NULL if the message loop ends.
+*/
+hid_device *HotplugWait(void)
+{
+	MSG msg;
+
+	if (hotplug_skip_path[0] != '\0')
+		HotplugSkipPresent();
+
+	for (;;)
+	{
+		while (hotplug_queue_count > 0)
+		{
+			char *path = hotplug_queue[hotplug_queue_head];
+			hotplug_queue_head = (hotplug_queue_head + 1) % HOTPLUG_QUEUE_SIZE;
+			hotplug_queue_count--;
+			if (path[0] == '\0')
+				continue;
+
+			hid_device *handle = HotplugOpen(path);
+			if (handle != NULL)
+				return handle;
+		}
+
+		if (GetMessageA(&msg, NULL, 0, 0) <= 0)
+			return NULL;
+		TranslateMessage(&msg);
+		DispatchMessageA(&msg);
+	}
+}
@@ -0,0 +1,23 @@
+// hotplug.h
+
+#ifndef __HOTPLUG_H
+#define __HOTPLUG_H
+
+
+#define	HOTPLUG_QUEUE_SIZE			16		// arrivals waiting to be opened
+#define	HOTPLUG_OPEN_RETRIES		50
+#define	HOTPLUG_OPEN_RETRY_MS		10
+
+
+// called on the watcher thread when a matching device is attached or removed
+typedef void (*HOTPLUG_CALLBACK_t)(const char *path, bool arrived);
+
+
+extern bool HotplugStart(unsigned short vid, unsigned short pid);
+extern void HotplugStop(void);
+extern hid_device *HotplugOpenPresent(unsigned short vid, unsigned short pid);
+extern hid_device *HotplugWait(void);
+extern bool HotplugWatch(unsigned short vid, unsigned short pid, HOTPLUG_CALLBACK_t callback);
+
+
+#endif
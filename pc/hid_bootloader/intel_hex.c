@@ -14,6 +14,7 @@ uint8_t firmware_buffer[FIRMWARE_BUFFER_SIZE];
 uint32_t firmware_crc = 0;
 uint32_t firmware_size = 0;
 FW_INFO_t *fw_info = NULL;
+FW_INFO_V2_t *fw_info_v2 = NULL;		// only set while the v2 hints match the loaded image
 
 
 /**************************************************************************************************
@@ -45,6 +46,106 @@ uint32_t ReadBase16(char *c, int num_chars)
 	return val;
 }
 
+/**************************************************************************************************
+* Check if a page of the loaded firmware image is unpopulated (all 0xFF)
+*/
+bool IsPageBlank(uint32_t page)
+{
+	uint8_t *ptr = &firmware_buffer[page * fw_info->page_size_b];
+
+	// trusted v2 hints answer without touching the buffer for anything the post-link tool found blank
+	if (fw_info_v2 != NULL)
+	{
+		uint32_t addr = page * fw_info->page_size_b;
+		if (addr >= fw_info_v2->image_length)
+			return true;
+		uint32_t bit = addr / InfoV2ChunkSize(fw_info);
+		if (!(fw_info_v2->page_map[bit / 8] & (1 << (bit % 8))))
+			return true;
+	}
+
+	for (uint16_t i = 0; i < fw_info->page_size_b; i++)
+	{
+		if (*ptr++ != 0xFF)
+			return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Bytes of flash covered by each bit of the v2 page map. Never less than a page, so every page is
+* covered by exactly one bit.
+*/
+uint32_t InfoV2ChunkSize(FW_INFO_t *info)
+{
+	uint32_t chunk = info->flash_size_b / FW_INFO_PAGE_MAP_BITS;
+
+	if (chunk < info->page_size_b)
+		chunk = info->page_size_b;
+	return chunk;
+}
+
+/**************************************************************************************************
+* Find the v2 fields following the embedded FW_INFO_t. Returns NULL for v1 images.
+*/
+FW_INFO_V2_t *FindInfoV2(void)
+{
+	FW_INFO_V2_t *info = (FW_INFO_V2_t *)fw_info;
+
+	if (fw_info == NULL)
+		return NULL;
+	if (((uint8_t *)fw_info - firmware_buffer) + sizeof(FW_INFO_V2_t) > FIRMWARE_BUFFER_SIZE)
+		return NULL;
+	if ((memcmp(info->v2_magic, V2_MAGIC_STRING, 4) != 0) || (info->info_size < sizeof(FW_INFO_V2_t)))
+		return NULL;
+	return info;
+}
+
+/**************************************************************************************************
+* NVM CRC of the first length bytes of the image, as the post-link tool calculates it with the
+* image_crc field still erased
+*/
+uint32_t InfoV2ImageCRC(FW_INFO_V2_t *info, uint32_t length)
+{
+	uint32_t saved = info->image_crc;
+	uint32_t crc;
+
+	info->image_crc = 0xFFFFFFFF;
+	crc = xmega_nvm_crc32(firmware_buffer, length);
+	info->image_crc = saved;
+	return crc;
+}
+
+/**************************************************************************************************
+* Check that patched v2 fields still describe the loaded image. Anything changed after the post-
+* link tool ran, or data outside the recorded length, means the hints can't be used.
+*/
+bool CheckInfoV2(FW_INFO_V2_t *info)
+{
+	if ((info->image_length == 0) ||
+		(info->image_length > fw_info->flash_size_b) ||
+		(info->image_length % fw_info->page_size_b) ||
+		(firmware_size >= info->image_length))
+		return false;
+	return InfoV2ImageCRC(info, info->image_length) == info->image_crc;
+}
+
+/**************************************************************************************************
+* NVM CRC of the whole flash for an image with checked v2 info. The image CRC was taken with the
+* image_crc field erased and everything past image_length is erased, so both are accounted for
+* without reading the buffer again.
+*/
+uint32_t InfoV2FlashCRC(FW_INFO_V2_t *info)
+{
+	uint8_t change[sizeof(info->image_crc)];
+	uint32_t offset = (uint32_t)((uint8_t *)&info->image_crc - firmware_buffer);
+
+	for (uint32_t i = 0; i < sizeof(change); i++)
+		change[i] = ((uint8_t *)&info->image_crc)[i] ^ 0xFF;
+	uint32_t crc = info->image_crc ^ xmega_nvm_crc32_delta(info->image_length, offset, change, sizeof(change));
+	return xmega_nvm_crc32_erased(crc, fw_info->flash_size_b - info->image_length);
+}
+
 // load an Intel hex file into buffer
 bool ReadHexFile(char *filename)
 {
@@ -62,6 +163,8 @@ bool ReadHexFile(char *filename)
 	quiet_printf("Loading %s...\n", filename);
 
 	memset(firmware_buffer, 0xFF, sizeof(firmware_buffer));
+	firmware_size = 0;
+	fw_info_v2 = NULL;
 	uint32_t	base_addr = 0;
 
 	int line_num = 0;
@@ -147,17 +250,150 @@ bool ReadHexFile(char *filename)
 		goto exit;
 	}
 
-	firmware_crc = xmega_nvm_crc32(firmware_buffer, fw_info->flash_size_b);
-	quiet_printf("Firmware CRC:\t0x%lX\n", firmware_crc);
+	// v2 hints, unpatched images still have the fields erased. Once they are checked the CRC of the
+	// whole flash follows from the image CRC, without another pass over the buffer.
+	FW_INFO_V2_t *info = FindInfoV2();
+	bool v2_patched = (info != NULL) && (info->image_length != 0xFFFFFFFF);
+	if (v2_patched && CheckInfoV2(info))
+	{
+		fw_info_v2 = info;
+		firmware_crc = InfoV2FlashCRC(info);
+	}
+	else
+		firmware_crc = xmega_nvm_crc32(firmware_buffer, fw_info->flash_size_b);
+	quiet_printf("Firmware CRC:\t0x%X\n", firmware_crc);
 
 	quiet_printf("MCU ID:\t\t%02X%02X%02X\n", fw_info->mcu_signature[0], fw_info->mcu_signature[1], fw_info->mcu_signature[2]);
 	//printf("Flash size:\t%u bytes (0x%X)\n", fw_info->flash_size_b, fw_info->flash_size_b);
 	quiet_printf("Flash size:\t%u KB (0x%X)\n", fw_info->flash_size_b / 1024, fw_info->flash_size_b);
 	quiet_printf("Page sise:\t%u\n", fw_info->page_size_b);
 	quiet_printf("Version:\t%u.%02u\n", fw_info->version_major, fw_info->version_minor);
+
+	if (fw_info_v2 != NULL)
+	{
+		quiet_printf("Build ID:\t%08X\n", fw_info_v2->build_id);
+		quiet_printf("Image length:\t%u bytes\n", fw_info_v2->image_length);
+	}
+	else if (v2_patched)
+		quiet_printf("Embedded v2 info does not match the image, ignoring it.\n");
 	quiet_printf("\n");
 
 exit:
 	fclose(fp);
 	return res;
-}
\ No newline at end of file
+}
+
+/**************************************************************************************************
+* Write the first length bytes of the firmware buffer as an Intel hex file. Blank records are left
+* out, the loader fills gaps with 0xFF anyway.
+*/
+bool WriteHexFile(char *filename, uint32_t length)
+{
+	FILE *fp;
+	uint32_t segment = 0;
+
+	fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	for (uint32_t addr = 0; addr < length; addr += HEX_RECORD_BYTES)
+	{
+		uint8_t len = ((length - addr) < HEX_RECORD_BYTES) ? (uint8_t)(length - addr) : HEX_RECORD_BYTES;
+		uint8_t *data = &firmware_buffer[addr];
+		uint8_t checksum;
+		uint8_t i;
+
+		for (i = 0; i < len; i++)
+		{
+			if (data[i] != 0xFF)
+				break;
+		}
+		if (i == len)
+			continue;
+
+		// extended segment address record for each 64k
+		if ((addr >> 16) != segment)
+		{
+			segment = addr >> 16;
+			uint16_t base = (uint16_t)(segment << 12);
+			checksum = 0x02 + 0x02 + (base >> 8) + (base & 0xFF);
+			fprintf(fp, ":02000002%04X%02X\n", base, (uint8_t)(0 - checksum));
+		}
+
+		checksum = len + ((addr >> 8) & 0xFF) + (addr & 0xFF);
+		fprintf(fp, ":%02X%04X00", len, addr & 0xFFFF);
+		for (i = 0; i < len; i++)
+		{
+			fprintf(fp, "%02X", data[i]);
+			checksum += data[i];
+		}
+		fprintf(fp, "%02X\n", (uint8_t)(0 - checksum));
+	}
+
+	fprintf(fp, ":00000001FF\n");
+	if (fclose(fp) != 0)
+	{
+		silent_printf("Error writing %s.\n", filename);
+		return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Post-link tool: fill in the v2 fields of the embedded info with the used length, page map,
+* build id and image CRC, and write the result as a new hex file
+*/
+bool PatchFirmwareInfo(char *infile, char *outfile)
+{
+	if (!ReadHexFile(infile))
+		return false;
+
+	FW_INFO_V2_t *info = FindInfoV2();
+	if (info == NULL)
+	{
+		silent_printf("%s has no v2 info to patch.\n", infile);
+		return false;
+	}
+	if (firmware_size >= fw_info->flash_size_b)
+	{
+		silent_printf("Image extends past the application section.\n");
+		return false;
+	}
+
+	// work from the buffer itself, not from hints a previous patch left behind
+	fw_info_v2 = NULL;
+
+	uint16_t page_size = fw_info->page_size_b;
+	uint32_t num_pages = fw_info->flash_size_b / page_size;
+	uint32_t chunk = InfoV2ChunkSize(fw_info);
+	uint32_t length = 0;
+
+	memset(info->page_map, 0, sizeof(info->page_map));
+	info->image_length = 0xFFFFFFFF;
+	info->image_crc = 0xFFFFFFFF;
+	for (uint32_t page = 0; page < num_pages; page++)
+	{
+		if (!IsPageBlank(page))
+		{
+			uint32_t bit = (page * page_size) / chunk;
+			info->page_map[bit / 8] |= 1 << (bit % 8);
+			length = (page + 1) * page_size;
+		}
+	}
+
+	// a build id set by the build is kept, otherwise derive one from the contents
+	if (info->build_id == 0xFFFFFFFF)
+		info->build_id = crc32(firmware_buffer, length);
+	info->image_length = length;
+	info->image_crc = InfoV2ImageCRC(info, length);
+
+	quiet_printf("Build ID:\t%08X\n", info->build_id);
+	quiet_printf("Image length:\t%u bytes\n", info->image_length);
+	quiet_printf("Image CRC:\t0x%X\n", info->image_crc);
+	quiet_printf("Writing %s...\n", outfile);
+
+	return WriteHexFile(outfile, firmware_size + 1);
+}
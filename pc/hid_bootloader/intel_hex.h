@@ -7,6 +7,11 @@
 #define	FIRMWARE_BUFFER_SIZE		((512+8)*512)	// 256k devices have 512 pages of 512 bytes each, plus 8 page bootloader
 
 
+#define	HEX_RECORD_BYTES			16			// data bytes per record written by WriteHexFile()
+#define	FW_INFO_PAGE_MAP_BYTES		32
+#define	FW_INFO_PAGE_MAP_BITS		(FW_INFO_PAGE_MAP_BYTES * 8)
+
+
 // data embedded in firmware image
 #pragma pack(1)
 typedef struct {
@@ -19,18 +24,42 @@ typedef struct {
 	uint32_t	eeprom_size_b;
 	uint16_t	eeprom_page_size_b;
 } FW_INFO_t;
+
+// v2 fields follow the v1 struct, so v1 readers still find everything they know about. The post-
+// link tool (-p) fills them in, the firmware only reserves them as 0xFF.
+typedef struct {
+	FW_INFO_t	v1;
+	char		v2_magic[4];			// FwI2
+	uint16_t	info_size;				// sizeof the whole struct, later versions append
+	uint32_t	image_length;			// start of flash to the end of the last populated page
+	uint32_t	image_crc;				// XMEGA NVM CRC of image_length bytes, with this field as 0xFFFFFFFF
+	uint32_t	build_id;
+	uint8_t		page_map[FW_INFO_PAGE_MAP_BYTES];	// bit set for each populated chunk of flash_size_b / FW_INFO_PAGE_MAP_BITS bytes
+} FW_INFO_V2_t;
 #pragma pack()
 
 #define	MAGIC_STRING				"YamaNeko"
+#define	V2_MAGIC_STRING				"FwI2"
 
 
 extern uint8_t firmware_buffer[FIRMWARE_BUFFER_SIZE];
 extern uint32_t firmware_crc;
 extern uint32_t firmware_size;
 extern FW_INFO_t *fw_info;
+extern FW_INFO_V2_t *fw_info_v2;
 
 
+extern uint32_t FindEmbeddedInfo(void);
+extern uint32_t ReadBase16(char *c, int num_chars);
 extern bool ReadHexFile(char *filename);
+extern bool IsPageBlank(uint32_t page);
+extern uint32_t InfoV2ChunkSize(FW_INFO_t *info);
+extern FW_INFO_V2_t *FindInfoV2(void);
+extern uint32_t InfoV2ImageCRC(FW_INFO_V2_t *info, uint32_t length);
+extern bool CheckInfoV2(FW_INFO_V2_t *info);
+extern uint32_t InfoV2FlashCRC(FW_INFO_V2_t *info);
+extern bool WriteHexFile(char *filename, uint32_t length);
+extern bool PatchFirmwareInfo(char *infile, char *outfile);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,365 @@
+// micro.c
+//
+// Microbenchmarks of the host's compute paths: parsing .hex files, finding the embedded info and
+// the two CRCs. Image validation jobs run these over whole release archives, so their cost is
+// tracked here separately from the bus time measured by the throughput benchmark (bench.c).
+//
+// Each kernel is run on the images given and on a generated 256KB image. The thread is pinned to
+// one CPU at high priority, and after a warm up run each kernel is sampled MICRO_REPEATS times,
+// each sample repeating it for at least MICRO_SAMPLE_US. Throughput and time per record are
+// reported for the median sample, with the fastest and slowest to show the spread.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "crc.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "simdev.h"
+#include "bench.h"
+#include "micro.h"
+
+
+LARGE_INTEGER	micro_frequency;
+char			*micro_file = NULL;			// image being measured
+char			*micro_text = NULL;			// its .hex text, for ReadBase16()
+uint32_t		micro_text_size = 0;
+uint32_t		*micro_records = NULL;		// offset of each data record in the text
+int				micro_record_count = 0;
+volatile uint32_t	micro_sink = 0;			// results go here so that the work isn't optimized away
+
+const char *micro_kernel_names[MICRO_KERNELS] = {
+	"ReadHexFile", "ReadBase16", "FindEmbeddedInfo", "xmega_nvm_crc32", "crc32",
+};
+
+
+/**************************************************************************************************
+* Write the firmware buffer as a .hex file of MICRO_RECORD_BYTES byte records
+*/
+bool MicroWriteHex(const char *filename, uint32_t size)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	for (uint32_t addr = 0; addr < size; addr += MICRO_RECORD_BYTES)
+	{
+		// extended segment address record at each 64K boundary
+		if ((addr & 0xFFFF) == 0)
+		{
+			uint16_t segment = (uint16_t)(addr >> 4);
+			uint8_t checksum = (uint8_t)(0x100 - ((2 + 2 + (segment >> 8) + (segment & 0xFF)) & 0xFF));
+			fprintf(fp, ":02000002%04X%02X\n", segment, checksum);
+		}
+
+		uint8_t length = (uint8_t)min(MICRO_RECORD_BYTES, size - addr);
+		uint8_t sum = length + ((addr >> 8) & 0xFF) + (addr & 0xFF);
+		fprintf(fp, ":%02X%04X00", length, addr & 0xFFFF);
+		for (uint8_t i = 0; i < length; i++)
+		{
+			fprintf(fp, "%02X", firmware_buffer[addr + i]);
+			sum += firmware_buffer[addr + i];
+		}
+		fprintf(fp, "%02X\n", (uint8_t)(0x100 - sum));
+	}
+	fprintf(fp, ":00000001FF\n");
+
+	bool ok = (fclose(fp) == 0);
+	if (!ok)
+		silent_printf("Failed to write %s.\n", filename);
+	return ok;
+}
+
+/**************************************************************************************************
+* Load the .hex text of an image into memory and index its records
+*/
+bool MicroLoadText(const char *filename)
+{
+	free(micro_text);
+	free(micro_records);
+	micro_text = NULL;
+	micro_records = NULL;
+	micro_record_count = 0;
+
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to open %s.\n", filename);
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	micro_text_size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	micro_text = malloc(micro_text_size + 1);
+	micro_records = malloc(((micro_text_size / 11) + 1) * sizeof(uint32_t));	// a record is at least 11 characters
+	if ((micro_text == NULL) || (micro_records == NULL) || (fread(micro_text, 1, micro_text_size, fp) != micro_text_size))
+	{
+		silent_printf("Unable to read %s.\n", filename);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	micro_text[micro_text_size] = '\0';
+
+	for (uint32_t i = 0; i < micro_text_size; i++)
+	{
+		if ((micro_text[i] != ':') || ((i != 0) && (micro_text[i - 1] != '\n')))
+			continue;
+		if (i + 11 > micro_text_size)
+			break;
+		uint8_t length = (uint8_t)ReadBase16(&micro_text[i + 1], 2);
+		if (i + 11 + (length * 2) > micro_text_size)
+			break;
+		micro_records[micro_record_count++] = i;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Decode every field of every record with ReadBase16(), as ReadHexFile() does
+*/
+void MicroParseRecords(void)
+{
+	uint32_t sum = 0;
+
+	for (int r = 0; r < micro_record_count; r++)
+	{
+		char *c = &micro_text[micro_records[r] + 1];
+		uint8_t length = (uint8_t)ReadBase16(c, 2);
+		sum += ReadBase16(c + 2, 4);			// address
+		sum += ReadBase16(c + 6, 2);			// type
+		c += 8;
+		for (uint8_t i = 0; i < length; i++, c += 2)
+			sum += ReadBase16(c, 2);
+		sum += ReadBase16(c, 2);				// checksum
+	}
+	micro_sink += sum;
+}
+
+/**************************************************************************************************
+* Run a kernel once on the current image
+*/
+bool MicroRunOnce(MICRO_KERNEL_t kernel)
+{
+	switch (kernel)
+	{
+	case MICRO_READ_HEX:
+		return ReadHexFile(micro_file);
+
+	case MICRO_READ_BASE16:
+		MicroParseRecords();
+		return true;
+
+	case MICRO_FIND_INFO:
+		micro_sink += FindEmbeddedInfo();
+		return true;
+
+	case MICRO_NVM_CRC:
+		micro_sink += xmega_nvm_crc32(firmware_buffer, fw_info->flash_size_b);
+		return true;
+
+	case MICRO_CRC32:
+		micro_sink += crc32(firmware_buffer, fw_info->flash_size_b);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/**************************************************************************************************
+* Sort samples
+*/
+int MicroCompare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/**************************************************************************************************
+* Sample a kernel on the current image
+*/
+bool MicroMeasure(MICRO_KERNEL_t kernel, MICRO_RESULT_t *res)
+{
+	double samples[MICRO_REPEATS];
+	uint64_t sample_ticks = (MICRO_SAMPLE_US * micro_frequency.QuadPart) / 1000000;
+
+	if (!MicroRunOnce(kernel))		// warm up
+		return false;
+
+	for (int r = 0; r < MICRO_REPEATS; r++)
+	{
+		uint32_t runs = 0;
+		uint64_t start = TimingClock();
+		uint64_t elapsed;
+		do
+		{
+			MicroRunOnce(kernel);
+			runs++;
+			elapsed = TimingClock() - start;
+		} while (elapsed < sample_ticks);
+		samples[r] = ((double)elapsed * 1e9) / ((double)micro_frequency.QuadPart * runs);
+	}
+
+	qsort(samples, MICRO_REPEATS, sizeof(double), MicroCompare);
+	res->kernel = kernel;
+	res->min_ns = samples[0];
+	res->median_ns = samples[MICRO_REPEATS / 2];
+	res->max_ns = samples[MICRO_REPEATS - 1];
+	return true;
+}
+
+/**************************************************************************************************
+* Run every kernel on one image, adding to results
+*/
+bool MicroImage(char *filename, const char *name, MICRO_RESULT_t *results, int *count)
+{
+	micro_file = filename;
+	if ((!MicroLoadText(filename)) || (!ReadHexFile(filename)))
+	{
+		silent_printf("Skipping %s.\n", name);
+		return false;
+	}
+
+	uint32_t info = FindEmbeddedInfo();
+	for (int k = 0; k < MICRO_KERNELS; k++)
+	{
+		MICRO_RESULT_t *res = &results[*count];
+		res->image = name;
+		switch (k)
+		{
+		case MICRO_READ_HEX:
+		case MICRO_READ_BASE16:
+			res->bytes = micro_text_size;
+			res->ops = micro_record_count;
+			break;
+
+		case MICRO_FIND_INFO:
+			res->bytes = info + sizeof(FW_INFO_t);
+			res->ops = 1;
+			break;
+
+		default:
+			res->bytes = fw_info->flash_size_b;
+			res->ops = 1;
+			break;
+		}
+
+		if (!MicroMeasure((MICRO_KERNEL_t)k, res))
+			return false;
+		(*count)++;
+
+		silent_printf("%-18s%-24s%8.1f MB/s\t%10.0f ns/%s\t(%.0f-%.0f us)\n", micro_kernel_names[k], name,
+					  (res->bytes * 1e3) / res->median_ns, res->median_ns / res->ops,
+					  (res->ops > 1) ? "record" : "call", res->min_ns / 1e3, res->max_ns / 1e3);
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Write the results table
+*/
+bool MicroWriteResults(const char *filename, MICRO_RESULT_t *results, int count)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	fprintf(fp, "kernel,image,bytes,ops,min_us,median_us,max_us,mb_per_s,ns_per_op\n");
+	for (int i = 0; i < count; i++)
+	{
+		MICRO_RESULT_t *res = &results[i];
+		fprintf(fp, "%s,%s,%lu,%lu,%.3f,%.3f,%.3f,%.2f,%.1f\n", micro_kernel_names[res->kernel], res->image,
+				res->bytes, res->ops, res->min_ns / 1e3, res->median_ns / 1e3, res->max_ns / 1e3,
+				(res->bytes * 1e3) / res->median_ns, res->median_ns / res->ops);
+	}
+
+	bool ok = (fclose(fp) == 0);
+	if (!ok)
+		silent_printf("Failed to write %s.\n", filename);
+	else
+		quiet_printf("Results written to %s.\n", filename);
+	return ok;
+}
+
+/**************************************************************************************************
+* Run the microbenchmarks on the given .hex images and a generated one, and write the results
+*/
+bool RunMicrobenchmarks(const char *results_file, char **images, int image_count)
+{
+	char temp_dir[MAX_PATH];
+	char generated[MAX_PATH];
+	int count = 0;
+	bool ok = true;
+
+	MICRO_RESULT_t *results = calloc((image_count + 1) * MICRO_KERNELS, sizeof(MICRO_RESULT_t));
+	if (results == NULL)
+		return false;
+
+	// the largest part, completely full
+	const BENCH_PART_t *part = &bench_parts[1];
+	if ((GetTempPathA(sizeof(temp_dir), temp_dir) == 0) || (GetTempFileNameA(temp_dir, "hbl", 0, generated) == 0))
+	{
+		silent_printf("Unable to create a temporary file.\n");
+		free(results);
+		return false;
+	}
+	BenchBuildImage(part, part->flash_size, 1);
+	if (!MicroWriteHex(generated, part->flash_size))
+	{
+		DeleteFileA(generated);
+		free(results);
+		return false;
+	}
+
+	QueryPerformanceFrequency(&micro_frequency);
+	HANDLE thread = GetCurrentThread();
+	DWORD_PTR affinity = SetThreadAffinityMask(thread, 1);
+	int priority = GetThreadPriority(thread);
+	SetThreadPriority(thread, THREAD_PRIORITY_HIGHEST);
+	silent_printf("Pinned to CPU 0, %d samples of at least %d ms each\n", MICRO_REPEATS, MICRO_SAMPLE_US / 1000);
+
+	bool quiet = opt_quiet;
+	opt_quiet = true;		// ReadHexFile() describes every image it loads
+	for (int i = 0; i < image_count; i++)
+	{
+		const char *name = strrchr(images[i], '\\');
+		name = (name != NULL) ? name + 1 : images[i];
+		if (!MicroImage(images[i], name, results, &count))
+			ok = false;
+	}
+	if (!MicroImage(generated, "generated 256KB", results, &count))
+		ok = false;
+	opt_quiet = quiet;
+
+	if (affinity != 0)
+		SetThreadAffinityMask(thread, affinity);
+	SetThreadPriority(thread, priority);
+	DeleteFileA(generated);
+
+	if ((results_file != NULL) && (!MicroWriteResults(results_file, results, count)))
+		ok = false;
+
+	free(micro_text);
+	free(micro_records);
+	micro_text = NULL;
+	micro_records = NULL;
+	free(results);
+	return ok;
+}
@@ -0,0 +1,37 @@
+// micro.h
+
+#ifndef __MICRO_H
+#define __MICRO_H
+
+
+#define	MICRO_REPEATS				15			// samples of each kernel, after one warm up
+#define	MICRO_SAMPLE_US				20000		// a sample runs the kernel for at least this long
+#define	MICRO_RECORD_BYTES			16			// data bytes per record in the generated image
+#define	MICRO_MAX_RECORDS			(FIRMWARE_BUFFER_SIZE / MICRO_RECORD_BYTES)
+
+
+typedef enum {
+	MICRO_READ_HEX = 0,
+	MICRO_READ_BASE16,
+	MICRO_FIND_INFO,
+	MICRO_NVM_CRC,
+	MICRO_CRC32,
+	MICRO_KERNELS,
+} MICRO_KERNEL_t;
+
+// one kernel on one image
+typedef struct {
+	MICRO_KERNEL_t	kernel;
+	const char		*image;
+	uint32_t		bytes;						// processed per run
+	uint32_t		ops;						// records or calls per run
+	double			min_ns;						// per run
+	double			median_ns;
+	double			max_ns;
+} MICRO_RESULT_t;
+
+
+extern bool RunMicrobenchmarks(const char *results_file, char **images, int image_count);
+
+
+#endif
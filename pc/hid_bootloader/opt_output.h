@@ -1,7 +1,14 @@
 // opt_output.h
 
+#ifdef _MSC_VER
+#define	OPT_THREAD			__declspec(thread)
+#else
+#define	OPT_THREAD			__thread
+#endif
+
 extern bool opt_quiet;
 extern bool opt_silent;
+extern OPT_THREAD bool opt_thread_silent;	// no output from this thread, whatever the options
 
-#define quiet_printf(...)	do { if (!opt_quiet) printf(__VA_ARGS__); } while(0)
-#define silent_printf(...)	do { if (!opt_silent) printf(__VA_ARGS__); } while(0)
+#define quiet_printf(...)	do { if ((!opt_quiet) && (!opt_thread_silent)) printf(__VA_ARGS__); } while(0)
+#define silent_printf(...)	do { if ((!opt_silent) && (!opt_thread_silent)) printf(__VA_ARGS__); } while(0)
@@ -0,0 +1,580 @@
+// plan.c
+//
+// Decides how each page of the firmware image is sent to the bootloader. For a full update, blank
+// pages are skipped because the application section is erased first, constant pages are filled on
+// the device and other pages are sent raw or compressed. For a delta update, only changed pages are
+// sent, as patches against the flash contents already on the device.
+//
+// Plans can be compiled to a file ahead of time, so that a programming station doesn't need to parse
+// and encode the image each time it runs.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "compress.h"
+#include "crc.h"
+#include "plan.h"
+#include "opt_output.h"
+
+
+PLAN_ENTRY_t *plan = NULL;
+int plan_entries = 0;
+PLAN_PAGE_t *plan_pages = NULL;
+int plan_page_count = 0;
+uint8_t *plan_payload = NULL;
+int plan_reports = 0;
+bool plan_erase = true;
+uint32_t plan_base_crc = 0;
+
+PLAN_ENTRY_t plan_entry_buffer[PLAN_MAX_ENTRIES];
+PLAN_PAGE_t plan_page_buffer[PLAN_MAX_ENTRIES];
+uint8_t plan_payload_buffer[FIRMWARE_BUFFER_SIZE];
+uint8_t delta_base_buffer[FIRMWARE_BUFFER_SIZE];
+
+HANDLE plan_file_handle = INVALID_HANDLE_VALUE;
+HANDLE plan_mapping_handle = NULL;
+
+
+/**************************************************************************************************
+* Check if a page consists of a repeated 16 bit word, returns the word in *pattern
+*/
+bool IsPageConstant(uint8_t *data, uint16_t page_size, uint16_t *pattern)
+{
+	for (uint16_t i = 2; i < page_size; i += 2)
+	{
+		if ((data[i] != data[0]) || (data[i + 1] != data[1]))
+			return false;
+	}
+	*pattern = data[0] | (data[1] << 8);
+	return true;
+}
+
+/**************************************************************************************************
+* Reset the plan to the in-memory buffers and list the populated pages of the loaded image
+*/
+void StartPlan(void)
+{
+	uint16_t page_size = fw_info->page_size_b;
+	int num_pages = fw_info->flash_size_b / page_size;
+
+	plan = plan_entry_buffer;
+	plan_entries = 0;
+	plan_pages = plan_page_buffer;
+	plan_page_count = 0;
+	plan_payload = plan_payload_buffer;
+	plan_reports = 0;
+	plan_base_crc = 0;
+
+	for (int page = 0; page < num_pages; page++)
+	{
+		if (!IsPageBlank(page))
+		{
+			plan_pages[plan_page_count].page = page;
+			plan_pages[plan_page_count].reserved = 0;
+			plan_pages[plan_page_count].crc = crc32(&firmware_buffer[page * page_size], page_size);
+			plan_page_count++;
+		}
+	}
+}
+
+/**************************************************************************************************
+* Build the write plan for the loaded firmware image
+*/
+bool PlanPages(bool compress)
+{
+	uint16_t page_size = fw_info->page_size_b;
+	uint16_t device_buffer_size = page_size + HID_DATA_BYTES;
+	int num_pages = fw_info->flash_size_b / page_size;
+	uint32_t payload_ptr = 0;
+	int filled = 0;
+	int compressed = 0;
+	int blank = 0;
+
+	StartPlan();
+	plan_erase = true;
+
+	for (int page = 0; page < num_pages; page++)
+	{
+		uint8_t *data = &firmware_buffer[page * page_size];
+		PLAN_ENTRY_t *entry = &plan[plan_entries];
+		uint16_t pattern;
+
+		if (IsPageBlank(page))
+		{
+			blank++;
+			continue;
+		}
+
+		if (IsPageConstant(data, page_size, &pattern))
+		{
+			filled++;
+			// extend previous run if possible
+			if ((plan_entries > 0) &&
+				(entry[-1].encoding == PLAN_ENCODING_FILL) &&
+				(entry[-1].pattern == pattern) &&
+				(entry[-1].page + entry[-1].count == page) &&
+				(entry[-1].count < FILL_MAX_PAGES))
+			{
+				entry[-1].count++;
+				continue;
+			}
+			entry->page = page;
+			entry->count = 1;
+			entry->encoding = PLAN_ENCODING_FILL;
+			entry->reserved = 0;
+			entry->pattern = pattern;
+			entry->length = 0;
+			entry->payload_offset = 0;
+			plan_entries++;
+			continue;
+		}
+
+		entry->page = page;
+		entry->count = 1;
+		entry->encoding = PLAN_ENCODING_RAW;
+		entry->reserved = 0;
+		entry->pattern = 0;
+		entry->length = page_size;
+		entry->payload_offset = payload_ptr;
+
+		uint8_t *output = &plan_payload_buffer[payload_ptr];
+		uint16_t length = 0;
+		if (compress && (payload_ptr + device_buffer_size <= sizeof(plan_payload_buffer)))
+			length = CompressPage(data, page_size, output, device_buffer_size);
+		if ((length != 0) && ((length + HID_DATA_BYTES - 1) / HID_DATA_BYTES < page_size / HID_DATA_BYTES))
+		{
+			entry->encoding = PLAN_ENCODING_COMPRESSED;
+			entry->length = length;
+			compressed++;
+		}
+		else
+			memcpy(output, data, page_size);
+		payload_ptr += entry->length;
+
+		plan_reports += (entry->length + HID_DATA_BYTES - 1) / HID_DATA_BYTES;
+		plan_entries++;
+	}
+
+	quiet_printf("Pages:\t\t%d (%d raw, %d compressed, %d filled, %d blank)\n", num_pages,
+				 num_pages - blank - filled - compressed, compressed, filled, blank);
+	return true;
+}
+
+/**************************************************************************************************
+* Build a delta update plan against the base image currently on the device. Each changed page is
+* rebuilt by the bootloader from a patch, so pages have to be written after all the pages that
+* copy from their old contents. Where that isn't possible (circular dependencies) the later pages
+* are encoded without the overwritten source.
+*/
+bool PlanDelta(uint8_t *base, uint32_t base_crc)
+{
+	uint16_t page_size = fw_info->page_size_b;
+	uint16_t device_buffer_size = page_size + HID_DATA_BYTES;
+	int num_pages = fw_info->flash_size_b / page_size;
+	uint32_t payload_ptr = 0;
+	int changed_count = 0;
+	int patched = 0;
+	uint8_t output[1024];
+
+	StartPlan();
+	plan_erase = false;
+	plan_base_crc = base_crc;
+
+	bool *changed = calloc(num_pages, sizeof(bool));
+	bool *valid = malloc(num_pages * sizeof(bool));
+	bool *written = calloc(num_pages, sizeof(bool));
+	bool *reads = calloc(num_pages * num_pages, sizeof(bool));		// reads[p * num_pages + q]: p copies from q
+	int *pending_readers = calloc(num_pages, sizeof(int));
+	if ((changed == NULL) || (valid == NULL) || (written == NULL) || (reads == NULL) || (pending_readers == NULL))
+	{
+		silent_printf("Out of memory.\n");
+		free(changed); free(valid); free(written); free(reads); free(pending_readers);
+		return false;
+	}
+
+	PatchIndexBuild(base, fw_info->flash_size_b, page_size);
+	for (int page = 0; page < num_pages; page++)
+	{
+		valid[page] = true;
+		if (memcmp(&firmware_buffer[page * page_size], &base[page * page_size], page_size) != 0)
+		{
+			changed[page] = true;
+			changed_count++;
+		}
+	}
+
+	// find dependencies with all sources available
+	for (int p = 0; p < num_pages; p++)
+	{
+		if (changed[p])
+			EncodePatch(&firmware_buffer[p * page_size], valid, output, device_buffer_size, &reads[p * num_pages]);
+	}
+	for (int p = 0; p < num_pages; p++)
+	{
+		for (int q = 0; q < num_pages; q++)
+		{
+			if (changed[p] && changed[q] && (p != q) && reads[p * num_pages + q])
+				pending_readers[q]++;
+		}
+	}
+
+	// schedule pages nobody still needs to read first
+	for (int remaining = changed_count; remaining > 0; remaining--)
+	{
+		int page = -1;
+		for (int q = 0; q < num_pages; q++)
+		{
+			if (changed[q] && !written[q])
+			{
+				if (page == -1)
+					page = q;		// fallback if all remaining pages are in a cycle
+				if (pending_readers[q] == 0)
+				{
+					page = q;
+					break;
+				}
+			}
+		}
+
+		PLAN_ENTRY_t *entry = &plan[plan_entries++];
+		uint8_t *data = &firmware_buffer[page * page_size];
+		entry->page = page;
+		entry->count = 1;
+		entry->encoding = PLAN_ENCODING_REPLACE;
+		entry->reserved = 0;
+		entry->pattern = 0;
+		entry->length = page_size;
+		entry->payload_offset = payload_ptr;
+
+		uint8_t *patch = &plan_payload_buffer[payload_ptr];
+		uint16_t length = 0;
+		if (payload_ptr + device_buffer_size <= sizeof(plan_payload_buffer))
+			length = EncodePatch(data, valid, patch, device_buffer_size, NULL);
+		if ((length != 0) && ((length + HID_DATA_BYTES - 1) / HID_DATA_BYTES < page_size / HID_DATA_BYTES))
+		{
+			entry->encoding = PLAN_ENCODING_PATCH;
+			entry->length = length;
+			patched++;
+		}
+		else
+			memcpy(patch, data, page_size);
+		payload_ptr += entry->length;
+		plan_reports += (entry->length + HID_DATA_BYTES - 1) / HID_DATA_BYTES;
+
+		// old contents of this page are gone once it is written
+		written[page] = true;
+		valid[page] = false;
+		for (int q = 0; q < num_pages; q++)
+		{
+			if (reads[page * num_pages + q] && (q != page) && changed[q] && !written[q])
+				pending_readers[q]--;
+		}
+	}
+
+	free(changed);
+	free(valid);
+	free(written);
+	free(reads);
+	free(pending_readers);
+
+	quiet_printf("Pages:\t\t%d (%d changed, %d patched, %d replaced)\n", num_pages, changed_count, patched, changed_count - patched);
+	return true;
+}
+
+/**************************************************************************************************
+* Build the bootloader command that writes a plan entry to flash, once its payload has been sent
+*/
+void PlanEntryCommand(PLAN_ENTRY_t *entry, BLCOMMAND_t *cmd)
+{
+	cmd->report_id = 0;
+	switch (entry->encoding)
+	{
+	case PLAN_ENCODING_FILL:
+		cmd->command = CMD_FILL_PAGES;
+		cmd->params.u16[0] = entry->pattern;
+		cmd->params.u16[1] = entry->page | ((entry->count - 1) << FILL_COUNT_SHIFT);
+		return;
+
+	case PLAN_ENCODING_COMPRESSED:
+		cmd->command = CMD_WRITE_COMPRESSED_PAGE;
+		cmd->params.u16[1] = entry->length;
+		break;
+
+	case PLAN_ENCODING_PATCH:
+		cmd->command = CMD_PATCH_PAGE;
+		cmd->params.u16[1] = entry->length;
+		break;
+
+	case PLAN_ENCODING_REPLACE:
+		cmd->command = CMD_PATCH_PAGE;
+		cmd->params.u16[1] = 0;		// buffer holds the whole page
+		break;
+
+	default:
+		cmd->command = CMD_WRITE_PAGE;
+		cmd->params.u16[1] = 0;
+		break;
+	}
+	cmd->params.u16[0] = entry->page;
+}
+
+/**************************************************************************************************
+* Length of the application, from the start of flash to the end of the last populated page. Sent
+* with CMD_RESET_MCU so the bootloader can record it and validate the application at boot.
+*/
+uint32_t PlanImageLength(PLAN_IMAGE_t *image)
+{
+	if (image->page_count == 0)
+		return 0;
+	return ((uint32_t)image->pages[image->page_count - 1].page + 1) * image->fw_info->page_size_b;
+}
+
+/**************************************************************************************************
+* Check if a file is a compiled plan rather than a .hex file
+*/
+bool IsPlanFile(char *filename)
+{
+	char magic[8];
+	bool res = false;
+
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return false;
+	if ((fread(magic, 1, sizeof(magic), fp) == sizeof(magic)) && (memcmp(magic, PLAN_MAGIC_STRING, 8) == 0))
+		res = true;
+	fclose(fp);
+	return res;
+}
+
+/**************************************************************************************************
+* Point image at the plan that was just built. It uses the plan buffers, so it is only valid until
+* the next plan is built.
+*/
+void GetPlanImage(PLAN_IMAGE_t *image)
+{
+	memset(image, 0, sizeof(PLAN_IMAGE_t));
+	image->fw_info = fw_info;
+	image->crc = firmware_crc;
+	image->entries = plan;
+	image->entry_count = plan_entries;
+	image->pages = plan_pages;
+	image->page_count = plan_page_count;
+	image->payload = plan_payload;
+	image->reports = plan_reports;
+	image->erase = plan_erase;
+	image->base_crc = plan_base_crc;
+
+	for (int i = 0; i < plan_entries; i++)
+	{
+		if (plan[i].payload_offset + plan[i].length > image->payload_size)
+			image->payload_size = plan[i].payload_offset + plan[i].length;
+	}
+}
+
+/**************************************************************************************************
+* Lay out an image in one block of memory, in the same format as a plan file. Returns NULL if out
+* of memory, the block must be freed by the caller.
+*/
+uint8_t *BuildPlanBlob(PLAN_IMAGE_t *image, uint32_t *size)
+{
+	PLAN_HEADER_t header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic_string, PLAN_MAGIC_STRING, 8);
+	header.version = PLAN_FILE_VERSION;
+	header.flags = image->erase ? 0 : PLAN_FLAG_DELTA;
+	header.fw_info = *image->fw_info;
+	header.image_crc = image->crc;
+	header.base_crc = image->base_crc;
+	header.entry_count = image->entry_count;
+	header.entry_offset = sizeof(header);
+	header.page_count = image->page_count;
+	header.page_offset = header.entry_offset + (image->entry_count * sizeof(PLAN_ENTRY_t));
+	header.payload_size = image->payload_size;
+	header.payload_offset = header.page_offset + (image->page_count * sizeof(PLAN_PAGE_t));
+	header.reports = image->reports;
+
+	*size = header.payload_offset + header.payload_size;
+	uint8_t *blob = malloc(*size);
+	if (blob == NULL)
+		return NULL;
+	memcpy(blob, &header, sizeof(header));
+	memcpy(&blob[header.entry_offset], image->entries, image->entry_count * sizeof(PLAN_ENTRY_t));
+	memcpy(&blob[header.page_offset], image->pages, image->page_count * sizeof(PLAN_PAGE_t));
+	memcpy(&blob[header.payload_offset], image->payload, header.payload_size);
+	return blob;
+}
+
+/**************************************************************************************************
+* Check a block of memory in plan file format and point image at it
+*/
+bool PlanImageFromBlob(PLAN_IMAGE_t *image, uint8_t *blob, uint32_t size)
+{
+	PLAN_HEADER_t *header = (PLAN_HEADER_t *)blob;
+	if ((size < sizeof(PLAN_HEADER_t)) ||
+		(memcmp(header->magic_string, PLAN_MAGIC_STRING, 8) != 0) ||
+		(header->version != PLAN_FILE_VERSION) ||
+		(header->entry_offset + ((uint64_t)header->entry_count * sizeof(PLAN_ENTRY_t)) > size) ||
+		(header->page_offset + ((uint64_t)header->page_count * sizeof(PLAN_PAGE_t)) > size) ||
+		(header->payload_offset + (uint64_t)header->payload_size > size) ||
+		(header->fw_info.page_size_b == 0) ||
+		(header->fw_info.page_size_b > PLAN_MAX_PAGE_SIZE) ||
+		((header->fw_info.page_size_b & (header->fw_info.page_size_b - 1)) != 0) ||	// power of two
+		((header->fw_info.flash_size_b % header->fw_info.page_size_b) != 0) ||
+		(header->fw_info.flash_size_b > FIRMWARE_BUFFER_SIZE))
+		return false;
+
+	memset(image, 0, sizeof(PLAN_IMAGE_t));
+	image->fw_info = &header->fw_info;
+	image->crc = header->image_crc;
+	image->entries = (PLAN_ENTRY_t *)&blob[header->entry_offset];
+	image->entry_count = header->entry_count;
+	image->pages = (PLAN_PAGE_t *)&blob[header->page_offset];
+	image->page_count = header->page_count;
+	image->payload = &blob[header->payload_offset];
+	image->payload_size = header->payload_size;
+	image->reports = header->reports;
+	image->erase = !(header->flags & PLAN_FLAG_DELTA);
+	image->base_crc = header->base_crc;
+
+	for (int i = 0; i < image->entry_count; i++)
+	{
+		if ((image->entries[i].payload_offset + (uint64_t)image->entries[i].length > image->payload_size) ||
+			(image->entries[i].length > image->fw_info->page_size_b + HID_DATA_BYTES))	// device page buffer
+			return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Make a copy of an image that doesn't depend on the plan buffers or a mapped file
+*/
+bool CopyPlanImage(PLAN_IMAGE_t *dest, PLAN_IMAGE_t *src)
+{
+	uint32_t size;
+	uint8_t *blob = BuildPlanBlob(src, &size);
+	if (blob == NULL)
+		return false;
+	if (!PlanImageFromBlob(dest, blob, size))
+	{
+		free(blob);
+		return false;
+	}
+	dest->blob = blob;
+	return true;
+}
+
+/**************************************************************************************************
+* Free an image made by CopyPlanImage()
+*/
+void FreePlanImage(PLAN_IMAGE_t *image)
+{
+	free(image->blob);
+	memset(image, 0, sizeof(PLAN_IMAGE_t));
+}
+
+/**************************************************************************************************
+* Write an image to a plan file
+*/
+bool WritePlanFile(char *filename, PLAN_IMAGE_t *image)
+{
+	uint32_t size;
+	uint8_t *blob = BuildPlanBlob(image, &size);
+	if (blob == NULL)
+	{
+		silent_printf("Out of memory.\n");
+		return false;
+	}
+
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		free(blob);
+		return false;
+	}
+	bool res = (fwrite(blob, 1, size, fp) == size);
+	if (fclose(fp) != 0)
+		res = false;
+	free(blob);
+	if (!res)
+	{
+		silent_printf("Failed to write %s.\n", filename);
+		return false;
+	}
+
+	quiet_printf("Plan written to %s (%u bytes)\n", filename, size);
+	return true;
+}
+
+/**************************************************************************************************
+* Unmap and close a plan file
+*/
+void ClosePlanFile(uint8_t *map)
+{
+	if (map != NULL)
+		UnmapViewOfFile(map);
+	if (plan_mapping_handle != NULL)
+		CloseHandle(plan_mapping_handle);
+	if (plan_file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(plan_file_handle);
+	plan_mapping_handle = NULL;
+	plan_file_handle = INVALID_HANDLE_VALUE;
+}
+
+/**************************************************************************************************
+* Close the plan file an image loaded by LoadPlanFile() points into
+*/
+void ClosePlanImage(PLAN_IMAGE_t *image)
+{
+	ClosePlanFile((uint8_t *)image->fw_info - offsetof(PLAN_HEADER_t, fw_info));
+	memset(image, 0, sizeof(PLAN_IMAGE_t));
+}
+
+/**************************************************************************************************
+* Map a plan file into memory and point image at it
+*/
+bool LoadPlanFile(char *filename, PLAN_IMAGE_t *image)
+{
+	quiet_printf("\nLoading %s...\n", filename);
+
+	plan_file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (plan_file_handle == INVALID_HANDLE_VALUE)
+	{
+		silent_printf("Unable to open %s.\n", filename);
+		return false;
+	}
+	DWORD file_size = GetFileSize(plan_file_handle, NULL);
+	plan_mapping_handle = CreateFileMapping(plan_file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	uint8_t *map = NULL;
+	if (plan_mapping_handle != NULL)
+		map = (uint8_t *)MapViewOfFile(plan_mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	if (map == NULL)
+	{
+		silent_printf("Unable to map %s.\n", filename);
+		ClosePlanFile(NULL);
+		return false;
+	}
+
+	if (!PlanImageFromBlob(image, map, file_size))
+	{
+		silent_printf("Invalid plan file.\n");
+		ClosePlanFile(map);
+		return false;
+	}
+
+	quiet_printf("Firmware CRC:\t0x%lX\n", image->crc);
+	quiet_printf("MCU ID:\t\t%02X%02X%02X\n", image->fw_info->mcu_signature[0], image->fw_info->mcu_signature[1], image->fw_info->mcu_signature[2]);
+	quiet_printf("Flash size:\t%u KB (0x%X)\n", image->fw_info->flash_size_b / 1024, image->fw_info->flash_size_b);
+	quiet_printf("Page sise:\t%u\n", image->fw_info->page_size_b);
+	quiet_printf("Version:\t%u.%02u\n", image->fw_info->version_major, image->fw_info->version_minor);
+	quiet_printf("Plan:\t\t%d operations, %d populated pages%s\n", image->entry_count, image->page_count, image->erase ? "" : ", delta");
+	quiet_printf("\n");
+	return true;
+}
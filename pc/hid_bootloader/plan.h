@@ -0,0 +1,94 @@
+// plan.h
+
+#ifndef __PLAN_H
+#define __PLAN_H
+
+
+#define	PLAN_MAX_ENTRIES			(FIRMWARE_BUFFER_SIZE / 128)
+#define	PLAN_MAX_PAGE_SIZE			1024	// page buffers used when writing and verifying
+
+#define	PLAN_ENCODING_RAW			0
+#define	PLAN_ENCODING_COMPRESSED	1
+#define	PLAN_ENCODING_FILL			2
+#define	PLAN_ENCODING_PATCH			3		// rebuilt from existing flash, erased and written
+#define	PLAN_ENCODING_REPLACE		4		// sent raw, erased and written
+
+
+// plan file, laid out so that it can be used directly from a memory mapped file
+#define	PLAN_MAGIC_STRING			"HIDBLPLN"
+#define	PLAN_FILE_VERSION			1
+
+#define	PLAN_FLAG_DELTA				0x0001	// no erase, device must hold the base image
+
+#pragma pack(1)
+typedef struct {
+	char		magic_string[8];		// HIDBLPLN
+	uint16_t	version;
+	uint16_t	flags;
+	FW_INFO_t	fw_info;
+	uint8_t		reserved;
+	uint32_t	image_crc;				// XMEGA NVM CRC of the whole application section
+	uint32_t	base_crc;				// delta plans only
+	uint32_t	entry_count;
+	uint32_t	entry_offset;
+	uint32_t	page_count;
+	uint32_t	page_offset;
+	uint32_t	payload_size;
+	uint32_t	payload_offset;
+	uint32_t	reports;				// number of data reports needed
+} PLAN_HEADER_t;
+
+// one write operation, covering a single page or a run of filled pages
+typedef struct {
+	uint16_t	page;
+	uint16_t	count;
+	uint8_t		encoding;
+	uint8_t		reserved;
+	uint16_t	pattern;				// fill pattern
+	uint16_t	length;					// payload length
+	uint32_t	payload_offset;
+} PLAN_ENTRY_t;
+
+// populated (non-blank) page of the image
+typedef struct {
+	uint16_t	page;
+	uint16_t	reserved;
+	uint32_t	crc;					// CRC32 of page contents
+} PLAN_PAGE_t;
+#pragma pack()
+
+// a firmware image ready to be sent, either a plan that was just built or a plan file
+typedef struct {
+	FW_INFO_t		*fw_info;
+	uint32_t		crc;
+	PLAN_ENTRY_t	*entries;
+	int				entry_count;
+	PLAN_PAGE_t		*pages;
+	int				page_count;
+	uint8_t			*payload;
+	uint32_t		payload_size;
+	int				reports;
+	bool			erase;
+	uint32_t		base_crc;
+	uint8_t			*blob;					// owned memory, CopyPlanImage() only
+} PLAN_IMAGE_t;
+
+extern uint8_t delta_base_buffer[FIRMWARE_BUFFER_SIZE];
+
+
+extern bool PlanPages(bool compress);
+extern bool PlanDelta(uint8_t *base, uint32_t base_crc);
+extern void PlanEntryCommand(PLAN_ENTRY_t *entry, BLCOMMAND_t *cmd);
+extern uint32_t PlanImageLength(PLAN_IMAGE_t *image);
+extern bool IsPlanFile(char *filename);
+extern void GetPlanImage(PLAN_IMAGE_t *image);
+extern uint8_t *BuildPlanBlob(PLAN_IMAGE_t *image, uint32_t *size);
+extern bool PlanImageFromBlob(PLAN_IMAGE_t *image, uint8_t *blob, uint32_t size);
+extern bool CopyPlanImage(PLAN_IMAGE_t *dest, PLAN_IMAGE_t *src);
+extern void FreePlanImage(PLAN_IMAGE_t *image);
+extern bool WritePlanFile(char *filename, PLAN_IMAGE_t *image);
+extern bool LoadPlanFile(char *filename, PLAN_IMAGE_t *image);
+extern void ClosePlanImage(PLAN_IMAGE_t *image);
+
+
+#endif
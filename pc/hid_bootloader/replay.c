@@ -0,0 +1,322 @@
+// replay.c
+//
+// Session recording and replay. While recording, every transfer of a single device session is
+// written to a binary file with its data and timing: the commands, the page data reports, and the
+// status and response reports the device sent back. A recording from a slow station can then be
+// replayed offline against the simulated bootloader (simdev.c), which reports the time the same
+// traffic takes on the bus model and any response that differs from the recording.
+//
+// The file is a REPLAY_HEADER_t followed by REPLAY_RECORD_t records, each followed by its data.
+// Feature reports and OUT reports include the report ID, IN reports don't.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "trace.h"
+#include "simdev.h"
+#include "replay.h"
+
+
+FILE			*replay_fp = NULL;
+REPLAY_HEADER_t	replay_header;
+uint64_t		replay_origin;
+LARGE_INTEGER	replay_frequency;
+
+
+/**************************************************************************************************
+* Start recording to a file. The header is completed when recording stops.
+*/
+bool ReplayCaptureStart(const char *filename)
+{
+	replay_fp = fopen(filename, "wb");
+	if (replay_fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	memset(&replay_header, 0, sizeof(replay_header));
+	replay_header.magic = REPLAY_MAGIC;
+	replay_header.version = REPLAY_VERSION;
+	replay_header.header_size = sizeof(REPLAY_HEADER_t);
+	fwrite(&replay_header, sizeof(replay_header), 1, replay_fp);
+
+	QueryPerformanceFrequency(&replay_frequency);
+	replay_origin = TimingClock();
+	return true;
+}
+
+/**************************************************************************************************
+* Finish the recording
+*/
+bool ReplayCaptureStop(void)
+{
+	if (replay_fp == NULL)
+		return false;
+
+	fseek(replay_fp, 0, SEEK_SET);
+	bool ok = (fwrite(&replay_header, sizeof(replay_header), 1, replay_fp) == 1);
+	if (fclose(replay_fp) != 0)
+		ok = false;
+	replay_fp = NULL;
+
+	if (!ok)
+		silent_printf("Failed to write the session recording.\n");
+	else
+		quiet_printf("%lu transfers recorded.\n", replay_header.record_count);
+	return ok;
+}
+
+/**************************************************************************************************
+* Check if a session is being recorded
+*/
+bool ReplayCapturing(void)
+{
+	return (replay_fp != NULL);
+}
+
+/**************************************************************************************************
+* Record the device being updated, so that it can be simulated on replay
+*/
+void ReplayCaptureTarget(BL_TARGET_t *target, FW_INFO_t *info)
+{
+	if (replay_fp == NULL)
+		return;
+
+	replay_header.flash_size = info->flash_size_b;
+	replay_header.page_size = info->page_size_b;
+	memcpy(replay_header.mcu_id, target->mcu_id, sizeof(replay_header.mcu_id));
+	memcpy(replay_header.mcu_fuses, target->mcu_fuses, sizeof(replay_header.mcu_fuses));
+	memcpy(replay_header.serial, target->serial, sizeof(replay_header.serial));
+	replay_header.serial[sizeof(replay_header.serial) - 1] = '\0';
+	replay_header.bootloader_version = target->has_caps ? target->caps.bootloader_version : 1;
+}
+
+/**************************************************************************************************
+* Convert a performance counter timestamp to microseconds since recording started
+*/
+uint32_t ReplayMicroseconds(uint64_t ticks)
+{
+	return (uint32_t)(((ticks - replay_origin) * 1000000) / replay_frequency.QuadPart);
+}
+
+/**************************************************************************************************
+* Record a transfer
+*/
+void ReplayCapture(TRACE_KIND_t kind, const void *data, int length, uint64_t start, uint64_t end, bool ok)
+{
+	REPLAY_RECORD_t rec;
+
+	if (replay_fp == NULL)
+		return;
+
+	if ((data == NULL) || (length < 0))
+		length = 0;
+	rec.kind = (uint8_t)kind;
+	rec.ok = ok ? 1 : 0;
+	rec.length = (uint16_t)min(length, REPLAY_MAX_DATA);
+	rec.start_us = ReplayMicroseconds(start);
+	rec.duration_us = ReplayMicroseconds(end) - rec.start_us;
+	fwrite(&rec, sizeof(rec), 1, replay_fp);
+	if (rec.length != 0)
+		fwrite(data, rec.length, 1, replay_fp);
+	replay_header.record_count++;
+}
+
+/**************************************************************************************************
+* Print a replay divergence
+*/
+void ReplayDivergence(int *divergences, uint32_t index, const char *what, uint8_t command, const uint8_t *got, const uint8_t *expected, int length)
+{
+	(*divergences)++;
+	if (*divergences > REPLAY_MAX_DIVERGENCES)
+		return;
+
+	const char *cmd_name = timing_command_names[command % TIMING_COMMANDS];
+	silent_printf("Transfer %lu, %s after %s", index, what, (cmd_name != NULL) ? cmd_name : "unknown command");
+	if (got == NULL)
+	{
+		silent_printf(": no response from the simulated device\n");
+		return;
+	}
+	for (int i = 0; i < length; i++)
+	{
+		if (got[i] != expected[i])
+		{
+			silent_printf(": byte %d is 0x%02X, recorded 0x%02X\n", i, got[i], expected[i]);
+			return;
+		}
+	}
+	silent_printf("\n");
+}
+
+/**************************************************************************************************
+* Print a time in microseconds as seconds
+*/
+void ReplayPrintTime(const char *label, uint64_t us, uint64_t bytes)
+{
+	silent_printf("%s\t%llu.%03llus", label, us / 1000000, (us / 1000) % 1000);
+	if (us != 0)
+		silent_printf(", %llu bytes/s of page data", (bytes * 1000000) / us);
+	silent_printf("\n");
+}
+
+/**************************************************************************************************
+* Replay a recorded session against the simulated bootloader. The simulated flash starts erased,
+* or holding basefile if given. Returns true if every response matched the recording.
+*/
+bool ReplaySession(const char *filename, char *basefile)
+{
+	REPLAY_HEADER_t header;
+	REPLAY_RECORD_t rec;
+	uint8_t data[REPLAY_MAX_DATA];
+	uint8_t response[HID_DATA_BYTES];
+	SIMDEV_t dev;
+
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to open %s.\n", filename);
+		return false;
+	}
+	if ((fread(&header, sizeof(header), 1, fp) != 1) || (header.magic != REPLAY_MAGIC) || (header.version != REPLAY_VERSION))
+	{
+		silent_printf("%s is not a session recording.\n", filename);
+		fclose(fp);
+		return false;
+	}
+	if ((header.flash_size == 0) || (header.page_size == 0))
+	{
+		silent_printf("The recorded session ended before the device was identified.\n");
+		fclose(fp);
+		return false;
+	}
+	fseek(fp, header.header_size, SEEK_SET);
+
+	header.serial[sizeof(header.serial) - 1] = '\0';
+	if (!SimDevInit(&dev, header.flash_size, header.page_size, SIMDEV_EEPROM_SIZE, SIMDEV_EEPROM_PAGE_SIZE, header.mcu_id, header.serial))
+	{
+		fclose(fp);
+		return false;
+	}
+	memcpy(dev.fuses, header.mcu_fuses, sizeof(dev.fuses));
+	if (header.header_size < sizeof(REPLAY_HEADER_t))
+		header.bootloader_version = 1;
+	dev.legacy = (header.bootloader_version < SIMDEV_VERSION);
+	quiet_printf("Replaying %lu transfers of device %s, %lu bytes of flash in %u byte pages.\n",
+				 header.record_count, header.serial, header.flash_size, header.page_size);
+
+	if (basefile != NULL)
+	{
+		if (!ReadHexFile(basefile))
+		{
+			SimDevFree(&dev);
+			fclose(fp);
+			return false;
+		}
+		memcpy(dev.flash, firmware_buffer, min(header.flash_size, FIRMWARE_BUFFER_SIZE));
+	}
+
+	uint32_t index = 0;
+	uint8_t command = CMD_NOP;
+	int divergences = 0;
+	int busy_differences = 0;
+	uint64_t page_bytes = 0;
+	uint64_t first_us = 0;
+	uint64_t last_us = 0;
+	uint64_t gap_us = 0;
+	uint64_t host_start = TimingClock();
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1)
+	{
+		if ((rec.length > sizeof(data)) || ((rec.length != 0) && (fread(data, rec.length, 1, fp) != 1)))
+		{
+			silent_printf("Recording is truncated at transfer %lu.\n", index);
+			divergences++;
+			break;
+		}
+
+		// inter-arrival timing of the recording
+		if (index == 0)
+			first_us = rec.start_us;
+		else if (rec.start_us > last_us)
+			gap_us += rec.start_us - last_us;
+		last_us = max(last_us, (uint64_t)rec.start_us + rec.duration_us);
+		index++;
+
+		if ((!rec.ok) || (rec.kind == TRACE_SLOT_WAIT))		// failed transfers never reached the device
+			continue;
+
+		dev.clock_us += SIMDEV_TRANSFER_US;
+		switch (rec.kind)
+		{
+		case TRACE_SET_FEATURE:
+			if (rec.length < sizeof(BLCOMMAND_t))
+				break;
+			command = data[1];
+			SimDevSetFeature(&dev, &data[1]);	// without the report ID
+			break;
+
+		case TRACE_GET_FEATURE:
+			{
+				BLSTATUS_t status;
+				SimDevGetFeature(&dev, &status);
+				int length = min(rec.length, sizeof(status));
+				uint8_t *got = (uint8_t *)&status;
+				if (memcmp(got, data, length) == 0)
+					break;
+				// the busy flags depend on timing, so they are only counted
+				status.busy_flags = ((BLSTATUS_t *)data)->busy_flags;
+				if ((length >= sizeof(status)) && (memcmp(got, data, length) == 0))
+					busy_differences++;
+				else
+					ReplayDivergence(&divergences, index, "status", command, got, data, length);
+				break;
+			}
+
+		case TRACE_WRITE:
+			if (rec.length < BUFFER_SIZE)
+				break;
+			SimDevReportOut(&dev, &data[1]);	// without the report ID
+			page_bytes += HID_DATA_BYTES;
+			break;
+
+		case TRACE_READ:
+			if (!SimDevReportIn(&dev, response))
+				ReplayDivergence(&divergences, index, "response", command, NULL, data, 0);
+			else if (memcmp(response, data, min(rec.length, HID_DATA_BYTES)) != 0)
+				ReplayDivergence(&divergences, index, "response", command, response, data, min(rec.length, HID_DATA_BYTES));
+			break;
+
+		default:
+			break;
+		}
+	}
+	uint64_t host_us = TimingSince(host_start);
+	fclose(fp);
+
+	if (index != header.record_count)
+		silent_printf("Recording has %lu transfers, the header says %lu.\n", index, header.record_count);
+
+	ReplayPrintTime("Recorded:", last_us - first_us, page_bytes);
+	ReplayPrintTime("Bus model:", dev.clock_us, page_bytes);
+	silent_printf("Host gaps:\t%llu.%03llus between transfers in the recording\n", gap_us / 1000000, (gap_us / 1000) % 1000);
+	silent_printf("Flash:\t\t%llu.%03llus of flash operations on the bus model\n", dev.flash_us / 1000000, (dev.flash_us / 1000) % 1000);
+	quiet_printf("Replay took %llu us.\n", host_us);
+	if (divergences > REPLAY_MAX_DIVERGENCES)
+		silent_printf("...\n");
+	silent_printf("%d responses differ from the recording, %d status reads differ only in the busy flags.\n", divergences, busy_differences);
+
+	SimDevFree(&dev);
+	return (divergences == 0);
+}
@@ -0,0 +1,47 @@
+// replay.h
+
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+
+#define	REPLAY_MAGIC				0x524C4248	// "HBLR"
+#define	REPLAY_VERSION				1
+#define	REPLAY_MAX_DATA				BUFFER_SIZE
+#define	REPLAY_MAX_DIVERGENCES		10			// divergences printed, the rest are only counted
+
+
+// session recording file header
+#pragma pack(1)
+typedef struct {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	header_size;
+	uint32_t	record_count;
+	uint32_t	flash_size;					// application section, 0 if the session didn't get that far
+	uint16_t	page_size;
+	uint8_t		mcu_id[4];
+	uint8_t		mcu_fuses[6];
+	char		serial[HID_DATA_BYTES];
+	uint8_t		bootloader_version;			// 1 for bootloaders without capabilities, and older recordings
+} REPLAY_HEADER_t;
+
+// one transfer, followed by length bytes of data
+typedef struct {
+	uint8_t		kind;						// TRACE_KIND_t
+	uint8_t		ok;
+	uint16_t	length;
+	uint32_t	start_us;					// since recording started
+	uint32_t	duration_us;
+} REPLAY_RECORD_t;
+#pragma pack()
+
+
+extern bool ReplayCaptureStart(const char *filename);
+extern bool ReplayCaptureStop(void);
+extern bool ReplayCapturing(void);
+extern void ReplayCaptureTarget(BL_TARGET_t *target, FW_INFO_t *info);
+extern void ReplayCapture(TRACE_KIND_t kind, const void *data, int length, uint64_t start, uint64_t end, bool ok);
+extern bool ReplaySession(const char *filename, char *basefile);
+
+
+#endif
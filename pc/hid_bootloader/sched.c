@@ -0,0 +1,240 @@
+// sched.c
+//
+// USB topology aware scheduling for gang programming. Full speed devices behind a high speed hub
+// reach the bus through one of its transaction translators (TT), a 12Mbit/s full speed bus shared
+// by every device on it. When too many of them stream reports at once the excess split transactions
+// are retried, wasting bus time. Devices are grouped by the TT they use and each TT has a budget of
+// devices that may stream reports at the same time. A device that is programming flash doesn't need
+// the bus, so it gives its slot to the next waiting device on the same TT.
+
+#include <stdio.h>
+#include <windows.h>
+#include <cfgmgr32.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "bootloader.h"
+#include "opt_output.h"
+#include "sched.h"
+
+
+/**************************************************************************************************
+* Prepare for a new set of devices. A budget of 0 estimates each hub's from the bus model.
+*/
+bool SchedInit(SCHED_t *sched, int device_count, int budget)
+{
+	sched->wait_next = malloc(device_count * sizeof(int));
+	if (sched->wait_next == NULL)
+		return false;
+
+	sched->hub_count = 0;
+	sched->budget = max(budget, 0);
+	return true;
+}
+
+/**************************************************************************************************
+* Free scheduler state
+*/
+void SchedFree(SCHED_t *sched)
+{
+	free(sched->wait_next);
+	sched->wait_next = NULL;
+	sched->hub_count = 0;
+}
+
+/**************************************************************************************************
+* Number of devices on one TT that can stream at once. Each moves at most one report per polling
+* interval, and every device's IN endpoint is polled each interval whether it has a report or not.
+*/
+int SchedBudget(int devices)
+{
+	int bytes = (SCHED_FRAME_BYTES * SCHED_EP_INTERVAL_MS) - (devices * SCHED_POLL_COST);
+	return max(bytes / SCHED_REPORT_COST, 1);
+}
+
+/**************************************************************************************************
+* Get a device node's ID and one of its registry properties, false if either is missing
+*/
+bool SchedNodeInfo(DEVINST inst, char *id, ULONG property, char *value, ULONG value_size)
+{
+	if (CM_Get_Device_IDA(inst, id, SCHED_HUB_KEY_SIZE, 0) != CR_SUCCESS)
+		return false;
+	memset(value, 0, value_size);
+	return CM_Get_DevNode_Registry_PropertyA(inst, property, NULL, value, &value_size, 0) == CR_SUCCESS;
+}
+
+/**************************************************************************************************
+* Get a hub's protocol from its compatible IDs, USB\Class_09&SubClass_00&Prot_0n. 0 for a full
+* speed hub, 1 for a high speed hub with a single TT, 2 for one TT per port, -1 if unknown.
+*/
+int SchedHubProtocol(DEVINST inst)
+{
+	char id[SCHED_HUB_KEY_SIZE];
+	char ids[512];
+
+	if (!SchedNodeInfo(inst, id, CM_DRP_COMPATIBLEIDS, ids, sizeof(ids) - 2))
+		return -1;
+	for (char *p = ids; *p != '\0'; p += strlen(p) + 1)		// multi string
+	{
+		char *prot = strstr(p, "Prot_0");
+		if ((_strnicmp(p, "USB\\Class_09", 12) == 0) && (prot != NULL))
+			return prot[6] - '0';
+	}
+	return -1;
+}
+
+/**************************************************************************************************
+* Find the transaction translator a HID device uses. The device path contains the instance ID of
+* the HID device, whose parent is the USB device (or the interface of a composite device). From
+* there hubs are followed up the tree until one translates to high speed: a single TT hub is the
+* key, for a multi TT hub or a root hub it is the hub and the port. Full speed hubs share the TT
+* above them. If the topology can't be found the path itself is used, so the device is scheduled
+* on its own.
+*/
+void SchedHubKey(const char *path, char *key, int key_size)
+{
+	char id[SCHED_HUB_KEY_SIZE];
+	char port[SCHED_HUB_KEY_SIZE];
+	DEVINST inst;
+
+	_snprintf(key, key_size - 1, "%s", path);
+	key[key_size - 1] = '\0';
+
+	// \\?\hid#vid_xxxx&pid_xxxx#instance#{class guid} -> HID\VID_XXXX&PID_XXXX\INSTANCE
+	const char *start = path;
+	if (strncmp(start, "\\\\?\\", 4) == 0)
+		start += 4;
+	const char *end = strrchr(start, '#');
+	if ((end == NULL) || (end - start >= (int)sizeof(id)))
+		return;
+	int len = (int)(end - start);
+	for (int i = 0; i < len; i++)
+		id[i] = (start[i] == '#') ? '\\' : start[i];
+	id[len] = '\0';
+
+	if (CM_Locate_DevNodeA(&inst, id, CM_LOCATE_DEVNODE_NORMAL) != CR_SUCCESS)
+		return;
+	if (CM_Get_Parent(&inst, inst, 0) != CR_SUCCESS)		// USB device or interface
+		return;
+	if (CM_Get_Device_IDA(inst, id, sizeof(id), 0) != CR_SUCCESS)
+		return;
+	if (strstr(id, "&MI_") != NULL)							// interface of a composite device
+	{
+		if (CM_Get_Parent(&inst, inst, 0) != CR_SUCCESS)
+			return;
+	}
+
+	for (;;)
+	{
+		// port the device, or the full speed hub, is attached to
+		DEVINST hub;
+		if (!SchedNodeInfo(inst, id, CM_DRP_LOCATION_INFORMATION, port, sizeof(port)))
+			return;
+		if (CM_Get_Parent(&hub, inst, 0) != CR_SUCCESS)
+			return;
+		if (CM_Get_Device_IDA(hub, id, sizeof(id), 0) != CR_SUCCESS)
+			return;
+
+		int protocol = (_strnicmp(id, "USB\\ROOT_HUB", 12) == 0) ? 2 : SchedHubProtocol(hub);
+		if (protocol == 0)
+		{
+			inst = hub;
+			continue;
+		}
+		if (protocol == 2)
+			_snprintf(key, key_size - 1, "%s|%s", id, port);
+		else
+			_snprintf(key, key_size - 1, "%s", id);
+		return;
+	}
+}
+
+/**************************************************************************************************
+* Add a device to the hub with the matching key, returns the hub index. When there are too many
+* hubs the rest share the last one.
+*/
+int SchedAddDevice(SCHED_t *sched, const char *key)
+{
+	int i;
+	for (i = 0; i < sched->hub_count; i++)
+	{
+		if (strcmp(sched->hubs[i].key, key) == 0)
+			break;
+	}
+
+	if (i == sched->hub_count)
+	{
+		if (sched->hub_count < SCHED_MAX_HUBS)
+		{
+			SCHED_HUB_t *hub = &sched->hubs[sched->hub_count++];
+			memset(hub, 0, sizeof(SCHED_HUB_t));
+			strncpy(hub->key, key, SCHED_HUB_KEY_SIZE - 1);
+			hub->budget = sched->budget;
+			hub->wait_head = -1;
+			hub->wait_tail = -1;
+		}
+		else
+			i = SCHED_MAX_HUBS - 1;
+	}
+
+	sched->hubs[i].devices++;
+	if (sched->budget == 0)
+		sched->hubs[i].budget = SchedBudget(sched->hubs[i].devices);
+	return i;
+}
+
+/**************************************************************************************************
+* Remove a device that no longer holds or waits for a streaming slot from its hub
+*/
+void SchedRemoveDevice(SCHED_t *sched, int hub)
+{
+	if (sched->hubs[hub].devices > 0)
+		sched->hubs[hub].devices--;
+	if (sched->budget == 0)
+		sched->hubs[hub].budget = SchedBudget(sched->hubs[hub].devices);
+}
+
+/**************************************************************************************************
+* Request a streaming slot on a hub. If none is free the device is queued and false returned, it
+* is handed a slot by SchedRelease() later.
+*/
+bool SchedAcquire(SCHED_t *sched, int hub, int device)
+{
+	SCHED_HUB_t *h = &sched->hubs[hub];
+
+	if (h->streaming < h->budget)
+	{
+		h->streaming++;
+		return true;
+	}
+
+	sched->wait_next[device] = -1;
+	if (h->wait_tail == -1)
+		h->wait_head = device;
+	else
+		sched->wait_next[h->wait_tail] = device;
+	h->wait_tail = device;
+	return false;
+}
+
+/**************************************************************************************************
+* Give up a streaming slot. If a device is waiting the slot passes to it and its index is
+* returned, otherwise -1.
+*/
+int SchedRelease(SCHED_t *sched, int hub)
+{
+	SCHED_HUB_t *h = &sched->hubs[hub];
+
+	int device = h->wait_head;
+	if (device == -1)
+	{
+		h->streaming--;
+		return -1;
+	}
+
+	h->wait_head = sched->wait_next[device];
+	if (h->wait_head == -1)
+		h->wait_tail = -1;
+	return device;
+}
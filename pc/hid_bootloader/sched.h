@@ -0,0 +1,46 @@
+// sched.h
+
+#ifndef __SCHED_H
+#define __SCHED_H
+
+
+#define	SCHED_MAX_HUBS				64
+#define	SCHED_HUB_KEY_SIZE			200
+
+// full speed bus model, shared with the simulator
+#define	SCHED_FRAME_BYTES			1350	// 90% of a 1ms full speed frame can be periodic transfers
+#define	SCHED_REPORT_COST			(HID_DATA_BYTES + 13)	// token, data and handshake packets plus bit stuffing
+#define	SCHED_POLL_COST				10		// IN token and NAK, the HID driver polls every device's IN endpoint
+#define	SCHED_EP_INTERVAL_MS		4		// bInterval of the bootloader's interrupt endpoints
+
+
+// devices sharing a transaction translator share its bandwidth, at most budget of them stream at once
+typedef struct {
+	char		key[SCHED_HUB_KEY_SIZE];
+	int			devices;
+	int			budget;
+	int			streaming;
+	int			wait_head;				// FIFO of devices waiting to stream, -1 if empty
+	int			wait_tail;
+} SCHED_HUB_t;
+
+// scheduler for one set of devices
+typedef struct {
+	SCHED_HUB_t	hubs[SCHED_MAX_HUBS];
+	int			hub_count;
+	int			budget;					// 0 to estimate each hub's from its devices
+	int			*wait_next;				// next device in the same wait FIFO
+} SCHED_t;
+
+
+extern bool SchedInit(SCHED_t *sched, int device_count, int budget);
+extern void SchedFree(SCHED_t *sched);
+extern int SchedBudget(int devices);
+extern void SchedHubKey(const char *path, char *key, int key_size);
+extern int SchedAddDevice(SCHED_t *sched, const char *key);
+extern void SchedRemoveDevice(SCHED_t *sched, int hub);
+extern bool SchedAcquire(SCHED_t *sched, int hub, int device);
+extern int SchedRelease(SCHED_t *sched, int hub);
+
+
+#endif
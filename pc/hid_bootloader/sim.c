@@ -0,0 +1,333 @@
+// sim.c
+//
+// Gang programming simulator, for tuning the hub scheduler without a rack of hardware. Devices are
+// spread over a number of transaction translators (TT) and run a plan in 1ms steps against a model
+// of the full speed bus behind each one. Every frame the TT carries SCHED_FRAME_BYTES of periodic
+// transfers, less the polls of every device's idle IN endpoint. Streaming devices move at most one
+// report per polling interval, and reports that don't fit in the frame are retried and waste
+// SIM_RETRY_COST bytes each. Commands are control transfers, one per device per frame, in what is
+// left of the frame. Flash operations keep the device busy without using the bus.
+//
+// The same plan is simulated without the scheduler, with the default budget and with half and
+// twice the default, and the devices per minute compared.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "opt_output.h"
+#include "sched.h"
+#include "sim.h"
+
+
+SIM_STEP_t		*sim_steps = NULL;
+int				sim_step_count = 0;
+SIM_DEVICE_t	*sim_devices = NULL;
+int				sim_device_count = 0;
+uint32_t		sim_time = 0;
+SCHED_t			sim_sched;
+
+
+/**************************************************************************************************
+* Append a step to the script, merging it with the previous step if they are the same type
+*/
+void SimAddStep(uint8_t type, uint32_t count)
+{
+	if (count == 0)
+		return;
+	if ((sim_step_count > 0) && (sim_steps[sim_step_count - 1].type == type) && (type != SIM_STEP_STREAM))
+	{
+		sim_steps[sim_step_count - 1].count += count;
+		return;
+	}
+	sim_steps[sim_step_count].type = type;
+	sim_steps[sim_step_count].count = count;
+	sim_step_count++;
+}
+
+/**************************************************************************************************
+* Script of bus transfers and flash operations that the engine performs for image.
+* Each command is a set feature and a get feature transfer, plus an IN report if it has a response.
+*/
+bool SimBuildScript(PLAN_IMAGE_t *image, bool verify)
+{
+	int num_pages = image->fw_info->flash_size_b / image->fw_info->page_size_b;
+
+	// every entry and page needs at most three steps, plus a few for the fixed commands
+	sim_steps = malloc((image->entry_count * 3 + num_pages * 3 + 16) * sizeof(SIM_STEP_t));
+	if (sim_steps == NULL)
+		return false;
+	sim_step_count = 0;
+
+	SimAddStep(SIM_STEP_TRANSFER, 3 + 3);				// serial number, MCU ID
+	if (image->erase)
+	{
+		SimAddStep(SIM_STEP_TRANSFER, 2);
+		SimAddStep(SIM_STEP_FLASH, SIM_ERASE_MS);
+	}
+	else
+	{
+		SimAddStep(SIM_STEP_TRANSFER, 3);
+		SimAddStep(SIM_STEP_FLASH, SIM_CRC_MS);
+	}
+	SimAddStep(SIM_STEP_TRANSFER, 2);					// set pointer
+
+	for (int i = 0; i < image->entry_count; i++)
+	{
+		PLAN_ENTRY_t *entry = &image->entries[i];
+		if (entry->encoding != PLAN_ENCODING_FILL)
+			SimAddStep(SIM_STEP_STREAM, (entry->length + HID_DATA_BYTES - 1) / HID_DATA_BYTES);
+		SimAddStep(SIM_STEP_TRANSFER, 2 * ((entry->count + FILL_BATCH_PAGES - 1) / FILL_BATCH_PAGES));
+		SimAddStep(SIM_STEP_FLASH, entry->count * SIM_PAGE_WRITE_MS);
+	}
+
+	SimAddStep(SIM_STEP_TRANSFER, 3);					// CRC check
+	SimAddStep(SIM_STEP_FLASH, SIM_CRC_MS);
+
+	if (verify)
+	{
+		int next = 0;
+		int page = 0;
+		while (page < num_pages)
+		{
+			if ((next < image->page_count) && (image->pages[next].page == page))
+			{
+				SimAddStep(SIM_STEP_STREAM, (image->fw_info->page_size_b + RESPONSE_DATA_BYTES - 1) / RESPONSE_DATA_BYTES);
+				next++;
+				page++;
+			}
+			else
+			{
+				int run = (next < image->page_count) ? image->pages[next].page - page : num_pages - page;
+				run = min(run, BLANK_CHECK_MAX_PAGES);
+				SimAddStep(SIM_STEP_TRANSFER, 3);
+				SimAddStep(SIM_STEP_FLASH, 1 + (run / SIM_BLANK_PAGES_PER_MS));
+				page += run;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**************************************************************************************************
+* Start the device's current step, skipping to the end of the script when it is finished. Streams
+* need a slot on the hub first.
+*/
+void SimEnterStep(int d)
+{
+	SIM_DEVICE_t *sd = &sim_devices[d];
+
+	if (sd->step >= sim_step_count)
+	{
+		sd->done = true;
+		sd->finish_ms = sim_time;
+		return;
+	}
+
+	SIM_STEP_t *step = &sim_steps[sd->step];
+	sd->remaining = step->count;
+	if ((step->type == SIM_STEP_STREAM) && (!sd->slot))
+	{
+		if (!SchedAcquire(&sim_sched, sd->hub, d))
+		{
+			sd->parked = true;
+			return;
+		}
+		sd->slot = true;
+	}
+}
+
+/**************************************************************************************************
+* Current step finished, release any hub slot and move on
+*/
+void SimStepDone(int d)
+{
+	SIM_DEVICE_t *sd = &sim_devices[d];
+
+	if (sd->slot)
+	{
+		sd->slot = false;
+		int next = SchedRelease(&sim_sched, sd->hub);
+		if (next != -1)
+		{
+			sim_devices[next].parked = false;
+			sim_devices[next].slot = true;
+		}
+	}
+
+	sd->step++;
+	SimEnterStep(d);
+}
+
+/**************************************************************************************************
+* Check if a device wants the bus this frame
+*/
+bool SimContending(int d)
+{
+	SIM_DEVICE_t *sd = &sim_devices[d];
+	if ((sd->done) || (sd->parked) || (sim_steps[sd->step].type == SIM_STEP_FLASH))
+		return false;
+
+	// the host polls each interrupt endpoint once per interval, spread over the interval's frames
+	if (sim_steps[sd->step].type == SIM_STEP_STREAM)
+		return (sim_time % SCHED_EP_INTERVAL_MS) == (uint32_t)(d % SCHED_EP_INTERVAL_MS);
+	return true;
+}
+
+/**************************************************************************************************
+* Let up to granted of the devices on a TT that want to stream, or to send commands, move this
+* frame. Round robin so that every contender makes progress.
+*/
+void SimGrant(int hub, bool stream, int granted, int rr)
+{
+	for (int n = 0; (n < sim_device_count) && (granted > 0); n++)
+	{
+		int i = (rr + n) % sim_device_count;
+		SIM_DEVICE_t *sd = &sim_devices[i];
+		if ((sd->hub == hub) && SimContending(i) && ((sim_steps[sd->step].type == SIM_STEP_STREAM) == stream))
+		{
+			sd->moved = true;
+			granted--;
+		}
+	}
+}
+
+/**************************************************************************************************
+* Simulate one run, returns the time in ms for all devices to finish
+*/
+uint32_t SimRun(int hubs, int per_hub, int budget)
+{
+	char key[SCHED_HUB_KEY_SIZE];
+	int capacity = SCHED_FRAME_BYTES - ((per_hub * SCHED_POLL_COST) / SCHED_EP_INTERVAL_MS);
+
+	sim_device_count = hubs * per_hub;
+	sim_devices = calloc(sim_device_count, sizeof(SIM_DEVICE_t));
+	if ((sim_devices == NULL) || (!SchedInit(&sim_sched, sim_device_count, budget)))
+	{
+		free(sim_devices);
+		return 0;
+	}
+
+	for (int i = 0; i < sim_device_count; i++)
+	{
+		sprintf(key, "sim-tt-%d", i / per_hub);
+		sim_devices[i].hub = SchedAddDevice(&sim_sched, key);
+	}
+
+	sim_time = 0;
+	for (int i = 0; i < sim_device_count; i++)
+		SimEnterStep(i);
+
+	int finished = 0;
+	int rr = 0;
+	while (finished < sim_device_count)
+	{
+		sim_time++;
+
+		// flash operations
+		for (int i = 0; i < sim_device_count; i++)
+		{
+			SIM_DEVICE_t *sd = &sim_devices[i];
+			if ((!sd->done) && (!sd->parked) && (sim_steps[sd->step].type == SIM_STEP_FLASH))
+				sd->moved = true;
+			else
+				sd->moved = false;
+		}
+
+		// bus transfers on each TT. Reports are periodic and scheduled first, commands are control
+		// transfers and get what is left of the frame.
+		for (int h = 0; h < sim_sched.hub_count; h++)
+		{
+			int reports = 0;
+			for (int i = 0; i < sim_device_count; i++)
+			{
+				if ((sim_devices[i].hub == h) && SimContending(i) && (sim_steps[sim_devices[i].step].type == SIM_STEP_STREAM))
+					reports++;
+			}
+
+			// the reports that don't fit are retried at the next poll, after wasting part of this frame
+			int granted = reports;
+			if (reports * SCHED_REPORT_COST > capacity)
+			{
+				granted = (capacity - (reports * SIM_RETRY_COST)) / (SCHED_REPORT_COST - SIM_RETRY_COST);
+				if (granted < 1)
+					granted = 1;
+			}
+			int used = (SCHED_FRAME_BYTES - capacity) + (granted * SCHED_REPORT_COST) + ((reports - granted) * SIM_RETRY_COST);
+
+			SimGrant(h, true, granted, rr);
+			SimGrant(h, false, max((SIM_FRAME_BYTES - used) / SIM_CONTROL_COST, 1), rr);
+		}
+		rr = (rr + 1) % sim_device_count;
+
+		for (int i = 0; i < sim_device_count; i++)
+		{
+			SIM_DEVICE_t *sd = &sim_devices[i];
+			if (!sd->moved)
+				continue;
+			if (--sd->remaining == 0)
+			{
+				SimStepDone(i);
+				if (sd->done)
+					finished++;
+			}
+		}
+	}
+
+	uint32_t elapsed = sim_time;
+	SchedFree(&sim_sched);
+	free(sim_devices);
+	sim_devices = NULL;
+	return elapsed;
+}
+
+/**************************************************************************************************
+* Print the result of one run
+*/
+void SimReport(const char *name, uint32_t elapsed, int devices)
+{
+	if (elapsed == 0)
+	{
+		silent_printf("%-16sfailed\n", name);
+		return;
+	}
+	silent_printf("%-16s%lu.%03lus\t%lu\n", name, elapsed / 1000, elapsed % 1000, ((uint32_t)devices * 60000) / elapsed);
+}
+
+/**************************************************************************************************
+* Simulate gang programming of image on hubs x per_hub devices, with and without hub
+* scheduling
+*/
+bool SimulateGang(PLAN_IMAGE_t *image, int hubs, int per_hub, int budget, bool verify)
+{
+	if ((hubs < 1) || (per_hub < 1))
+		return false;
+	if (!SimBuildScript(image, verify))
+		return false;
+
+	int devices = hubs * per_hub;
+	int estimate = SchedBudget(per_hub);
+	silent_printf("Simulating %d TTs of %d devices, %d steps per device, estimated budget %d\n", hubs, per_hub, sim_step_count, estimate);
+	if (estimate >= per_hub)
+		silent_printf("The estimated budget doesn't limit this many devices per TT.\n");
+	silent_printf("\t\tTime\t\tDevices/min\n");
+	SimReport("Unscheduled", SimRun(hubs, per_hub, INT_MAX), devices);
+	SimReport("Estimated", SimRun(hubs, per_hub, 0), devices);
+	if (estimate > 1)
+		SimReport("Half", SimRun(hubs, per_hub, estimate / 2), devices);
+	if (estimate * 2 < per_hub)
+		SimReport("Double", SimRun(hubs, per_hub, estimate * 2), devices);
+	if (budget > 0)
+		SimReport("Given", SimRun(hubs, per_hub, budget), devices);
+
+	free(sim_steps);
+	sim_steps = NULL;
+	return true;
+}
@@ -0,0 +1,43 @@
+// sim.h
+
+#ifndef __SIM_H
+#define __SIM_H
+
+
+// timing model
+#define	SIM_PAGE_WRITE_MS			8		// XMEGA page erase and write
+#define	SIM_ERASE_MS				40		// application section erase
+#define	SIM_CRC_MS					20		// NVM CRC of the application section
+#define	SIM_SIG_ROW_MS				4		// user signature row erase, or write
+#define	SIM_EEPROM_WRITE_MS			8		// EEPROM atomic page erase and write
+#define	SIM_BLANK_PAGES_PER_MS		16
+#define	SIM_RETRY_COST				20		// bytes of frame lost to a transaction that doesn't fit and is retried
+#define	SIM_FRAME_BYTES				1500	// whole full speed frame, control transfers get what periodic ones leave
+#define	SIM_CONTROL_COST			45		// setup, data and status stages of a feature report
+
+#define	SIM_STEP_TRANSFER			0		// count transfers, any time
+#define	SIM_STEP_STREAM				1		// count transfers, needs a streaming slot on the hub
+#define	SIM_STEP_FLASH				2		// count ms of flash operations
+
+
+typedef struct {
+	uint8_t		type;
+	uint32_t	count;
+} SIM_STEP_t;
+
+typedef struct {
+	int			hub;
+	int			step;
+	uint32_t	remaining;
+	bool		slot;
+	bool		parked;
+	bool		moved;					// made progress this frame
+	bool		done;
+	uint32_t	finish_ms;
+} SIM_DEVICE_t;
+
+
+extern bool SimulateGang(PLAN_IMAGE_t *image, int hubs, int per_hub, int budget, bool verify);
+
+
+#endif
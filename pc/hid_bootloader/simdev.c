@@ -0,0 +1,435 @@
+// simdev.c
+//
+// Simulated bootloader. The firmware's report handlers in firmware/hid_bootloader/hid_bootloader.c
+// talk to the NVM controller and USB stack directly, so they are mirrored here against a flash
+// array in host memory, using the host ports of the page decoders in compress.c. Responses match
+// the firmware byte for byte, which lets recorded sessions be replayed and checked offline.
+//
+// Time is virtual. The caller advances the clock for each bus transfer, and flash operations keep
+// the device busy for the times in the simulator's model (sim.h). Commands that wait for the NVM
+// controller in the firmware stall the clock until it is free, as the firmware stalls the bus.
+//
+// Nothing here depends on Windows, the Linux uhid device (pc/uhid_bootloader) builds it as well.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "compress.h"
+#include "crc.h"
+#include "sim.h"
+#include "simdev.h"
+
+
+/**************************************************************************************************
+* Set up an erased device. The flash size is the application section.
+*/
+bool SimDevInit(SIMDEV_t *dev, uint32_t flash_size, uint16_t page_size, uint32_t eeprom_size, uint16_t eeprom_page_size,
+				const uint8_t *mcu_id, const char *serial)
+{
+	memset(dev, 0, sizeof(SIMDEV_t));
+	dev->flash = malloc(flash_size);
+	dev->page_buffer = malloc(page_size + HID_DATA_BYTES);
+	dev->user_sig = malloc(page_size);
+	dev->eeprom = malloc(eeprom_size);
+	if ((dev->flash == NULL) || (dev->page_buffer == NULL) || (dev->user_sig == NULL) || (dev->eeprom == NULL))
+	{
+		SimDevFree(dev);
+		return false;
+	}
+
+	memset(dev->flash, 0xFF, flash_size);
+	memset(dev->page_buffer, 0xFF, page_size + HID_DATA_BYTES);
+	memset(dev->user_sig, 0xFF, page_size);
+	memset(dev->eeprom, 0xFF, eeprom_size);
+	dev->flash_size = flash_size;
+	dev->page_size = page_size;
+	dev->eeprom_size = eeprom_size;
+	dev->eeprom_page_size = eeprom_page_size;
+	memcpy(dev->mcu_id, mcu_id, sizeof(dev->mcu_id));
+	strncpy(dev->serial, serial, sizeof(dev->serial) - 1);
+	return true;
+}
+
+/**************************************************************************************************
+* Free a simulated device
+*/
+void SimDevFree(SIMDEV_t *dev)
+{
+	free(dev->flash);
+	free(dev->page_buffer);
+	free(dev->user_sig);
+	free(dev->eeprom);
+	dev->flash = NULL;
+	dev->page_buffer = NULL;
+	dev->user_sig = NULL;
+	dev->eeprom = NULL;
+}
+
+/**************************************************************************************************
+* SP_WaitForSPM(), wait for the NVM controller to finish
+*/
+void SimDevWaitSPM(SIMDEV_t *dev)
+{
+	if (dev->clock_us < dev->busy_until_us)
+		dev->clock_us = dev->busy_until_us;
+}
+
+/**************************************************************************************************
+* Start a flash operation that runs in the background
+*/
+void SimDevFlash(SIMDEV_t *dev, uint32_t ms)
+{
+	dev->busy_until_us = dev->clock_us + (ms * 1000);
+	dev->flash_us += ms * 1000;
+}
+
+/**************************************************************************************************
+* Flash operation that the handler waits for
+*/
+void SimDevBlock(SIMDEV_t *dev, uint32_t ms)
+{
+	dev->clock_us += ms * 1000;
+	dev->flash_us += ms * 1000;
+}
+
+/**************************************************************************************************
+* Write the page buffer to a page, like SP_LoadFlashPage() and SP_WriteApplicationPage()
+*/
+void SimDevWritePage(SIMDEV_t *dev, uint16_t page)
+{
+	SimDevWaitSPM(dev);
+	memcpy(&dev->flash[(uint32_t)page * dev->page_size], dev->page_buffer, dev->page_size);
+	SimDevFlash(dev, SIM_PAGE_WRITE_MS);
+}
+
+/**************************************************************************************************
+* Handle a set feature report, a command. The report ID is not included.
+*/
+void SimDevSetFeature(SIMDEV_t *dev, const uint8_t *report)
+{
+	uint8_t command = report[0];
+	uint32_t u32 = report[1] | (report[2] << 8) | (report[3] << 16) | ((uint32_t)report[4] << 24);
+	uint16_t u16[2] = { (uint16_t)(u32 & 0xFFFF), (uint16_t)(u32 >> 16) };
+	uint16_t num_pages = (uint16_t)(dev->flash_size / dev->page_size);
+	uint8_t *response = dev->response;
+	bool none = !dev->legacy;			// no response, version 1 bootloaders send the buffer anyway
+
+	dev->result = 0;
+	memset(response, 0, HID_DATA_BYTES);
+
+	// version 1 bootloaders stop at CMD_READ_EEPROM_CRC
+	if (dev->legacy && (command >= CMD_BLANK_CHECK))
+	{
+		dev->result = 0xFF;
+		return;
+	}
+
+	switch (command)
+	{
+	case CMD_NOP:
+		return;
+
+	case CMD_SET_POINTER:
+		dev->page_ptr = u16[0];
+		return;
+
+	case CMD_READ_FLASH:
+		if (u32 > dev->flash_size)
+		{
+			dev->result = 0xFF;
+			return;
+		}
+		SimDevWaitSPM(dev);
+		memcpy(response, &dev->flash[u32], (dev->flash_size - u32 < HID_DATA_BYTES) ? dev->flash_size - u32 : HID_DATA_BYTES);
+		break;
+
+	case CMD_ERASE_APP_SECTION:
+		SimDevWaitSPM(dev);
+		memset(dev->flash, 0xFF, dev->flash_size);
+		SimDevFlash(dev, SIM_ERASE_MS);
+		return;
+
+	case CMD_READ_FLASH_CRCS:
+		{
+			SimDevWaitSPM(dev);
+			uint32_t crc = xmega_nvm_crc32(dev->flash, dev->flash_size);
+			SimDevBlock(dev, SIM_CRC_MS);
+			response[0] = crc & 0xFF;
+			response[1] = (crc >> 8) & 0xFF;
+			response[2] = (crc >> 16) & 0xFF;
+			response[3] = (crc >> 24) & 0xFF;
+			response[8] = 0xA5;				// boot section CRC isn't simulated
+			break;
+		}
+
+	case CMD_READ_MCU_IDS:
+		memcpy(response, dev->mcu_id, sizeof(dev->mcu_id));
+		break;
+
+	case CMD_READ_FUSES:
+		SimDevWaitSPM(dev);
+		memcpy(response, dev->fuses, sizeof(dev->fuses));
+		break;
+
+	case CMD_WRITE_PAGE:
+		if (u16[0] >= num_pages)
+		{
+			dev->result = 0xFF;
+			return;
+		}
+		SimDevWritePage(dev, u16[0]);
+		dev->page_ptr = 0;
+		if (none)
+			return;
+		break;
+
+	case CMD_ERASE_USER_SIG_ROW:
+		SimDevWaitSPM(dev);
+		memset(dev->user_sig, 0xFF, dev->page_size);
+		SimDevFlash(dev, SIM_SIG_ROW_MS);
+		if (none)
+			return;
+		break;
+
+	// written without an erase, so bits can only be cleared
+	case CMD_WRITE_USER_SIG_ROW:
+		SimDevWaitSPM(dev);
+		for (uint16_t i = 0; i < dev->page_size; i++)
+			dev->user_sig[i] &= dev->page_buffer[i];
+		SimDevFlash(dev, SIM_SIG_ROW_MS);
+		if (none)
+			return;
+		break;
+
+	// bytes past the end of the row aren't simulated and read as zero
+	case CMD_READ_USER_SIG_ROW:
+		if (u16[0] > dev->page_size)
+		{
+			dev->result = 0xFF;
+			return;
+		}
+		SimDevWaitSPM(dev);
+		for (uint16_t i = 0; (i < HID_DATA_BYTES) && (u16[0] + i < dev->page_size); i++)
+			response[i] = dev->user_sig[u16[0] + i];
+		break;
+
+	case CMD_READ_SERIAL:
+		memcpy(response, dev->serial, sizeof(dev->serial));
+		break;
+
+	// with the application's length the boot record is written first, in the user signature row
+	case CMD_RESET_MCU:
+		if (u32 != 0)
+		{
+			if ((u32 > dev->flash_size) || (u32 & 1))
+			{
+				dev->result = 0xFF;
+				return;
+			}
+			SimDevWaitSPM(dev);
+			uint32_t crc = xmega_nvm_crc32(dev->flash, u32);
+			SimDevBlock(dev, 1 + (uint32_t)(((uint64_t)SIM_CRC_MS * u32) / dev->flash_size));
+			uint32_t record[3] = { SIMDEV_BOOT_RECORD_MAGIC, u32, crc };
+			for (int i = 0; i < 12; i++)
+				dev->user_sig[i] = (record[i / 4] >> ((i % 4) * 8)) & 0xFF;
+			memcpy(dev->page_buffer, dev->user_sig, dev->page_size);	// the firmware builds the row there
+			dev->page_ptr = 0;
+			SimDevBlock(dev, 2 * SIM_SIG_ROW_MS);
+		}
+		dev->reset = true;
+		if (none)
+			return;
+		break;
+
+	case CMD_READ_EEPROM:
+		if (u16[0] > dev->eeprom_size)
+		{
+			dev->result = 0xFF;
+			return;
+		}
+		SimDevWaitSPM(dev);
+		for (uint16_t i = 0; (i < HID_DATA_BYTES) && (u16[0] + i < dev->eeprom_size); i++)
+			response[i] = dev->eeprom[u16[0] + i];
+		break;
+
+	// the firmware's range check for this command has lost its body, the intended check is
+	// simulated here
+	case CMD_WRITE_EEPROM_PAGE:
+		if (u16[0] >= dev->eeprom_size / dev->eeprom_page_size)
+		{
+			dev->result = 0xFF;
+			return;
+		}
+		SimDevWaitSPM(dev);
+		memcpy(&dev->eeprom[(uint32_t)u16[0] * dev->eeprom_page_size], dev->page_buffer, dev->eeprom_page_size);
+		SimDevFlash(dev, SIM_EEPROM_WRITE_MS);
+		if (none)
+			return;
+		break;
+
+	// the firmware feeds the EEPROM through the CRC module's DATAIN in CRC-32 mode
+	case CMD_READ_EEPROM_CRC:
+		{
+			SimDevWaitSPM(dev);
+			uint32_t crc = crc32(dev->eeprom, dev->eeprom_size);
+			SimDevBlock(dev, 1);
+			response[0] = crc & 0xFF;
+			response[1] = (crc >> 8) & 0xFF;
+			response[2] = (crc >> 16) & 0xFF;
+			response[3] = (crc >> 24) & 0xFF;
+			break;
+		}
+
+	case CMD_BLANK_CHECK:
+		{
+			uint32_t addr = (uint32_t)u16[0] * dev->page_size;
+			uint32_t end = addr + ((uint32_t)u16[1] * dev->page_size);
+			if ((u16[1] > BLANK_CHECK_MAX_PAGES) || (end > dev->flash_size))
+			{
+				dev->result = 0xFF;
+				return;
+			}
+			SimDevWaitSPM(dev);
+			SimDevBlock(dev, 1 + (u16[1] / SIM_BLANK_PAGES_PER_MS));
+			while ((addr < end) && (dev->flash[addr] == 0xFF))
+				addr++;
+			if (addr >= end)
+				addr = 0xFFFFFFFF;
+			response[0] = addr & 0xFF;
+			response[1] = (addr >> 8) & 0xFF;
+			response[2] = (addr >> 16) & 0xFF;
+			response[3] = (addr >> 24) & 0xFF;
+			break;
+		}
+
+	case CMD_WRITE_COMPRESSED_PAGE:
+		if ((u16[0] >= num_pages) ||
+			(!DecompressPageInPlace(dev->page_buffer, dev->page_size + HID_DATA_BYTES, dev->page_size, u16[1])))
+		{
+			dev->page_ptr = 0;
+			dev->result = 0xFF;
+			return;
+		}
+		SimDevWritePage(dev, u16[0]);
+		dev->page_ptr = 0;
+		return;
+
+	case CMD_FILL_PAGES:
+		{
+			uint16_t page = u16[1] & FILL_PAGE_MASK;
+			uint8_t count = (u16[1] >> FILL_COUNT_SHIFT) + 1;
+			if ((count > FILL_BATCH_PAGES) || (page + count > num_pages))
+			{
+				dev->result = 0xFF;
+				return;
+			}
+			for (uint16_t i = 0; i < dev->page_size; i += 2)
+			{
+				dev->page_buffer[i] = u16[0] & 0xFF;
+				dev->page_buffer[i + 1] = u16[0] >> 8;
+			}
+			while (count--)
+				SimDevWritePage(dev, page++);
+			dev->page_ptr = 0;
+			return;
+		}
+
+	// the firmware's table, with the simulator's timing model as the NVM hints
+	case CMD_READ_CAPABILITIES:
+		{
+			BL_CAPS_t caps;
+			memset(&caps, 0, sizeof(caps));
+			caps.caps_version = CAPS_VERSION;
+			caps.bootloader_version = SIMDEV_VERSION;
+			caps.features = CAP_BLANK_CHECK | CAP_BOOT_RECORD | CAP_EEPROM | CAP_USER_SIG_ROW | CAP_NVM_WAIT | CAP_TAGGED;
+			caps.encodings = ENC_RAW | ENC_COMPRESSED | ENC_FILL | ENC_PATCH;
+			caps.page_buffers = 2;
+			caps.max_batch = FILL_BATCH_PAGES;
+			caps.in_queue = SIMDEV_IN_QUEUE;
+			caps.page_size = dev->page_size;
+			caps.app_section_size = dev->flash_size;
+			caps.eeprom_size = (uint16_t)dev->eeprom_size;
+			caps.eeprom_page_size = (uint8_t)dev->eeprom_page_size;
+			caps.page_write_ms = SIM_PAGE_WRITE_MS;
+			caps.page_erase_write_ms = SIM_PAGE_WRITE_MS;
+			caps.eeprom_write_ms = SIM_EEPROM_WRITE_MS;
+			caps.app_erase_ms = SIM_ERASE_MS;
+			memcpy(response, &caps, sizeof(caps));
+			break;
+		}
+
+	case CMD_PATCH_PAGE:
+		SimDevWaitSPM(dev);
+		if ((u16[0] >= num_pages) ||
+			(!PatchPageInPlace(dev->page_buffer, dev->page_size + HID_DATA_BYTES, dev->page_size, u16[1], dev->flash, dev->flash_size)))
+		{
+			dev->page_ptr = 0;
+			dev->result = 0xFF;
+			return;
+		}
+		SimDevWritePage(dev, u16[0]);
+		dev->page_ptr = 0;
+		return;
+
+	default:
+		dev->result = 0xFF;
+		return;
+	}
+
+	// numbered like the firmware's, version 1 bootloaders don't
+	uint8_t seq = (dev->in_seq + 1) & STATUS_SEQ_MASK;
+	if (!dev->legacy)
+		response[RESPONSE_SEQ_BYTE] = seq;
+	dev->in_seq = seq;
+
+	// the host's HID driver polls the IN endpoint all the time, so the firmware's ring doesn't fill
+	// and reports wait in the driver's buffer instead, which drops the oldest
+	if (dev->response_count >= SIMDEV_IN_QUEUE)
+	{
+		dev->response_head = (dev->response_head + 1) % SIMDEV_IN_QUEUE;
+		dev->response_count--;
+	}
+	uint8_t slot = (dev->response_head + dev->response_count) % SIMDEV_IN_QUEUE;
+	memcpy(dev->responses[slot], response, HID_DATA_BYTES);
+	dev->response_count++;
+}
+
+/**************************************************************************************************
+* Handle a get feature report, the status of the last command
+*/
+void SimDevGetFeature(SIMDEV_t *dev, BLSTATUS_t *status)
+{
+	status->report_id = 0;
+	status->version = dev->legacy ? 1 : SIMDEV_VERSION;
+	status->busy_flags = (dev->clock_us < dev->busy_until_us) ? SIMDEV_NVM_BUSY : 0;
+	status->page_ptr = dev->legacy ? dev->page_ptr : ((dev->page_ptr & STATUS_PAGE_PTR_MASK) | (dev->in_seq << STATUS_SEQ_SHIFT));
+	status->result = dev->result;
+}
+
+/**************************************************************************************************
+* Handle an OUT report, data for the page buffer
+*/
+void SimDevReportOut(SIMDEV_t *dev, const uint8_t *data)
+{
+	memcpy(&dev->page_buffer[dev->page_ptr], data, HID_DATA_BYTES);
+	dev->page_ptr += HID_DATA_BYTES;
+	dev->page_ptr &= dev->page_size - 1;
+}
+
+/**************************************************************************************************
+* Get the oldest queued IN report, a command response. False if there isn't one.
+*/
+bool SimDevReportIn(SIMDEV_t *dev, uint8_t *data)
+{
+	if (dev->response_count == 0)
+		return false;
+	memcpy(data, dev->responses[dev->response_head], HID_DATA_BYTES);
+	dev->response_head = (dev->response_head + 1) % SIMDEV_IN_QUEUE;
+	dev->response_count--;
+	return true;
+}
@@ -0,0 +1,58 @@
+// simdev.h
+
+#ifndef __SIMDEV_H
+#define __SIMDEV_H
+
+
+// bus model, one full speed frame per transfer
+#define	SIMDEV_TRANSFER_US			1000
+#define	SIMDEV_NVM_BUSY				0x80	// NVM.STATUS NVMBUSY
+#define	SIMDEV_BOOT_RECORD_MAGIC	0x544F4F42	// BOOT_RECORD_MAGIC in the firmware's protocol.h
+#define	SIMDEV_IN_QUEUE				4		// IN reports waiting for the host, as UDI_HID_GENERIC_REPORT_IN_QUEUE
+#define	SIMDEV_VERSION				2		// BOOTLOADER_VERSION, 1 without CMD_READ_CAPABILITIES
+
+// EEPROM for callers that don't know the part's, the largest XMEGA A's
+#define	SIMDEV_EEPROM_SIZE			4096
+#define	SIMDEV_EEPROM_PAGE_SIZE		32
+
+
+// simulated bootloader, the firmware's report handlers running against a flash array in host memory
+typedef struct {
+	uint8_t		*flash;
+	uint32_t	flash_size;
+	uint16_t	page_size;
+	uint8_t		*page_buffer;				// page_size + HID_DATA_BYTES, like the firmware
+	uint8_t		*user_sig;					// user signature row, one page
+	uint8_t		*eeprom;
+	uint32_t	eeprom_size;
+	uint16_t	eeprom_page_size;
+	uint16_t	page_ptr;
+	uint8_t		result;
+	uint8_t		mcu_id[4];
+	uint8_t		fuses[6];
+	char		serial[HID_DATA_BYTES];
+	uint8_t		response[HID_DATA_BYTES];		// being built by the handler
+	uint8_t		responses[SIMDEV_IN_QUEUE][HID_DATA_BYTES];	// IN reports waiting for the host
+	uint8_t		response_head;
+	uint8_t		response_count;
+	uint8_t		in_seq;						// number of the last IN report queued
+	bool		reset;						// CMD_RESET_MCU received
+	bool		legacy;						// behave as a version 1 bootloader, without capabilities or tagging
+
+	// virtual time, advanced by the caller for bus transfers and by the device for flash operations
+	uint64_t	clock_us;
+	uint64_t	busy_until_us;
+	uint64_t	flash_us;					// total time spent in flash operations
+} SIMDEV_t;
+
+
+extern bool SimDevInit(SIMDEV_t *dev, uint32_t flash_size, uint16_t page_size, uint32_t eeprom_size, uint16_t eeprom_page_size,
+					   const uint8_t *mcu_id, const char *serial);
+extern void SimDevFree(SIMDEV_t *dev);
+extern void SimDevSetFeature(SIMDEV_t *dev, const uint8_t *report);
+extern void SimDevGetFeature(SIMDEV_t *dev, BLSTATUS_t *status);
+extern void SimDevReportOut(SIMDEV_t *dev, const uint8_t *data);
+extern bool SimDevReportIn(SIMDEV_t *dev, uint8_t *data);
+
+
+#endif
@@ -0,0 +1,345 @@
+// timing.c
+//
+// Timing of flashing sessions. The command layer records how long each phase of an update takes,
+// the latency of every bootloader command and report as a histogram, how often the bootloader was
+// found busy, and the bytes moved. Timestamps come from the performance counter, so they are
+// monotonic and much finer than the USB frame.
+//
+// All functions do nothing when passed a NULL TIMING_t, which is how timing is turned off. The
+// synchronous command functions find the session of the calling thread in timing_session, so that
+// gang workers each record their own device.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "bootloader.h"
+#include "opt_output.h"
+#include "timing.h"
+
+
+__declspec(thread) TIMING_t *timing_session = NULL;
+
+LARGE_INTEGER timing_frequency = { 0 };
+
+const char *timing_phase_names[TIMING_PHASES] = {
+	"enumerate", "info", "load", "erase", "stream", "nvm", "crc", "verify", "reset",
+};
+
+const char *timing_transfer_names[TIMING_TRANSFERS] = {
+	"response report", "page data report", "busy wait",
+};
+
+const char *timing_transfer_keys[TIMING_TRANSFERS] = {
+	"response_reports", "page_data_reports", "busy_waits",
+};
+
+const char *timing_command_names[TIMING_COMMANDS] = {
+	"NOP", "SET_POINTER", "READ_FLASH", "ERASE_APP_SECTION", "READ_FLASH_CRCS", "READ_MCU_IDS",
+	"READ_FUSES", "WRITE_PAGE", NULL, "ERASE_USER_SIG_ROW", "WRITE_USER_SIG_ROW", "READ_USER_SIG_ROW",
+	"READ_SERIAL", NULL, "RESET_MCU", "READ_EEPROM", "WRITE_EEPROM_PAGE", "READ_EEPROM_CRC",
+	"BLANK_CHECK", "WRITE_COMPRESSED_PAGE", "FILL_PAGES", "PATCH_PAGE", "READ_CAPABILITIES",
+};
+
+
+/**************************************************************************************************
+* Performance counter timestamp
+*/
+uint64_t TimingClock(void)
+{
+	LARGE_INTEGER now;
+
+	if (timing_frequency.QuadPart == 0)		// the frequency is fixed at boot, racing threads agree on it
+		QueryPerformanceFrequency(&timing_frequency);
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+/**************************************************************************************************
+* Timestamp for starting a measurement, 0 when timing is off
+*/
+uint64_t TimingNow(TIMING_t *t)
+{
+	if (t == NULL)
+		return 0;
+	return TimingClock();
+}
+
+/**************************************************************************************************
+* Microseconds since a timestamp from TimingClock() or TimingNow()
+*/
+uint32_t TimingSince(uint64_t start)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+	uint64_t us = ((now.QuadPart - start) * 1000000) / timing_frequency.QuadPart;
+	return (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+}
+
+/**************************************************************************************************
+* Start a new session
+*/
+void TimingBegin(TIMING_t *t)
+{
+	if (t == NULL)
+		return;
+	t->sessions++;
+	t->phase_start = 0;
+}
+
+/**************************************************************************************************
+* End the phase in progress, if any, and start another
+*/
+void TimingPhase(TIMING_t *t, TIMING_PHASE_t phase)
+{
+	if (t == NULL)
+		return;
+
+	uint64_t now = TimingNow(t);
+	if (t->phase_start != 0)
+		t->phase_us[t->phase] += TimingSince(t->phase_start);
+	t->phase = phase;
+	t->phase_start = now;
+}
+
+/**************************************************************************************************
+* End the session, finishing the phase in progress
+*/
+void TimingEnd(TIMING_t *t)
+{
+	if ((t == NULL) || (t->phase_start == 0))
+		return;
+	t->phase_us[t->phase] += TimingSince(t->phase_start);
+	t->phase_start = 0;
+}
+
+/**************************************************************************************************
+* Add the time since start to a histogram
+*/
+void TimingAdd(TIMING_HIST_t *hist, uint64_t start)
+{
+	uint32_t us = TimingSince(start);
+	if ((hist->count == 0) || (us < hist->min_us))
+		hist->min_us = us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	hist->count++;
+	hist->total_us += us;
+
+	int n = 0;
+	while ((n < TIMING_BUCKETS - 1) && (us >= (1UL << n)))
+		n++;
+	hist->buckets[n]++;
+}
+
+/**************************************************************************************************
+* Record the latency of a bootloader command
+*/
+void TimingCommand(TIMING_t *t, uint8_t command, uint64_t start)
+{
+	if (t == NULL)
+		return;
+	TimingAdd(&t->commands[command % TIMING_COMMANDS], start);
+}
+
+/**************************************************************************************************
+* Record the latency of a report or wait
+*/
+void TimingRecord(TIMING_t *t, TIMING_TRANSFER_t transfer, uint64_t start)
+{
+	if (t == NULL)
+		return;
+	TimingAdd(&t->transfers[transfer], start);
+}
+
+/**************************************************************************************************
+* Count report payload bytes sent and received
+*/
+void TimingBytes(TIMING_t *t, uint32_t out, uint32_t in)
+{
+	if (t == NULL)
+		return;
+	t->bytes_out += out;
+	t->bytes_in += in;
+}
+
+/**************************************************************************************************
+* Add one histogram to another
+*/
+void TimingMergeHist(TIMING_HIST_t *dest, TIMING_HIST_t *src)
+{
+	if (src->count == 0)
+		return;
+	if ((dest->count == 0) || (src->min_us < dest->min_us))
+		dest->min_us = src->min_us;
+	if (src->max_us > dest->max_us)
+		dest->max_us = src->max_us;
+	dest->count += src->count;
+	dest->total_us += src->total_us;
+	for (int i = 0; i < TIMING_BUCKETS; i++)
+		dest->buckets[i] += src->buckets[i];
+}
+
+/**************************************************************************************************
+* Add the sessions recorded in src to dest, e.g. to total up gang programming
+*/
+void TimingMerge(TIMING_t *dest, TIMING_t *src)
+{
+	if ((dest == NULL) || (src == NULL))
+		return;
+
+	dest->sessions += src->sessions;
+	for (int i = 0; i < TIMING_PHASES; i++)
+		dest->phase_us[i] += src->phase_us[i];
+	for (int i = 0; i < TIMING_COMMANDS; i++)
+		TimingMergeHist(&dest->commands[i], &src->commands[i]);
+	for (int i = 0; i < TIMING_TRANSFERS; i++)
+		TimingMergeHist(&dest->transfers[i], &src->transfers[i]);
+	dest->busy_polls += src->busy_polls;
+	dest->bytes_out += src->bytes_out;
+	dest->bytes_in += src->bytes_in;
+}
+
+/**************************************************************************************************
+* Estimate a percentile from a histogram, as the upper bound of the bucket it falls in
+*/
+uint32_t TimingPercentile(TIMING_HIST_t *hist, int percent)
+{
+	uint32_t target = (uint32_t)(((uint64_t)hist->count * percent + 99) / 100);
+	uint32_t seen = 0;
+
+	for (int n = 0; n < TIMING_BUCKETS; n++)
+	{
+		seen += hist->buckets[n];
+		if (seen >= target)
+			return min((uint32_t)(1UL << n), hist->max_us);
+	}
+	return hist->max_us;
+}
+
+/**************************************************************************************************
+* Total time of all phases, the length of the sessions added together
+*/
+uint64_t TimingTotal(TIMING_t *t)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < TIMING_PHASES; i++)
+		total += t->phase_us[i];
+	return total;
+}
+
+/**************************************************************************************************
+* Print one histogram line
+*/
+void TimingPrintHist(const char *name, TIMING_HIST_t *hist)
+{
+	if (hist->count == 0)
+		return;
+	silent_printf("%-22s\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", name, hist->count, hist->min_us, (uint32_t)(hist->total_us / hist->count),
+				  hist->max_us, TimingPercentile(hist, 50), TimingPercentile(hist, 99));
+}
+
+/**************************************************************************************************
+* Print a timing report
+*/
+void TimingReport(TIMING_t *t)
+{
+	char name[16];
+
+	if ((t == NULL) || (t->sessions == 0))
+		return;
+
+	uint64_t total = TimingTotal(t);
+	silent_printf("\nTiming of %d sessions, %llu.%03llus in total\n", t->sessions, total / 1000000, (total / 1000) % 1000);
+	silent_printf("Phase\t\tms\tms each\t%%\n");
+	for (int i = 0; i < TIMING_PHASES; i++)
+	{
+		if (t->phase_us[i] == 0)
+			continue;
+		silent_printf("%-10s\t%llu\t%llu\t%llu\n", timing_phase_names[i], t->phase_us[i] / 1000, t->phase_us[i] / (1000 * t->sessions),
+					  (total != 0) ? (t->phase_us[i] * 100) / total : 0);
+	}
+
+	silent_printf("\nLatency (us)\t\tCount\tMin\tAvg\tMax\tp50\tp99\n");
+	for (int i = 0; i < TIMING_COMMANDS; i++)
+	{
+		const char *cmd_name = timing_command_names[i];
+		if (cmd_name == NULL)
+		{
+			_snprintf(name, sizeof(name) - 1, "0x%02X", i);
+			name[sizeof(name) - 1] = '\0';
+			cmd_name = name;
+		}
+		TimingPrintHist(cmd_name, &t->commands[i]);
+	}
+	for (int i = 0; i < TIMING_TRANSFERS; i++)
+		TimingPrintHist(timing_transfer_names[i], &t->transfers[i]);
+
+	silent_printf("\nBusy polls:\t%lu in %lu waits\n", t->busy_polls, t->transfers[TIMING_BUSY_WAIT].count);
+	silent_printf("Data:\t\t%llu bytes out, %llu bytes in\n", t->bytes_out, t->bytes_in);
+	if (total != 0)
+		silent_printf("Throughput:\t%llu bytes/s per session", (t->bytes_out * 1000000) / total);
+	uint64_t streaming = t->phase_us[TIMING_STREAM] + t->phase_us[TIMING_NVM];
+	if (streaming != 0)
+		silent_printf(", %llu bytes/s while writing", (t->bytes_out * 1000000) / streaming);
+	silent_printf("\n");
+}
+
+/**************************************************************************************************
+* Write one histogram as a JSON object
+*/
+void TimingWriteHist(FILE *fp, TIMING_HIST_t *hist)
+{
+	fprintf(fp, "{ \"count\": %lu, \"min_us\": %lu, \"avg_us\": %lu, \"max_us\": %lu, \"p50_us\": %lu, \"p99_us\": %lu, \"buckets\": [",
+			hist->count, hist->min_us, (hist->count != 0) ? (uint32_t)(hist->total_us / hist->count) : 0, hist->max_us,
+			TimingPercentile(hist, 50), TimingPercentile(hist, 99));
+	for (int n = 0; n < TIMING_BUCKETS; n++)
+		fprintf(fp, "%s%lu", (n == 0) ? "" : ", ", hist->buckets[n]);
+	fprintf(fp, "] }");
+}
+
+/**************************************************************************************************
+* Write the timing report as JSON for collection by test station software. Histogram bucket n
+* counts latencies under 2^n us and at least 2^(n-1) us.
+*/
+bool TimingWriteJSON(TIMING_t *t, const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	uint64_t total = TimingTotal(t);
+	fprintf(fp, "{\n\t\"sessions\": %d,\n\t\"total_us\": %llu,\n\t\"phases_us\": {", t->sessions, total);
+	for (int i = 0; i < TIMING_PHASES; i++)
+		fprintf(fp, "%s\n\t\t\"%s\": %llu", (i == 0) ? "" : ",", timing_phase_names[i], t->phase_us[i]);
+	fprintf(fp, "\n\t},\n\t\"commands\": {");
+	bool first = true;
+	for (int i = 0; i < TIMING_COMMANDS; i++)
+	{
+		if (t->commands[i].count == 0)
+			continue;
+		if (timing_command_names[i] != NULL)
+			fprintf(fp, "%s\n\t\t\"%s\": ", first ? "" : ",", timing_command_names[i]);
+		else
+			fprintf(fp, "%s\n\t\t\"0x%02X\": ", first ? "" : ",", i);
+		TimingWriteHist(fp, &t->commands[i]);
+		first = false;
+	}
+	fprintf(fp, "\n\t}");
+	for (int i = 0; i < TIMING_TRANSFERS; i++)
+	{
+		fprintf(fp, ",\n\t\"%s\": ", timing_transfer_keys[i]);
+		TimingWriteHist(fp, &t->transfers[i]);
+	}
+	fprintf(fp, ",\n\t\"busy_polls\": %lu,\n\t\"bytes_out\": %llu,\n\t\"bytes_in\": %llu,\n", t->busy_polls, t->bytes_out, t->bytes_in);
+	fprintf(fp, "\t\"bytes_per_second\": %llu\n}\n", (total != 0) ? (t->bytes_out * 1000000) / total : 0);
+
+	fclose(fp);
+	return true;
+}
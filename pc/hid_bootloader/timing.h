@@ -0,0 +1,75 @@
+// timing.h
+
+#ifndef __TIMING_H
+#define __TIMING_H
+
+
+#define	TIMING_BUCKETS				24		// bucket n holds latencies under 2^n us, the last one everything else
+#define	TIMING_COMMANDS				32		// bootloader command numbers recorded
+
+
+typedef enum {
+	TIMING_ENUMERATE = 0,				// finding and opening devices
+	TIMING_INFO,						// serial number, MCU ID and fuses
+	TIMING_LOAD,						// base image check and planning for delta updates
+	TIMING_ERASE,
+	TIMING_STREAM,						// page data reports
+	TIMING_NVM,							// page write commands, waiting for flash programming
+	TIMING_CRC,
+	TIMING_VERIFY,
+	TIMING_RESET,
+	TIMING_PHASES,
+} TIMING_PHASE_t;
+
+// latencies recorded besides commands
+typedef enum {
+	TIMING_RESPONSE = 0,				// response report after a command
+	TIMING_WRITE,						// page data report
+	TIMING_BUSY_WAIT,					// wait for the busy flags to clear
+	TIMING_TRANSFERS,
+} TIMING_TRANSFER_t;
+
+// latency histogram
+typedef struct {
+	uint32_t		count;
+	uint64_t		total_us;
+	uint32_t		min_us;
+	uint32_t		max_us;
+	uint32_t		buckets[TIMING_BUCKETS];
+} TIMING_HIST_t;
+
+// timing of one or more sessions, a session being the update of one device
+typedef struct {
+	int				sessions;
+	uint64_t		phase_us[TIMING_PHASES];
+	TIMING_HIST_t	commands[TIMING_COMMANDS];	// feature report out to status back in
+	TIMING_HIST_t	transfers[TIMING_TRANSFERS];
+	uint32_t		busy_polls;				// status reads that found the bootloader busy
+	uint64_t		bytes_out;				// page data sent
+	uint64_t		bytes_in;				// response data received
+
+	// phase in progress
+	TIMING_PHASE_t	phase;
+	uint64_t		phase_start;			// 0 if none
+} TIMING_t;
+
+
+extern __declspec(thread) TIMING_t *timing_session;
+extern const char *timing_command_names[TIMING_COMMANDS];
+
+
+extern uint64_t TimingClock(void);
+extern uint64_t TimingNow(TIMING_t *t);
+extern uint32_t TimingSince(uint64_t start);
+extern void TimingBegin(TIMING_t *t);
+extern void TimingPhase(TIMING_t *t, TIMING_PHASE_t phase);
+extern void TimingEnd(TIMING_t *t);
+extern void TimingCommand(TIMING_t *t, uint8_t command, uint64_t start);
+extern void TimingRecord(TIMING_t *t, TIMING_TRANSFER_t transfer, uint64_t start);
+extern void TimingBytes(TIMING_t *t, uint32_t out, uint32_t in);
+extern void TimingMerge(TIMING_t *dest, TIMING_t *src);
+extern void TimingReport(TIMING_t *t);
+extern bool TimingWriteJSON(TIMING_t *t, const char *filename);
+
+
+#endif
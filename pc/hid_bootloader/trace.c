@@ -0,0 +1,196 @@
+// trace.c
+//
+// Timeline trace of every USB transfer. Each feature report set and get, page data report and
+// response report is recorded with its start and end timestamps, size, command and device in an
+// in-memory ring buffer, which is written out at the end in the Chrome trace event format. Load it
+// in chrome://tracing or ui.perfetto.dev to see one track per device, where the gaps between
+// transfers are idle bus time and devices queueing for a streaming slot on their hub show up as
+// slot waits.
+//
+// Recording is a timestamp and a few stores, and a gang of threads can record at once. When the
+// buffer fills up the oldest events are overwritten.
+
+#include <stdio.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hidapi.h"
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "opt_output.h"
+#include "hid_bootloader.h"
+#include "timing.h"
+#include "trace.h"
+#include "replay.h"
+
+
+__declspec(thread) int trace_device = 0;		// device of the synchronous calls on this thread
+
+TRACE_EVENT_t	*trace_events = NULL;
+int				trace_size = 0;
+volatile LONG	trace_next = 0;
+uint64_t		trace_origin = 0;
+LARGE_INTEGER	trace_frequency;
+char			*trace_names[TRACE_MAX_DEVICES];
+
+const char *trace_kind_names[TRACE_KINDS] = {
+	"set", "get", "write", "read", "slot wait",
+};
+
+
+/**************************************************************************************************
+* Start recording into a buffer of max_events
+*/
+bool TraceStart(int max_events)
+{
+	trace_events = malloc(max_events * sizeof(TRACE_EVENT_t));
+	if (trace_events == NULL)
+		return false;
+	trace_size = max_events;
+	trace_next = 0;
+	memset(trace_names, 0, sizeof(trace_names));
+	QueryPerformanceFrequency(&trace_frequency);
+	trace_origin = TimingClock();
+	return true;
+}
+
+/**************************************************************************************************
+* Stop recording and free the buffer
+*/
+void TraceStop(void)
+{
+	free(trace_events);
+	trace_events = NULL;
+	for (int i = 0; i < TRACE_MAX_DEVICES; i++)
+	{
+		free(trace_names[i]);
+		trace_names[i] = NULL;
+	}
+}
+
+/**************************************************************************************************
+* Check if transfers are being recorded
+*/
+bool TraceEnabled(void)
+{
+	return (trace_events != NULL);
+}
+
+/**************************************************************************************************
+* Name the track of a device, e.g. with its serial number
+*/
+void TraceDevice(int device, const char *name)
+{
+	if ((trace_events == NULL) || (device < 0) || (device >= TRACE_MAX_DEVICES))
+		return;
+	free(trace_names[device]);
+	trace_names[device] = _strdup(name);
+}
+
+/**************************************************************************************************
+* Record a transfer that started at start and has just finished. The data is only kept when a
+* session is being recorded for replay.
+*/
+void TraceRecord(int device, TRACE_KIND_t kind, uint8_t command, const void *data, int bytes, uint64_t start, bool ok)
+{
+	if ((trace_events == NULL) && (!ReplayCapturing()))
+		return;
+
+	uint64_t end = TimingClock();
+	ReplayCapture(kind, data, bytes, start, end, ok);
+	if (trace_events == NULL)
+		return;
+
+	ULONG seq = (ULONG)InterlockedIncrement(&trace_next) - 1;
+	TRACE_EVENT_t *ev = &trace_events[seq % trace_size];
+	ev->start = start;
+	ev->end = end;
+	ev->device = (uint16_t)device;
+	ev->kind = (uint8_t)kind;
+	ev->command = command;
+	ev->bytes = (uint16_t)bytes;
+	ev->ok = ok;
+}
+
+/**************************************************************************************************
+* Convert a timestamp to microseconds since recording started
+*/
+double TraceMicroseconds(uint64_t ticks)
+{
+	return ((double)(int64_t)(ticks - trace_origin) * 1000000.0) / (double)trace_frequency.QuadPart;
+}
+
+/**************************************************************************************************
+* Write the recorded events, oldest first, as a Chrome trace event JSON file
+*/
+bool TraceWrite(const char *filename)
+{
+	char name[32];
+
+	if (trace_events == NULL)
+		return false;
+
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		silent_printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	ULONG next = (ULONG)trace_next;
+	ULONG count = min(next, (ULONG)trace_size);
+	if (next > (ULONG)trace_size)
+		silent_printf("Trace buffer overflowed, only the last %d transfers were kept.\n", trace_size);
+
+	fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"hid_bootloader\"}}");
+
+	// track names, unnamed devices get the viewer's default
+	for (int i = 0; i < TRACE_MAX_DEVICES; i++)
+	{
+		if (trace_names[i] == NULL)
+			continue;
+		fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%d: ", i, i);
+		for (const char *c = trace_names[i]; *c != '\0'; c++)		// paths contain backslashes
+		{
+			if ((*c == '\\') || (*c == '"'))
+				fputc('\\', fp);
+			if ((uint8_t)*c >= ' ')
+				fputc(*c, fp);
+		}
+		fprintf(fp, "\"}}");
+	}
+
+	for (ULONG seq = next - count; seq != next; seq++)
+	{
+		TRACE_EVENT_t *ev = &trace_events[seq % trace_size];
+
+		const char *cmd_name = NULL;
+		if (ev->command != TRACE_NO_COMMAND)
+		{
+			cmd_name = timing_command_names[ev->command % TIMING_COMMANDS];
+			if (cmd_name == NULL)
+			{
+				_snprintf(name, sizeof(name) - 1, "0x%02X", ev->command);
+				name[sizeof(name) - 1] = '\0';
+				cmd_name = name;
+			}
+		}
+		else if (ev->kind == TRACE_GET_FEATURE)
+			cmd_name = "busy";
+
+		double start = TraceMicroseconds(ev->start);
+		fprintf(fp, ",\n{\"name\": \"%s%s%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, ",
+				trace_kind_names[ev->kind], (cmd_name != NULL) ? " " : "", (cmd_name != NULL) ? cmd_name : "",
+				(ev->kind == TRACE_SLOT_WAIT) ? "sched" : "usb", ev->device, start, TraceMicroseconds(ev->end) - start);
+		fprintf(fp, "\"args\": {\"bytes\": %u, \"ok\": %s}}", ev->bytes, ev->ok ? "true" : "false");
+	}
+
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	quiet_printf("%lu transfers written to %s.\n", count, filename);
+	return true;
+}
@@ -0,0 +1,43 @@
+// trace.h
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+
+#define	TRACE_DEFAULT_EVENTS		(1 << 18)	// 8MB, a few hundred devices of a large image
+#define	TRACE_MAX_DEVICES			256			// devices that can be given track names
+#define	TRACE_NO_COMMAND			0xFF
+
+
+typedef enum {
+	TRACE_SET_FEATURE = 0,				// command sent
+	TRACE_GET_FEATURE,					// status read, after a command or while waiting for busy to clear
+	TRACE_WRITE,						// OUT report of page data
+	TRACE_READ,							// IN report with a response
+	TRACE_SLOT_WAIT,					// waiting for a streaming slot on the hub
+	TRACE_KINDS,
+} TRACE_KIND_t;
+
+typedef struct {
+	uint64_t		start;				// performance counter
+	uint64_t		end;
+	uint16_t		device;
+	uint8_t			kind;				// TRACE_KIND_t
+	uint8_t			command;			// bootloader command, TRACE_NO_COMMAND if none
+	uint16_t		bytes;
+	bool			ok;
+} TRACE_EVENT_t;
+
+
+extern __declspec(thread) int trace_device;
+
+
+extern bool TraceStart(int max_events);
+extern void TraceStop(void);
+extern bool TraceEnabled(void);
+extern void TraceDevice(int device, const char *name);
+extern void TraceRecord(int device, TRACE_KIND_t kind, uint8_t command, const void *data, int bytes, uint64_t start, bool ok);
+extern bool TraceWrite(const char *filename);
+
+
+#endif
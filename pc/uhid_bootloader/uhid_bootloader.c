@@ -0,0 +1,547 @@
+// uhid_bootloader.c
+//
+// Virtual bootloader for Linux. Creates a HID device through /dev/uhid with the bootloader's report
+// descriptor, IDs and strings, and answers its feature and data reports with the simulated bootloader
+// from pc/hid_bootloader/simdev.c. The kernel's HID core and hidraw see it as the real device, so host
+// code that uses hidapi can be run and tested end to end with no hardware attached.
+//
+// Flash, EEPROM and user signature row operations take as long as they do on the device, using the
+// simulator's timing model (sim.h), unless -n is given. The flash can be preloaded from a hex file,
+// which also sets the part. After CMD_RESET_MCU the device disconnects, as the watchdog resets the
+// MCU, and with -k it comes back as the bootloader again.
+//
+// Build:
+//   gcc -std=gnu99 -O2 -I../hid_bootloader -o uhid_bootloader uhid_bootloader.c ../hid_bootloader/simdev.c
+//       ../hid_bootloader/compress.c ../hid_bootloader/crc.c ../hid_bootloader/intel_hex.c
+//
+// Needs read/write access to /dev/uhid, usually root.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+
+#include "intel_hex.h"
+#include "bootloader.h"
+#include "plan.h"
+#include "sim.h"
+#include "simdev.h"
+#include "opt_output.h"
+
+
+#define	UHID_VID					0x8282		// conf_usb.h
+#define	UHID_PID					0xB71D
+#define	UHID_RELEASE				0x0100
+#define	UHID_NAME					"Keio USB Bootloader"
+#define	UHID_DEFAULT_SERIAL			"UHID00000001"
+#define	UHID_RESET_MS				128			// watchdog period after CMD_RESET_MCU
+#define	UHID_REATTACH_MS			1000		// application start up and jump back to the bootloader, with -k
+#define	UHID_POLL_MS				100
+
+
+typedef struct {
+	const char	*name;
+	uint8_t		signature[3];
+	uint32_t	flash_size;						// application section
+	uint16_t	page_size;
+	uint32_t	eeprom_size;
+	uint16_t	eeprom_page_size;
+} UHID_PART_t;
+
+typedef struct {
+	uint32_t	set_feature;
+	uint32_t	get_feature;
+	uint32_t	reports_out;
+	uint32_t	reports_in;
+	uint32_t	errors;						// commands that returned a failure result
+	uint32_t	resets;
+} UHID_STATS_t;
+
+
+// the report descriptor from firmware/hid_bootloader/udi_hid_generic.c: a 5 byte feature report
+// and 64 byte IN and OUT reports, no report IDs
+static const uint8_t report_descriptor[] = {
+	0x06, 0x00, 0xFF,		// Usage Page (Vendor Defined 0xFF00)
+	0x09, 0x01,				// Usage (1)
+	0xA1, 0x01,				// Collection (Application)
+	0x15, 0x00,				//   Logical Minimum (0)
+	0x26, 0xFF, 0x00,		//   Logical Maximum (255)
+	0x75, 0x08,				//   Report Size (8)
+	0x95, 0x05,				//   Report Count (5)
+	0x09, 0x00,				//   Usage (0)
+	0xB2, 0x02, 0x01,		//   Feature (Data, Variable, Absolute, Buffered Bytes)
+	0x95, 0x40,				//   Report Count (64)
+	0x09, 0x00,				//   Usage (0)
+	0x82, 0x02, 0x01,		//   Input (Data, Variable, Absolute, Buffered Bytes)
+	0x09, 0x00,				//   Usage (0)
+	0x92, 0x02, 0x01,		//   Output (Data, Variable, Absolute, Buffered Bytes)
+	0xC0					// End Collection
+};
+
+static const UHID_PART_t uhid_parts[] = {
+	{ "atxmega128a4u", { 0x1E, 0x97, 0x46 }, 128 * 1024, 256, 2048, 32 },
+	{ "atxmega256a3bu", { 0x1E, 0x98, 0x43 }, 256 * 1024, 512, 4096, 32 },
+	{ NULL }
+};
+
+
+bool opt_quiet = false;
+bool opt_silent = false;
+OPT_THREAD bool opt_thread_silent = false;
+bool opt_verbose = false;
+bool opt_no_delay = false;
+bool opt_keep = false;
+bool opt_legacy = false;
+
+volatile sig_atomic_t stop = 0;
+bool created = false;
+SIMDEV_t dev;
+UHID_STATS_t stats;
+uint64_t origin_us;
+
+
+/**************************************************************************************************
+* Monotonic time in microseconds
+*/
+uint64_t NowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**************************************************************************************************
+* Bring the device's clock up to real time
+*/
+void SyncClock(void)
+{
+	uint64_t now = NowUs() - origin_us;
+	if (dev.clock_us < now)
+		dev.clock_us = now;
+}
+
+/**************************************************************************************************
+* Wait out a stall, the time the handler spent waiting for the NVM controller
+*/
+void WaitClock(void)
+{
+	if (opt_no_delay)
+		return;
+	uint64_t now = NowUs() - origin_us;
+	if (dev.clock_us > now)
+		usleep((useconds_t)(dev.clock_us - now));
+}
+
+/**************************************************************************************************
+* SIGINT and SIGTERM
+*/
+void Stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/**************************************************************************************************
+* Send an event to the kernel
+*/
+bool SendEvent(int fd, struct uhid_event *ev)
+{
+	ssize_t res = write(fd, ev, sizeof(struct uhid_event));
+	if (res < 0)
+	{
+		silent_printf("uhid write failed: %s\n", strerror(errno));
+		return false;
+	}
+	if (res != sizeof(struct uhid_event))
+	{
+		silent_printf("uhid write was short (%d of %d bytes)\n", (int)res, (int)sizeof(struct uhid_event));
+		return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Create the device
+*/
+bool CreateDevice(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strncpy((char *)ev.u.create2.name, UHID_NAME, sizeof(ev.u.create2.name) - 1);
+	strncpy((char *)ev.u.create2.phys, "uhid_bootloader", sizeof(ev.u.create2.phys) - 1);
+	snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "%s", dev.serial);
+	memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+	ev.u.create2.rd_size = sizeof(report_descriptor);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = UHID_VID;
+	ev.u.create2.product = UHID_PID;
+	ev.u.create2.version = UHID_RELEASE;
+	ev.u.create2.country = 0;
+	if (!SendEvent(fd, &ev))
+		return false;
+
+	created = true;
+	quiet_printf("Created %04X:%04X \"%s\", serial %s\n", UHID_VID, UHID_PID, UHID_NAME, dev.serial);
+	return true;
+}
+
+/**************************************************************************************************
+* Destroy the device, like unplugging it
+*/
+bool DestroyDevice(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	created = false;
+	return SendEvent(fd, &ev);
+}
+
+/**************************************************************************************************
+* Send the response to the last command as an IN report, if it has one
+*/
+bool SendReportIn(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	if (!SimDevReportIn(&dev, ev.u.input2.data))
+		return true;
+	ev.u.input2.size = HID_DATA_BYTES;
+	stats.reports_in++;
+	return SendEvent(fd, &ev);
+}
+
+/**************************************************************************************************
+* Handle an OUT report. hidraw passes the report ID, 0 for this device, in front of the data.
+*/
+void ReportOut(const uint8_t *data, uint16_t size)
+{
+	if (size == HID_DATA_BYTES + 1)
+	{
+		data++;
+		size--;
+	}
+	if (size != HID_DATA_BYTES)
+	{
+		if (opt_verbose)
+			printf("OUT report of %u bytes ignored\n", size);
+		return;
+	}
+
+	SyncClock();
+	SimDevReportOut(&dev, data);
+	stats.reports_out++;
+}
+
+/**************************************************************************************************
+* Handle a set feature report, a command. The data starts with the report ID.
+*/
+bool SetFeature(int fd, struct uhid_set_report_req *req)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_SET_REPORT_REPLY;
+	ev.u.set_report_reply.id = req->id;
+
+	// some stacks send OUT reports on the control pipe
+	if (req->rtype == UHID_OUTPUT_REPORT)
+	{
+		ReportOut(req->data, req->size);
+		return SendEvent(fd, &ev);
+	}
+
+	if ((req->rtype != UHID_FEATURE_REPORT) || (req->size < sizeof(BLCOMMAND_t)))
+	{
+		ev.u.set_report_reply.err = EIO;
+		return SendEvent(fd, &ev);
+	}
+
+	SyncClock();
+	SimDevSetFeature(&dev, &req->data[1]);
+	stats.set_feature++;
+	if (dev.result != 0)
+		stats.errors++;
+	if (opt_verbose)
+		printf("%10.3f  command 0x%02X  %02X %02X %02X %02X  result %u\n", dev.clock_us / 1000000.0,
+			   req->data[1], req->data[2], req->data[3], req->data[4], req->data[5], dev.result);
+
+	// the firmware doesn't complete the status stage until the handler returns
+	WaitClock();
+	if (!SendEvent(fd, &ev))
+		return false;
+	return SendReportIn(fd);
+}
+
+/**************************************************************************************************
+* Handle a get feature report, the status of the last command
+*/
+bool GetFeature(int fd, struct uhid_get_report_req *req)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_GET_REPORT_REPLY;
+	ev.u.get_report_reply.id = req->id;
+	if (req->rtype != UHID_FEATURE_REPORT)
+	{
+		ev.u.get_report_reply.err = EIO;
+		return SendEvent(fd, &ev);
+	}
+
+	SyncClock();
+	SimDevGetFeature(&dev, (BLSTATUS_t *)ev.u.get_report_reply.data);
+	ev.u.get_report_reply.size = sizeof(BLSTATUS_t);
+	stats.get_feature++;
+	return SendEvent(fd, &ev);
+}
+
+/**************************************************************************************************
+* Handle one event from the kernel. False on a fatal error.
+*/
+bool HandleEvent(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ssize_t res = read(fd, &ev, sizeof(ev));
+	if (res == 0)
+	{
+		silent_printf("uhid closed\n");
+		return false;
+	}
+	if (res < 0)
+	{
+		if ((errno == EINTR) || (errno == EAGAIN))
+			return true;
+		silent_printf("uhid read failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	switch (ev.type)
+	{
+	case UHID_START:
+	case UHID_STOP:
+		break;
+
+	case UHID_OPEN:
+		if (opt_verbose)
+			printf("Opened\n");
+		break;
+
+	case UHID_CLOSE:
+		if (opt_verbose)
+			printf("Closed\n");
+		break;
+
+	case UHID_OUTPUT:
+		ReportOut(ev.u.output.data, ev.u.output.size);
+		break;
+
+	case UHID_GET_REPORT:
+		return GetFeature(fd, &ev.u.get_report);
+
+	case UHID_SET_REPORT:
+		return SetFeature(fd, &ev.u.set_report);
+
+	default:
+		if (opt_verbose)
+			printf("Event %u ignored\n", ev.type);
+		break;
+	}
+
+	return true;
+}
+
+/**************************************************************************************************
+* Sleep unless delays are off, waking early on a signal
+*/
+void Delay(uint32_t ms)
+{
+	if (opt_no_delay)
+		return;
+	while ((ms > 0) && (!stop))
+	{
+		uint32_t step = (ms < UHID_POLL_MS) ? ms : UHID_POLL_MS;
+		usleep(step * 1000);
+		ms -= step;
+	}
+}
+
+/**************************************************************************************************
+* Find a part by name
+*/
+const UHID_PART_t *FindPart(const char *name)
+{
+	for (int i = 0; uhid_parts[i].name != NULL; i++)
+	{
+		if (strcmp(uhid_parts[i].name, name) == 0)
+			return &uhid_parts[i];
+	}
+	return NULL;
+}
+
+/**************************************************************************************************
+* Print usage and exit
+*/
+void Usage(void)
+{
+	printf("Usage: uhid_bootloader [-d image.hex] [-p part] [-s serial] [-k] [-l] [-n] [-q] [-v]\n");
+	printf("\t-d\tpreload flash with an image, which also sets the part\n");
+	printf("\t-p\tpart, atxmega128a4u or atxmega256a3bu (default)\n");
+	printf("\t-s\tserial number (default %s)\n", UHID_DEFAULT_SERIAL);
+	printf("\t-k\tcome back as the bootloader after CMD_RESET_MCU, instead of exiting\n");
+	printf("\t-l\tlegacy, a version 1 bootloader that doesn't report its capabilities\n");
+	printf("\t-n\tno delays, flash operations complete instantly\n");
+	printf("\t-q\tquiet\n");
+	printf("\t-v\tverbose, log every command\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const UHID_PART_t *part = FindPart("atxmega256a3bu");
+	char *image_file = NULL;
+	char *serial = UHID_DEFAULT_SERIAL;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:klnp:qs:v")) != -1)
+	{
+		switch (c)
+		{
+		case 'd':
+			image_file = optarg;
+			break;
+		case 'k':
+			opt_keep = true;
+			break;
+		case 'l':
+			opt_legacy = true;
+			break;
+		case 'n':
+			opt_no_delay = true;
+			break;
+		case 'p':
+			part = FindPart(optarg);
+			if (part == NULL)
+			{
+				printf("Unknown part %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'q':
+			opt_quiet = true;
+			break;
+		case 's':
+			serial = optarg;
+			break;
+		case 'v':
+			opt_verbose = true;
+			break;
+		default:
+			Usage();
+		}
+	}
+	if (optind != argc)
+		Usage();
+
+	// the image's embedded info describes its part
+	UHID_PART_t image_part;
+	if (image_file != NULL)
+	{
+		if (!ReadHexFile(image_file))
+			return 1;
+		image_part.name = "image";
+		memcpy(image_part.signature, fw_info->mcu_signature, sizeof(image_part.signature));
+		image_part.flash_size = fw_info->flash_size_b;
+		image_part.page_size = fw_info->page_size_b;
+		image_part.eeprom_size = fw_info->eeprom_size_b;
+		image_part.eeprom_page_size = fw_info->eeprom_page_size_b;
+		part = &image_part;
+	}
+
+	uint8_t mcu_id[4] = { part->signature[0], part->signature[1], part->signature[2], 0 };
+	if (!SimDevInit(&dev, part->flash_size, part->page_size, part->eeprom_size, part->eeprom_page_size, mcu_id, serial))
+	{
+		printf("Out of memory\n");
+		return 1;
+	}
+	if (image_file != NULL)
+		memcpy(dev.flash, firmware_buffer, part->flash_size);
+	dev.legacy = opt_legacy;
+	quiet_printf("%s, %lu KB flash, %u byte pages, %lu byte EEPROM\n", part->name,
+				 (unsigned long)(part->flash_size / 1024), part->page_size, (unsigned long)part->eeprom_size);
+
+	int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("Unable to open /dev/uhid: %s\n", strerror(errno));
+		SimDevFree(&dev);
+		return 1;
+	}
+
+	signal(SIGINT, Stop);
+	signal(SIGTERM, Stop);
+
+	origin_us = NowUs();
+	bool ok = CreateDevice(fd);
+	while (ok && !stop)
+	{
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int res = poll(&pfd, 1, UHID_POLL_MS);
+		if (res < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			printf("poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (res > 0)
+			ok = HandleEvent(fd);
+
+		// the watchdog resets the MCU and it drops off the bus
+		if (ok && dev.reset)
+		{
+			Delay(UHID_RESET_MS);
+			ok = DestroyDevice(fd);
+			stats.resets++;
+			quiet_printf("Reset\n");
+			if (!opt_keep)
+				break;
+
+			Delay(UHID_REATTACH_MS);
+			dev.reset = false;
+			dev.page_ptr = 0;
+			dev.result = 0;
+			dev.response_count = 0;
+			if (ok && !stop)
+				ok = CreateDevice(fd);
+		}
+	}
+
+	if (created)
+		DestroyDevice(fd);
+	close(fd);
+
+	quiet_printf("\nCommands:\t%lu (%lu failed)\n", (unsigned long)stats.set_feature, (unsigned long)stats.errors);
+	quiet_printf("Status reads:\t%lu\n", (unsigned long)stats.get_feature);
+	quiet_printf("Reports:\t%lu out, %lu in\n", (unsigned long)stats.reports_out, (unsigned long)stats.reports_in);
+	quiet_printf("Flash busy:\t%.3f s\n", dev.flash_us / 1000000.0);
+	quiet_printf("Resets:\t\t%lu\n", (unsigned long)stats.resets);
+
+	SimDevFree(&dev);
+	return ok ? 0 : 1;
+}
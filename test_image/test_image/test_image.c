@@ -9,6 +9,17 @@
 
 #define VERSION_MAJOR	1
 #define VERSION_MINOR	0
+#define BUILD_ID		0xFFFFFFFF		// left erased, the post-link tool derives one from the image
+
+#define PAGE_MAP_BYTES	32
+
+// written to the last four bytes of SRAM before a reset to stay in the bootloader, see protocol.h
+#define BOOT_REQUEST_MAGIC	0x4C424448		// "HDBL"
+#define BOOT_REQUEST_ADDR	(RAMEND - 3)
+
+// sending this character to USARTC0 (PC2, 9600 8N1) restarts in the bootloader
+#define BOOT_COMMAND		'B'
+#define USART_BSEL			12				// 9600 baud from the 2MHz reset clock
 
 
 typedef struct {
@@ -20,6 +31,14 @@ typedef struct {
 	uint16_t	page_size_b;
 	uint32_t	eeprom_size_b;
 	uint16_t	eeprom_page_size_b;
+
+	// v2, filled in after linking by "hid_bootloader -p <patched.hex> test_image.hex"
+	char		v2_magic[4];
+	uint16_t	info_size;
+	uint32_t	image_length;
+	uint32_t	image_crc;
+	uint32_t	build_id;
+	uint8_t		page_map[PAGE_MAP_BYTES];
 } FW_INFO_t;
 
 
@@ -31,13 +50,41 @@ volatile const __flash FW_INFO_t firmware_info =	{	{ 0x59, 0x61, 0x6d, 0x61, 0x4
 														APP_SECTION_SIZE,
 														APP_SECTION_PAGE_SIZE,
 														EEPROM_SIZE,
-														EEPROM_PAGE_SIZE
+														EEPROM_PAGE_SIZE,
+														{ 0x46, 0x77, 0x49, 0x32 },									// "FwI2"
+														sizeof(FW_INFO_t),
+														0xFFFFFFFF,
+														0xFFFFFFFF,
+														BUILD_ID,
+														{ [0 ... PAGE_MAP_BYTES - 1] = 0xFF }
 													};
 
 
+/**************************************************************************************************
+* Reset into the bootloader. The bootloader reads the request before anything is pushed to the
+* stack, so it survives the reset.
+*/
+void EnterBootloader(void) __attribute__ ((noreturn));
+void EnterBootloader(void)
+{
+	*(volatile uint32_t *)BOOT_REQUEST_ADDR = BOOT_REQUEST_MAGIC;
+	CCP = CCP_IOREG_gc;
+	RST.CTRL = RST_SWRST_bm;
+	for(;;);
+}
+
 int main(void)
 {
 	firmware_info.magic_string[0];	// prevent firmware_info being optimized away
 
-	for(;;);
+	USARTC0.BAUDCTRLA = USART_BSEL;
+	USARTC0.BAUDCTRLB = 0;
+	USARTC0.CTRLC = USART_CHSIZE_8BIT_gc;
+	USARTC0.CTRLB = USART_RXEN_bm;
+
+	for(;;)
+	{
+		if ((USARTC0.STATUS & USART_RXCIF_bm) && (USARTC0.DATA == BOOT_COMMAND))
+			EnterBootloader();
+	}
 }
\ No newline at end of file